@@ -10,28 +10,20 @@ public:
     aabb(){};
 
     // optimize to not have to copy hittable list
-    aabb(const point3& min, const point3& max) : mMin{min}, mMax{max}, mSize{ max - min } {}
+    aabb(const point3& min, const point3& max) : mMin{min}, mMax{max} {}
 
     point3& min() {return mMin;}
     point3& max()  {return mMax;}
-    vec3& size() {return mSize;}
+    const point3& min() const {return mMin;}
+    const point3& max() const {return mMax;}
+    vec3 size() const {return mMax - mMin;}
 
-    float hit(const ray& r)
+    float hit(const ray& r) const
     {
-        float tx1 = (mMin.x() - r.origin().x()) * r.invDirection().x();
-        float tx2 = (mMax.x() - r.origin().x()) * r.invDirection().x();
-        float tMin = std::min(tx1, tx2);
-        float tMax = std::max(tx1, tx2);
-
-        float ty1 = (mMin.y() - r.origin().y()) * r.invDirection().y();
-        float ty2 = (mMax.y() - r.origin().y()) * r.invDirection().y();
-        tMin = std::max(tMin, std::min(ty1, ty2));
-        tMax = std::min(tMax, std::max(ty1, ty2));
-
-        float tz1 = (mMin.z() - r.origin().z()) * r.invDirection().z();
-        float tz2 = (mMax.z() - r.origin().z()) * r.invDirection().z();
-        tMin = std::max(tMin, std::min(tz1, tz2));
-        tMax = std::min(tMax, std::max(tz1, tz2));
+        float4 t1 = (float4::load3(mMin) - r.origin4()) * r.invDirection4();
+        float4 t2 = (float4::load3(mMax) - r.origin4()) * r.invDirection4();
+        float tMin = hmax3(::min(t1, t2));
+        float tMax = hmin3(::max(t1, t2));
 
         if(tMax >= tMin && tMin < r.t && tMax > 0.0f)
             return tMin;
@@ -39,6 +31,26 @@ public:
             return infinity;
     }
 
+    // Slab test against two boxes at once (a in the low lanes, b in the high lanes), used for the
+    // child pairs during traversal
+    static void hit2(const aabb& a, const aabb& b, const ray& r, float& hitA, float& hitB)
+    {
+        float8 o {r.origin4(), r.origin4()};
+        float8 invD {r.invDirection4(), r.invDirection4()};
+        float8 t1 = (float8{float4::load3(a.mMin), float4::load3(b.mMin)} - o) * invD;
+        float8 t2 = (float8{float4::load3(a.mMax), float4::load3(b.mMax)} - o) * invD;
+        float8 tNear = ::min(t1, t2);
+        float8 tFar = ::max(t1, t2);
+
+        float tMinA = hmax3(tNear.lo());
+        float tMaxA = hmin3(tFar.lo());
+        float tMinB = hmax3(tNear.hi());
+        float tMaxB = hmin3(tFar.hi());
+
+        hitA = (tMaxA >= tMinA && tMinA < r.t && tMaxA > 0.0f) ? tMinA : infinity;
+        hitB = (tMaxB >= tMinB && tMinB < r.t && tMaxB > 0.0f) ? tMinB : infinity;
+    }
+
     bool intersects(aabb& b)
     {
         return (mMin.x() <= b.max().x()) && (mMax.x() >= b.min().x()) &&
@@ -52,7 +64,7 @@ public:
         mMax = vmax(mMax, p);
     }
 
-    void grow(aabb& b)
+    void grow(const aabb& b)
     {
         if(b.min() == vec3::posInf())
             return;
@@ -61,16 +73,20 @@ public:
         grow(b.max());
     }
 
-    float area()
+    float area() const
     {
+        if(mMin.x() > mMax.x())
+            return 0.0f;
+
         vec3 e {mMax - mMin};
         return e.x() * e.y() + e.y() * e.z() + e.z() * e.x();
     }
 
 private:
-    point3 mMin{};
-    point3 mMax{};
-    vec3 mSize{};
+    // Only the corners are stored so a BVH node with its bounds packs into 32 bytes. A default
+    // constructed box is empty, anything grown into it replaces the corners.
+    point3 mMin{infinity};
+    point3 mMax{-infinity};
 };
 
 #endif
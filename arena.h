@@ -0,0 +1,150 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <cstddef>
+#include <mutex>
+#include <new>
+#include <ostream>
+#include <type_traits>
+#include <vector>
+
+// What an arena allocation holds, only used for the memory report
+enum class arenaTag
+{
+    geometry,
+    meshIndices,
+    texcoords,
+    opacity,
+    indices,
+    bvhNodes,
+    tlasNodes,
+    models,
+    count
+};
+
+inline const char* arenaTagName(arenaTag tag)
+{
+    switch(tag)
+    {
+        case arenaTag::geometry: return "vertices";
+        case arenaTag::meshIndices: return "mesh indices";
+        case arenaTag::texcoords: return "texcoords";
+        case arenaTag::opacity: return "opacity classes";
+        case arenaTag::indices: return "bvh indices";
+        case arenaTag::bvhNodes: return "bvh nodes";
+        case arenaTag::tlasNodes: return "tlas nodes";
+        case arenaTag::models: return "models";
+        default: return "unknown";
+    }
+}
+
+// Bump allocator owning everything a scene needs for its whole lifetime. Memory is handed out from
+// large blocks and only given back all at once by release(), so only trivially destructible types
+// may live in it. Allocation is thread safe so BLAS builds can run in parallel.
+class sceneArena
+{
+public:
+    static constexpr size_t alignment = 64;
+
+    explicit sceneArena(size_t blockSize = 64 << 20) : blockSize(blockSize) {}
+    sceneArena(const sceneArena&) = delete;
+    sceneArena& operator=(const sceneArena&) = delete;
+    ~sceneArena() { release(); }
+
+    // Makes sure the next `bytes` worth of allocations come out of a single block
+    void reserve(size_t bytes)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if(blocks.empty() || blocks.back().size - blocks.back().used < bytes)
+            addBlock(bytes);
+    }
+
+    // Uninitialized, cache line aligned storage for count objects of T
+    template <typename T>
+    T* allocate(size_t count, arenaTag tag)
+    {
+        static_assert(std::is_trivially_destructible<T>::value, "arena objects are never destroyed");
+
+        size_t bytes = count * sizeof(T);
+        std::lock_guard<std::mutex> lock(mutex);
+        if(blocks.empty() || !fits(blocks.back(), bytes))
+            addBlock(bytes > blockSize ? bytes : blockSize);
+
+        block& b = blocks.back();
+        size_t offset = alignUp(b.used);
+        b.used = offset + bytes;
+        used += bytes;
+        tagBytes[(int)tag] += bytes;
+
+        return reinterpret_cast<T*>(b.data + offset);
+    }
+
+    // Like allocate but default constructs every element
+    template <typename T>
+    T* create(size_t count, arenaTag tag)
+    {
+        T* p = allocate<T>(count, tag);
+        for(size_t i = 0; i < count; i++)
+            new (p + i) T();
+        return p;
+    }
+
+    void release()
+    {
+        for(block& b : blocks)
+            ::operator delete(b.data, std::align_val_t{alignment});
+
+        blocks.clear();
+        reserved = 0;
+        used = 0;
+        for(size_t& t : tagBytes)
+            t = 0;
+    }
+
+    size_t bytesReserved() const { return reserved; }
+    size_t bytesUsed() const { return used; }
+    size_t bytesUsed(arenaTag tag) const { return tagBytes[(int)tag]; }
+    size_t blockCount() const { return blocks.size(); }
+
+    void report(std::ostream& out) const
+    {
+        const double mb = 1.0 / (1024.0 * 1024.0);
+        out << "SCENE MEMORY: " << bytesUsed() * mb << " MB used of " << bytesReserved() * mb << " MB in "
+            << blockCount() << " block(s)\n";
+
+        for(int i = 0; i < (int)arenaTag::count; i++)
+            out << "  " << arenaTagName((arenaTag)i) << ": " << tagBytes[i] * mb << " MB\n";
+    }
+
+    // Upper bound on the padding a single allocation can add
+    static size_t slack(size_t allocations) { return allocations * alignment; }
+
+private:
+    struct block
+    {
+        unsigned char* data;
+        size_t size;
+        size_t used;
+    };
+
+    std::vector<block> blocks;
+    std::mutex mutex;
+    size_t blockSize;
+    size_t reserved = 0;
+    size_t used = 0;
+    size_t tagBytes[(int)arenaTag::count] {};
+
+    static size_t alignUp(size_t offset) { return (offset + alignment - 1) & ~(alignment - 1); }
+
+    static bool fits(const block& b, size_t bytes) { return alignUp(b.used) + bytes <= b.size; }
+
+    void addBlock(size_t bytes)
+    {
+        bytes = alignUp(bytes);
+        unsigned char* data = static_cast<unsigned char*>(::operator new(bytes, std::align_val_t{alignment}));
+        blocks.push_back({data, bytes, 0});
+        reserved += bytes;
+    }
+};
+
+#endif
@@ -0,0 +1,138 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "camera.h"
+#include "scheduler.h"
+#include "stats.h"
+#include "tlas.h"
+
+// Several views of one scene rendered by one worker pool. Every view gets its own tile scheduler
+// and the workers drain them in order, so a worker that runs out of tiles in one view moves straight
+// on to the next instead of waiting for the frame's slowest tile. Only the last view splits slow
+// tiles, the others have the next view's tiles to hide their tail behind.
+inline void renderBatch(std::vector<camera>& views, tlas& t, int threadCount)
+{
+    int workers = threadCount > 0 ? threadCount : std::max(1, (int)std::thread::hardware_concurrency());
+    int viewCount = (int)views.size();
+
+    std::unique_ptr<tileScheduler[]> schedulers(new tileScheduler[viewCount]);
+    std::vector<framebuffer> outputs(viewCount);
+    for(int i = 0; i < viewCount; i++)
+    {
+        camera& view = views[i];
+        view.prepare();
+        outputs[i] = framebuffer(view.imageWidth, view.height(), view.framebufferFormat);
+
+        tileScheduler& scheduler = schedulers[i];
+        scheduler.order = view.tileOrdering;
+        scheduler.tileSize = view.tileSize;
+        scheduler.splitExpensive = view.splitTiles && i == viewCount - 1;
+        scheduler.build(view.imageWidth, view.height(), workers);
+    }
+
+    std::atomic<int> current {0};
+    statsAccumulator stats;
+    auto worker = [&]()
+    {
+        threadStats() = {};
+        for(int i = current; i < viewCount; i = current)
+        {
+            tile tl;
+            if(schedulers[i].next(tl))
+                renderScheduledTile(schedulers[i], tl, t, views[i], outputs[i]);
+            else
+                current.compare_exchange_strong(i, i + 1);
+        }
+        stats.add(threadStats());
+    };
+
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> threadPool;
+    for(int i = 0; i < workers; i++)
+        threadPool.emplace_back(worker);
+    for(auto& thread : threadPool)
+        thread.join();
+    double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+    int tiles = 0;
+    for(int i = 0; i < viewCount; i++)
+    {
+        tiles += schedulers[i].tileCount();
+        views[i].writeImage(outputs[i]);
+    }
+
+    std::cout << "BATCH: " << viewCount << " view(s), " << tiles << " tiles in one queue, " << ms << " ms ("
+              << (viewCount > 0 ? ms / viewCount : 0.0) << " ms per view)\n";
+    stats.result().report(std::cout, ms);
+    for(const framebuffer& output : outputs)
+        output.report(std::cout);
+    if(!views.empty() && views[0].materials && views[0].materials->textures.count() > 0)
+        views[0].materials->textures.report(std::cout, stats.result().textureLookups);
+}
+
+// Output path of view i of a batch, e.g. output.ppm -> output_px.ppm or output_3.ppm
+inline std::string viewOutputPath(const std::string& base, const std::string& suffix)
+{
+    size_t dot = base.rfind('.');
+    if(dot == std::string::npos)
+        return base + "_" + suffix;
+    return base.substr(0, dot) + "_" + suffix + base.substr(dot);
+}
+
+// Left and right eye, offset along the camera's right vector and looking parallel
+inline std::vector<camera> stereoViews(const camera& base, float eyeSeparation)
+{
+    vec3 right = cross(base.lookAt - base.lookFrom, base.vUp).normalize() * (0.5f * eyeSeparation);
+    std::vector<camera> views(2, base);
+    views[0].lookFrom = base.lookFrom - right;
+    views[0].lookAt = base.lookAt - right;
+    views[0].outputPath = viewOutputPath(base.outputPath, "left");
+    views[1].lookFrom = base.lookFrom + right;
+    views[1].lookAt = base.lookAt + right;
+    views[1].outputPath = viewOutputPath(base.outputPath, "right");
+    return views;
+}
+
+// Six square 90 degree faces around the camera position
+inline std::vector<camera> cubemapViews(const camera& base)
+{
+    const vec3 directions[6] = {{1, 0, 0}, {-1, 0, 0}, {0, 1, 0}, {0, -1, 0}, {0, 0, 1}, {0, 0, -1}};
+    const vec3 ups[6] = {{0, 1, 0}, {0, 1, 0}, {0, 0, -1}, {0, 0, 1}, {0, 1, 0}, {0, 1, 0}};
+    const char* names[6] = {"px", "nx", "py", "ny", "pz", "nz"};
+
+    std::vector<camera> views(6, base);
+    for(int i = 0; i < 6; i++)
+    {
+        views[i].aspectRatio = 1.0;
+        views[i].vfov = 90;
+        views[i].lookAt = base.lookFrom + directions[i];
+        views[i].vUp = ups[i];
+        views[i].outputPath = viewOutputPath(base.outputPath, names[i]);
+    }
+    return views;
+}
+
+// frames views orbiting the look at point at the camera's distance and height
+inline std::vector<camera> turntableViews(const camera& base, int frames)
+{
+    vec3 offset = base.lookFrom - base.lookAt;
+    std::vector<camera> views(std::max(frames, 0), base);
+    for(int i = 0; i < frames; i++)
+    {
+        float angle = 2.0f * pi * i / frames;
+        float c = std::cos(angle);
+        float s = std::sin(angle);
+        views[i].lookFrom = base.lookAt + vec3{c * offset.x() + s * offset.z(), offset.y(), -s * offset.x() + c * offset.z()};
+        views[i].outputPath = viewOutputPath(base.outputPath, std::to_string(i));
+    }
+    return views;
+}
+
+#endif
@@ -2,11 +2,17 @@
 #define BVH_H
 
 #include "aabb.h"
+#include "arena.h"
+#include "bvhprofile.h"
+#include "mesh.h"
+#include "stats.h"
 #include "triangle.h"
 
-#include <stack>
+#include <algorithm>
 
-#define BINS 8
+// Entries of the fixed traversal stacks on the C++ stack. Ordered traversal pushes at most one node per
+// level, so trees up to this deep use them and deeper ones switch to stackless traversal.
+constexpr int traversalStackSize = 64;
 
 class bvh
 {
@@ -17,7 +23,8 @@ private:
         int triCount = 0;
     };
 
-    struct bvhNode
+    // 32 bytes and aligned so each child pair shares one 64 byte cache line
+    struct alignas(32) bvhNode
     {
         aabb bounds{};
         int leftFirst = 0;
@@ -25,15 +32,25 @@ private:
 
         bool isLeaf() { return triCount > 0; }
     };
+    static_assert(sizeof(bvhNode) == 32, "bvhNode should fill half a cache line");
 
-    std::vector<shared_ptr<triangle>>* triangles;
-    std::vector<int> triIndices{};
-    std::vector<bvhNode> bvhNodes{};
+    // Not owned, the mesh belongs to the model and both arrays live in the scene arena
+    const indexedMesh* mesh = nullptr;
+    int* triIndices = nullptr;
+    bvhNode* bvhNodes = nullptr;
     int triCount = 0;
     int nodesUsed = 1;
+    int depth = 1;                  // Levels of the tree, the root alone is 1
+    int* parents = nullptr;         // Parent of every node, only for stackless traversal
+    bvhBuildProfile profile{};
+
+    // Only valid during build, decoded once per triangle instead of on every builder pass
+    const point3* centroids = nullptr;
+    const aabb* triBounds = nullptr;
 
     float findBestSplitPlane(const bvhNode& node, int& axis, float& splitPos)
     {
+        const int binCount = std::min(std::max(profile.binCount, 2), bvhBuildProfile::maxBins);
         float bestCost = infinity;
         axis = 0;
         splitPos = 0;
@@ -43,48 +60,46 @@ private:
             float boundsMax = -infinity;
             for(int i = 0; i < node.triCount; i++)
             {
-                shared_ptr<triangle> t = (*triangles)[triIndices[node.leftFirst + i]];
-                boundsMin = std::min(boundsMin, t->centroid()[x]);
-                boundsMax = std::max(boundsMax, t->centroid()[x]);
+                const point3& c = centroids[triIndices[node.leftFirst + i]];
+                boundsMin = std::min(boundsMin, c[x]);
+                boundsMax = std::max(boundsMax, c[x]);
             }
 
             if(boundsMin == boundsMax)
                 continue;
 
-            bin bins[BINS];
-            float scale = BINS / (boundsMax - boundsMin);
+            bin bins[bvhBuildProfile::maxBins];
+            float scale = binCount / (boundsMax - boundsMin);
             for(int i = 0; i < node.triCount; i++)
             {
-                shared_ptr<triangle> t = (*triangles)[triIndices[node.leftFirst + i]];
-                int binIdx = std::min(BINS - 1, (int)((t->centroid()[x] - boundsMin) * scale));
+                int triIdx = triIndices[node.leftFirst + i];
+                int binIdx = std::min(binCount - 1, (int)((centroids[triIdx][x] - boundsMin) * scale));
                 bins[binIdx].triCount++;
-                bins[binIdx].bounds.grow(t->v0());
-                bins[binIdx].bounds.grow(t->v1());
-                bins[binIdx].bounds.grow(t->v2());
+                bins[binIdx].bounds.grow(triBounds[triIdx]);
             }
 
-            float leftArea[BINS - 1];
-            float rightArea[BINS - 1];
-            int leftCount[BINS - 1];
-            int rightCount[BINS - 1];
+            float leftArea[bvhBuildProfile::maxBins - 1];
+            float rightArea[bvhBuildProfile::maxBins - 1];
+            int leftCount[bvhBuildProfile::maxBins - 1];
+            int rightCount[bvhBuildProfile::maxBins - 1];
             aabb leftBox{};
             aabb rightBox{};
             int leftSum = 0;
             int rightSum = 0;
-            for(int i = 0; i < BINS - 1; i++)
+            for(int i = 0; i < binCount - 1; i++)
             {
                 leftSum += bins[i].triCount;
                 leftCount[i] = leftSum;
                 leftBox.grow(bins[i].bounds);
                 leftArea[i] = leftBox.area();
-                rightSum += bins[BINS - 1 - i].triCount;
-                rightCount[BINS - 2 - i] = rightSum;
-                rightBox.grow(bins[BINS - 1 - i].bounds);
-                rightArea[BINS - 2 - i] = rightBox.area();
+                rightSum += bins[binCount - 1 - i].triCount;
+                rightCount[binCount - 2 - i] = rightSum;
+                rightBox.grow(bins[binCount - 1 - i].bounds);
+                rightArea[binCount - 2 - i] = rightBox.area();
             }
 
-            scale = (boundsMax - boundsMin) / BINS;
-            for(int i = 0; i < BINS - 1; i++)
+            scale = (boundsMax - boundsMin) / binCount;
+            for(int i = 0; i < binCount - 1; i++)
             {
                 float planeCost = leftCount[i] * leftArea[i] + rightCount[i] * rightArea[i];
                 if(planeCost < bestCost)
@@ -98,11 +113,48 @@ private:
         return bestCost;
     }
 
-    float calculateNodeCost(bvhNode& node)
+    // Exact SAH over every object split, sorting the node's triangles by centroid on each axis.
+    // Only used for small nodes where the binned estimate is too coarse.
+    float findBestSplitSweep(const bvhNode& node, int& axis, float& splitPos)
     {
-        vec3 e {node.bounds.max() - node.bounds.min()};
-        float parentArea = e.x() * e.y() + e.y() * e.z() + e.z() * e.x();
-        return node.triCount * parentArea;
+        float bestCost = infinity;
+        axis = 0;
+        splitPos = 0;
+
+        std::vector<int> sorted(triIndices + node.leftFirst, triIndices + node.leftFirst + node.triCount);
+        std::vector<float> rightArea(node.triCount);
+        for(int x = 0; x < 3; x++)
+        {
+            std::sort(sorted.begin(), sorted.end(), [&](int a, int b) { return centroids[a][x] < centroids[b][x]; });
+
+            aabb rightBox{};
+            for(int i = node.triCount - 1; i > 0; i--)
+            {
+                rightBox.grow(triBounds[sorted[i]]);
+                rightArea[i] = rightBox.area();
+            }
+
+            aabb leftBox{};
+            for(int i = 1; i < node.triCount; i++)
+            {
+                leftBox.grow(triBounds[sorted[i - 1]]);
+
+                // The partition in subdivide compares against splitPos, so identical centroids can't be separated
+                float c0 = centroids[sorted[i - 1]][x];
+                float c1 = centroids[sorted[i]][x];
+                if(c0 == c1)
+                    continue;
+
+                float planeCost = i * leftBox.area() + (node.triCount - i) * rightArea[i];
+                if(planeCost < bestCost)
+                {
+                    splitPos = 0.5f * (c0 + c1);
+                    axis = x;
+                    bestCost = planeCost;
+                }
+            }
+        }
+        return bestCost;
     }
 
     void updateNodeBounds(int nodeIdx)
@@ -113,34 +165,40 @@ private:
         int first = node.leftFirst;
         for(int i = 0; i < node.triCount; i++)
         {
-            int modIndex = triIndices[first + i];
-            shared_ptr<triangle> t = (*triangles)[modIndex];
-            node.bounds.min() = vmin(node.bounds.min(), t->v0());
-            node.bounds.min() = vmin(node.bounds.min(), t->v1());
-            node.bounds.min() = vmin(node.bounds.min(), t->v2());
-            node.bounds.max() = vmax(node.bounds.max(), t->v0());
-            node.bounds.max() = vmax(node.bounds.max(), t->v1());
-            node.bounds.max() = vmax(node.bounds.max(), t->v2());
+            const aabb& t = triBounds[triIndices[first + i]];
+            node.bounds.min() = vmin(node.bounds.min(), t.min());
+            node.bounds.max() = vmax(node.bounds.max(), t.max());
         }
     }
 
-    void subdivide(int nodeIdx)
+    void subdivide(int nodeIdx, int level)
     {
         bvhNode& node = bvhNodes[nodeIdx];
+        depth = std::max(depth, level);
+
+        if(node.triCount <= 1)
+            return;
 
         int axis{};
         float splitPos{};
-        float splitCost = findBestSplitPlane(node, axis, splitPos);
-        float noSplitCost = calculateNodeCost(node);
+        float split = node.triCount < profile.fullSweepBelow ? findBestSplitSweep(node, axis, splitPos)
+                                                              : findBestSplitPlane(node, axis, splitPos);
+        if(split == infinity)
+            return;
+
+        // Costs are left unnormalized by the parent area, which is common to both sides
+        float parentArea = node.bounds.area();
+        float splitCost = profile.traversalCost * parentArea + profile.intersectCost * split;
+        float noSplitCost = profile.intersectCost * node.triCount * parentArea;
 
-        if(splitCost >= noSplitCost)
+        if(splitCost >= noSplitCost && node.triCount <= profile.maxLeafSize)
             return;
 
         int i = node.leftFirst;
         int j = i + node.triCount - 1;
         while(i <= j)
         {
-            if((*triangles)[triIndices[i]]->centroid()[axis] < splitPos)
+            if(centroids[triIndices[i]][axis] < splitPos)
             {
                 i++;
             }
@@ -167,12 +225,25 @@ private:
         updateNodeBounds(leftChildIndex);
         updateNodeBounds(rightChildIndex);
 
-        subdivide(leftChildIndex);
-        subdivide(rightChildIndex);
+        subdivide(leftChildIndex, level + 1);
+        subdivide(rightChildIndex, level + 1);
     }
 
     void build()
     {
+        std::vector<point3> centroidBuffer(triCount);
+        std::vector<aabb> boundsBuffer(triCount);
+        for(int i = 0; i < triCount; i++)
+        {
+            triangle t = mesh->get(i);
+            centroidBuffer[i] = t.centroid();
+            boundsBuffer[i].grow(t.v0());
+            boundsBuffer[i].grow(t.v1());
+            boundsBuffer[i].grow(t.v2());
+        }
+        centroids = centroidBuffer.data();
+        triBounds = boundsBuffer.data();
+
         nodesUsed = 2;
 
         for(int i = 0; i < triCount; i++) 
@@ -183,41 +254,105 @@ private:
         root.triCount = triCount;
 
         updateNodeBounds(0);
-        subdivide(0);
+        depth = 1;
+        subdivide(0, 1);
 
         bvhBounds = {root.bounds.min(), root.bounds.max()};
+
+        centroids = nullptr;
+        triBounds = nullptr;
     }
-public:
-    aabb bvhBounds{};
 
-    bvh(){};
+    void reportNode(int idx, int depth, float rootArea, bvhReport& rep, std::vector<int>& rangeFirst, std::vector<int>& rangeLast) const
+    {
+        const bvhNode& n = bvhNodes[idx];
+        rep.nodes++;
+        rep.maxDepth = std::max(rep.maxDepth, depth);
+
+        float relArea = n.bounds.area() / rootArea;
+        if(n.triCount > 0)
+        {
+            rep.leaves++;
+            rep.triangles += n.triCount;
+            rep.leafHistogram[bvhReport::bucket(n.triCount)]++;
+            rep.sahCost += relArea * n.triCount;
+            rangeFirst[idx] = n.leftFirst;
+            rangeLast[idx] = n.leftFirst + n.triCount;
+            return;
+        }
+
+        rep.sahCost += relArea;
+        reportNode(n.leftFirst, depth + 1, rootArea, rep, rangeFirst, rangeLast);
+        reportNode(n.leftFirst + 1, depth + 1, rootArea, rep, rangeFirst, rangeLast);
+        rangeFirst[idx] = std::min(rangeFirst[n.leftFirst], rangeFirst[n.leftFirst + 1]);
+        rangeLast[idx] = std::max(rangeLast[n.leftFirst], rangeLast[n.leftFirst + 1]);
+    }
 
-    bvh(std::vector<shared_ptr<triangle>>* t, int N) : triangles(t), triCount(N)
+    // Fraction of box a that lies inside box b, flat axes count as fully inside
+    static float overlapFraction(const aabb& a, const aabb& b)
     {
-        triIndices.resize(N);
-        bvhNodes.resize(2 * N);
-        build();
+        float fraction = 1.0f;
+        for(int x = 0; x < 3; x++)
+        {
+            float lo = std::max(a.min()[x], b.min()[x]);
+            float hi = std::min(a.max()[x], b.max()[x]);
+            if(hi < lo)
+                return 0.0f;
+
+            float extent = a.max()[x] - a.min()[x];
+            if(extent > 1e-12f)
+                fraction *= (hi - lo) / extent;
+        }
+        return fraction;
     }
 
-    void hit(ray& r)
+    void fillParents()
+    {
+        parents[0] = -1;
+        for(int i = 0; i < nodesUsed; i++)
+        {
+            if(i != 1 && !bvhNodes[i].isLeaf())
+            {
+                parents[bvhNodes[i].leftFirst] = i;
+                parents[bvhNodes[i].leftFirst + 1] = i;
+            }
+        }
+    }
+
+    void intersectLeaf(bvhNode* n, ray& r, const alphaTest* alpha) const
+    {
+        if(alpha)
+        {
+            for(int i = 0; i < n->triCount; i++)
+                mesh->hitMasked(r, triIndices[n->leftFirst + i], *alpha);
+        }
+        else
+        {
+            for(int i = 0; i < n->triCount; i++)
+            {
+                int triIdx = triIndices[n->leftFirst + i];
+                mesh->hit(r, triIdx);
+            }
+        }
+    }
+
+    // Ordered traversal with the far child of every pair pushed on a fixed array, no heap involved
+    void hitStack(ray& r, const alphaTest* alpha) const
     {
         bvhNode* n = &bvhNodes[0];
-        std::stack<bvhNode*> stack;
+        bvhNode* stack[traversalStackSize];
+        int stackPtr = 0;
+        traversalStats& stats = threadStats();
         while(true)
         {
+            stats.visit(n);
             if(n->isLeaf())
             {
-                for(int i = 0; i < n->triCount; i++)
-                    (*triangles)[triIndices[n->leftFirst + i]]->hit(r);
-
-                if(stack.size() > 0)
-                {
-                    n = stack.top();
-                    stack.pop();
-                }
-                else
+                intersectLeaf(n, r, alpha);
+                if(stackPtr == 0)
                     break;
-                
+
+                n = stack[--stackPtr];
                 continue;
             }
 
@@ -225,8 +360,7 @@ public:
             bvhNode* child2 = &bvhNodes[n->leftFirst + 1];
 
             float hit1, hit2;
-            hit1 = child1->bounds.hit(r);
-            hit2 = child2->bounds.hit(r);
+            aabb::hit2(child1->bounds, child2->bounds, r, hit1, hit2);
             
             if(hit1 > hit2)
             {
@@ -236,19 +370,265 @@ public:
 
             if(hit1 == infinity)
             {
-                if(stack.size() == 0)
+                if(stackPtr == 0)
                     break;
 
-                n = stack.top();
-                stack.pop();
+                n = stack[--stackPtr];
             }
             else
             {
                 n = child1;
                 if(hit2 != infinity)
-                    stack.push(child2);
+                    stack[stackPtr++] = child2;
+            }
+        }
+    }
+
+    // Stackless traversal after Hapala et al. 2011, walking parent and sibling links. The near child
+    // of a pair has to come out the same every time the walk returns to it, so it is picked by the
+    // ray direction rather than by the entry distances.
+    void hitStackless(ray& r, const alphaTest* alpha) const
+    {
+        traversalStats& stats = threadStats();
+        auto nearChild = [&](int idx)
+        {
+            int first = bvhNodes[idx].leftFirst;
+            vec3 between = (bvhNodes[first].bounds.min() + bvhNodes[first].bounds.max())
+                         - (bvhNodes[first + 1].bounds.min() + bvhNodes[first + 1].bounds.max());
+            return dot(between, r.direction()) <= 0.0f ? first : first + 1;
+        };
+
+        stats.visit(&bvhNodes[0]);
+        if(bvhNodes[0].isLeaf())
+        {
+            intersectLeaf(&bvhNodes[0], r, alpha);
+            return;
+        }
+
+        enum { fromParent, fromSibling, fromChild } state = fromParent;
+        int current = nearChild(0);
+        while(true)
+        {
+            if(state == fromChild)
+            {
+                if(current == 0)
+                    return;
+
+                int parent = parents[current];
+                if(current == nearChild(parent))
+                {
+                    current ^= 1;
+                    state = fromSibling;
+                }
+                else
+                {
+                    current = parent;
+                    state = fromChild;
+                }
+                continue;
+            }
+
+            bvhNode* n = &bvhNodes[current];
+            stats.visit(n);
+            bool entered = n->bounds.hit(r) != infinity;
+            if(entered && !n->isLeaf())
+            {
+                current = nearChild(current);
+                state = fromParent;
+                continue;
+            }
+
+            if(entered)
+                intersectLeaf(n, r, alpha);
+            if(state == fromParent)
+            {
+                current ^= 1;
+                state = fromSibling;
+            }
+            else
+            {
+                current = parents[current];
+                state = fromChild;
+            }
+        }
+    }
+
+    // Copies the subtree under oldIdx into newNodes at newIdx, giving every child pair the next free
+    // slots. The child with the larger surface area (the one more rays will enter) is laid out first
+    // so its pair sits right after the current one.
+    void layoutDepthFirst(std::vector<bvhNode>& newNodes, int oldIdx, int newIdx, int& next)
+    {
+        bvhNode node = bvhNodes[oldIdx];
+        newNodes[newIdx] = node;
+        if(node.isLeaf())
+            return;
+
+        int first = node.leftFirst;
+        int second = node.leftFirst + 1;
+        if(bvhNodes[second].bounds.area() > bvhNodes[first].bounds.area())
+            std::swap(first, second);
+
+        int pair = next;
+        next += 2;
+        newNodes[newIdx].leftFirst = pair;
+
+        layoutDepthFirst(newNodes, first, pair, next);
+        layoutDepthFirst(newNodes, second, pair + 1, next);
+    }
+public:
+    aabb bvhBounds{};
+
+    bvh(){};
+
+    bvh(const indexedMesh* m, sceneArena& arena, const bvhBuildProfile& buildProfile = {}) : mesh(m), triCount(m->triCount), profile(buildProfile)
+    {
+        int N = triCount;
+        triIndices = arena.allocate<int>(N, arenaTag::indices);
+        bvhNodes = arena.create<bvhNode>(2 * N, arenaTag::bvhNodes);
+        build();
+        if(depth > traversalStackSize)
+            linkParents(arena);
+    }
+
+    // Arena bytes a bvh over N triangles will allocate, including alignment padding and parent links
+    static size_t memoryRequired(int N)
+    {
+        return N * (sizeof(int) + 2 * sizeof(bvhNode) + 2 * sizeof(int)) + sceneArena::slack(3);
+    }
+
+    // Switches the tree to stackless traversal, which build does by itself for trees deeper than the
+    // fixed stacks. Costs an int per node.
+    void linkParents(sceneArena& arena)
+    {
+        if(parents || nodesUsed < 2)
+            return;
+        parents = arena.allocate<int>(nodesUsed, arenaTag::bvhNodes);
+        fillParents();
+    }
+
+    int nodeCount() const { return nodesUsed; }
+    int treeDepth() const { return depth; }
+    bool stackless() const { return parents != nullptr; }
+
+    // Raw arrays, used to write the BLAS to the out-of-core cache
+    const void* nodeData() const { return bvhNodes; }
+    size_t nodeBytes() const { return nodesUsed * sizeof(bvhNode); }
+    const int* indexData() const { return triIndices; }
+    size_t indexBytes() const { return triCount * sizeof(int); }
+    const int* parentData() const { return parents; }
+    size_t parentBytes() const { return parents ? nodesUsed * sizeof(int) : 0; }
+
+    // Wraps arrays written by nodeData/indexData/parentData that live elsewhere, e.g. in a mapped cache page
+    static bvh view(const indexedMesh* m, const void* nodes, int nodeCount, const int* indices, const aabb& bounds, int depth,
+                    const int* parents = nullptr)
+    {
+        bvh b;
+        b.mesh = m;
+        b.triCount = m->triCount;
+        b.nodesUsed = nodeCount;
+        b.bvhNodes = static_cast<bvhNode*>(const_cast<void*>(nodes));
+        b.triIndices = const_cast<int*>(indices);
+        b.bvhBounds = bounds;
+        b.depth = depth;
+        b.parents = const_cast<int*>(parents);
+        return b;
+    }
+
+    // Copy of the tree in arena over the mesh m, which must be a copy of this tree's mesh
+    bvh clone(const indexedMesh* m, sceneArena& arena) const
+    {
+        bvh b = *this;
+        b.mesh = m;
+        b.triIndices = arena.allocate<int>(triCount, arenaTag::indices);
+        b.bvhNodes = arena.allocate<bvhNode>(nodesUsed, arenaTag::bvhNodes);
+        std::copy(triIndices, triIndices + triCount, b.triIndices);
+        std::copy(bvhNodes, bvhNodes + nodesUsed, b.bvhNodes);
+        if(parents)
+        {
+            b.parents = arena.allocate<int>(nodesUsed, arenaTag::bvhNodes);
+            std::copy(parents, parents + nodesUsed, b.parents);
+        }
+        return b;
+    }
+
+    // Walks the finished tree for node/leaf counts, depth, leaf size histogram, SAH cost and an
+    // estimate of EPO. EPO clips every triangle against the boxes of the nodes it does not belong to
+    // but overlaps, approximating the clipped area by the overlapping fraction of its bounding box.
+    bvhReport report() const
+    {
+        bvhReport rep;
+        rep.trees = 1;
+        rep.stacklessTrees = parents ? 1 : 0;
+        if(triCount == 0)
+            return rep;
+
+        std::vector<int> rangeFirst(nodesUsed), rangeLast(nodesUsed);
+        float rootArea = std::max(bvhNodes[0].bounds.area(), 1e-12f);
+        reportNode(0, 1, rootArea, rep, rangeFirst, rangeLast);
+
+        std::vector<int> position(triCount);
+        for(int i = 0; i < triCount; i++)
+            position[triIndices[i]] = i;
+
+        double overlap = 0.0;
+        double totalArea = 0.0;
+        std::vector<int> stack;
+        for(int tri = 0; tri < triCount; tri++)
+        {
+            triangle t = mesh->get(tri);
+            float triArea = 0.5f * cross(t.v1() - t.v0(), t.v2() - t.v0()).length();
+            totalArea += triArea;
+
+            aabb triBox{};
+            triBox.grow(t.v0());
+            triBox.grow(t.v1());
+            triBox.grow(t.v2());
+
+            stack.push_back(0);
+            while(!stack.empty())
+            {
+                const bvhNode& n = bvhNodes[stack.back()];
+                int idx = stack.back();
+                stack.pop_back();
+
+                float fraction = overlapFraction(triBox, n.bounds);
+                if(fraction <= 0.0f)
+                    continue;
+
+                bool inside = position[tri] >= rangeFirst[idx] && position[tri] < rangeLast[idx];
+                if(!inside)
+                    overlap += triArea * fraction * (n.triCount > 0 ? n.triCount : 1);
+
+                if(n.triCount == 0)
+                {
+                    stack.push_back(n.leftFirst);
+                    stack.push_back(n.leftFirst + 1);
+                }
             }
         }
+        rep.epo = totalArea > 0.0 ? overlap / totalArea : 0.0;
+        return rep;
+    }
+
+    // Reorders the nodes depth first after the build, which allocated child pairs in creation order
+    // and interleaved unrelated subtrees. Slot 1 stays unused so pairs start on even indices.
+    void optimizeLayout()
+    {
+        std::vector<bvhNode> newNodes(nodesUsed);
+        int next = 2;
+        layoutDepthFirst(newNodes, 0, 0, next);
+        std::copy(newNodes.begin(), newNodes.begin() + next, bvhNodes);
+        if(parents)
+            fillParents();
+    }
+
+    // alpha is the any-hit filter of an alpha-tested model, null for opaque ones
+    void hit(ray& r, const alphaTest* alpha = nullptr) const
+    {
+        if(parents)
+            hitStackless(r, alpha);
+        else
+            hitStack(r, alpha);
     }
 };
 
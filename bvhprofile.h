@@ -0,0 +1,107 @@
+#ifndef BVH_PROFILE_H
+#define BVH_PROFILE_H
+
+#include <algorithm>
+#include <ostream>
+#include <string>
+
+// Knobs of the binned SAH builder. The presets trade build time for tree quality; balanced matches
+// what the builder always did.
+struct bvhBuildProfile
+{
+    static constexpr int maxBins = 64;
+
+    const char* name = "balanced";
+    int binCount = 8;               // Split candidates per axis are binCount - 1
+    float traversalCost = 0.0f;     // Cost of visiting an interior node, relative to intersectCost
+    float intersectCost = 1.0f;     // Cost of one ray/triangle test
+    int maxLeafSize = 1 << 30;      // Nodes above this are split even when SAH says stop
+    int fullSweepBelow = 0;         // Nodes with fewer triangles evaluate every object split exactly
+
+    static bvhBuildProfile fast()
+    {
+        bvhBuildProfile p;
+        p.name = "fast";
+        p.binCount = 4;
+        p.traversalCost = 1.0f;
+        p.maxLeafSize = 16;
+        return p;
+    }
+
+    static bvhBuildProfile balanced() { return bvhBuildProfile{}; }
+
+    static bvhBuildProfile quality()
+    {
+        bvhBuildProfile p;
+        p.name = "quality";
+        p.binCount = 32;
+        p.traversalCost = 1.0f;
+        p.intersectCost = 1.0f;
+        p.maxLeafSize = 8;
+        p.fullSweepBelow = 64;
+        return p;
+    }
+};
+
+inline bool parseBvhProfile(const std::string& name, bvhBuildProfile& profile)
+{
+    if(name == "fast") profile = bvhBuildProfile::fast();
+    else if(name == "balanced") profile = bvhBuildProfile::balanced();
+    else if(name == "quality") profile = bvhBuildProfile::quality();
+    else return false;
+
+    return true;
+}
+
+// Quality numbers of one or more built trees. SAH cost is always measured with traversal and
+// intersection cost 1 so trees built with different profiles can be compared.
+struct bvhReport
+{
+    static constexpr int histogramBuckets = 8;  // Leaf sizes 1, 2, 3-4, 5-8, ... , 65+
+
+    int trees = 0;
+    long long nodes = 0;
+    long long leaves = 0;
+    long long triangles = 0;
+    int maxDepth = 0;
+    int stacklessTrees = 0;     // Trees traversed through parent links instead of a fixed stack
+    double sahCost = 0.0;       // Summed over trees, each relative to its own root area
+    double epo = 0.0;           // Effective parallel overlap, summed like sahCost
+    long long leafHistogram[histogramBuckets] {};
+
+    static int bucket(int leafSize)
+    {
+        int b = 0;
+        for(int size = 1; size < leafSize && b < histogramBuckets - 1; size *= 2)
+            b++;
+        return b;
+    }
+
+    void merge(const bvhReport& other)
+    {
+        trees += other.trees;
+        nodes += other.nodes;
+        leaves += other.leaves;
+        triangles += other.triangles;
+        maxDepth = std::max(maxDepth, other.maxDepth);
+        stacklessTrees += other.stacklessTrees;
+        sahCost += other.sahCost;
+        epo += other.epo;
+        for(int i = 0; i < histogramBuckets; i++)
+            leafHistogram[i] += other.leafHistogram[i];
+    }
+
+    void report(std::ostream& out, const char* profileName) const
+    {
+        out << "BVH (" << profileName << "): " << trees << " tree(s), " << nodes << " nodes, " << leaves << " leaves, max depth "
+            << maxDepth << ", avg leaf " << (leaves > 0 ? (double)triangles / leaves : 0.0) << " tris, " << stacklessTrees << " stackless\n";
+        out << "  SAH cost " << (trees > 0 ? sahCost / trees : 0.0) << ", EPO " << (trees > 0 ? epo / trees : 0.0) << " (mean per tree)\n";
+        out << "  leaf sizes:";
+        const char* labels[histogramBuckets] = {"1", "2", "3-4", "5-8", "9-16", "17-32", "33-64", "65+"};
+        for(int i = 0; i < histogramBuckets; i++)
+            out << ' ' << labels[i] << ":" << leafHistogram[i];
+        out << '\n';
+    }
+};
+
+#endif
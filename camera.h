@@ -1,15 +1,28 @@
 #ifndef CAMERA_H
 #define CAMERA_H
 
+#include <chrono>
+#include <memory>
+#include <string>
 #include <vector>
 #include <thread>
 
 #include "utilities.h"
+#include "framebuffer.h"
+#include "lights.h"
+#include "material.h"
+#include "numa.h"
+#include "raster.h"
+#include "scheduler.h"
+#include "stats.h"
+#include "temporal.h"
+#include "tilehits.h"
 #include "tlas.h"
 
 class camera;
 
-void renderRow(int tx, int ty, int nx, int ny, int ns, int maxBounceDepth, tlas& tlas, const camera& cam, std::vector<color>* output);
+void renderTiles(tileScheduler& scheduler, tlas& t, const camera& cam, framebuffer* output, statsAccumulator* stats,
+                 const primaryRaster* raster = nullptr);
 
 class camera
 {
@@ -23,69 +36,260 @@ public:
     point3 lookAt = point3{0,0,-1};
     vec3 vUp = vec3{0,1,0};
 
+    tileOrder tileOrdering = tileOrder::hilbert;  // Order tiles are handed to the workers
+    int tileSize = 0;            // Tile edge in pixels, 0 sizes tiles from the image and thread count
+    bool splitTiles = true;      // Split slow tiles at the end of the frame so idle workers can help
+    int threadCount = 0;         // Worker threads, 0 uses every hardware thread
+    bool pinThreads = false;     // Pin workers to CPUs, spread round robin over the NUMA nodes
+    bool tileCulling = true;     // Cull the TLAS against each tile's frustum once for all its primary rays
+    bool rasterPrimary = false;  // Rasterize primary visibility and start path tracing at the first hit
+    tile crop{};                 // Pixel rectangle to render when not empty, the rest of the image is read from outputPath
+    std::string outputPath = "output.ppm";  // A .pfm path keeps the HDR values of the half and rgb9e5 formats
+    pixelFormat framebufferFormat = pixelFormat::rgb8;
+    materialLibrary* materials = nullptr;   // Not owned, null shades everything with the constant 0.5 albedo
+    float diffuseConeSpread = 0.2f;         // Cone spread angle of rays leaving a diffuse bounce, in radians
+    const lightTree* lights = nullptr;      // Not owned, emissive triangles sampled at every diffuse hit
+    bool nextEventEstimation = true;        // Without it emitters only contribute when a bounce happens to hit them
+    tileHits* recordHits = nullptr;         // Not owned, filled with the BLASes each tile's paths entered. Primaries are traced then.
+    temporalHistory* history = nullptr;     // Not owned, the previous frame of a sequence, blended in and replaced by this one
+
     double getInvPixelSamples() const { return pixelSamplesInv; }
 
     void render(tlas& t)
     {
-        initialize();
+        render(std::vector<tlas*>{&t});
+    }
 
-        std::vector<std::thread> threadPool;
-        std::vector<color> output(imageWidth * imageHeight);
+    // nodeScenes holds one TLAS per NUMA node, workers traverse the one of the node they are pinned to
+    void render(const std::vector<tlas*>& nodeScenes)
+    {
+        initialize();
 
-        int tX = (int)std::ceil((float)imageWidth / 16.0f);
-        int tY = (int)std::ceil((float)imageHeight / 16.0f);
-        int numTiles = tX * tY;
-        for(int tile = 0; tile < numTiles; tile++)
+        framebuffer output(imageWidth, imageHeight, framebufferFormat);
+        tile region {0, 0, imageWidth, imageHeight};
+        if(crop.pixels() > 0)
         {
-            int x = tile % (int)tX;
-            int y = tile / (int)tX;
+            region = clipToImage(crop);
+            if(!output.read(outputPath) || output.width != imageWidth || output.height != imageHeight)
+            {
+                output = framebuffer(imageWidth, imageHeight, framebufferFormat);
+                std::cout << "CROP: no " << imageWidth << "x" << imageHeight << " image at " << outputPath
+                          << " to render into, the rest of the frame stays black\n";
+            }
+        }
 
-            threadPool.emplace_back(renderRow, x, y, imageWidth, imageHeight, samplesPerPixel, maxBounceDepth, std::ref(t), *this, &output);
-            //renderRow(x, y, imageWidth, imageHeight, samplesPerPixel, maxBounceDepth, t, *this, &output);
+        renderRegion(nodeScenes, output, region, nullptr);
+        writeImage(output);
+    }
+
+    // Renders only region into image, which keeps all its other pixels, and writes it
+    void renderCrop(tlas& t, framebuffer& image, const tile& region)
+    {
+        initialize();
+        if(image.width != imageWidth || image.height != imageHeight)
+        {
+            std::cout << "ERROR::CROP::image is " << image.width << "x" << image.height << " but the camera renders "
+                      << imageWidth << "x" << imageHeight << std::endl;
+            return;
         }
 
-        for(auto& thread : threadPool)
+        renderRegion({&t}, image, clipToImage(region), nullptr);
+        writeImage(image);
+    }
+
+    // Renders again only the tiles whose paths entered one of the changed models, after those were
+    // edited in place. image holds the result of the render that recorded hits, and both are
+    // brought up to date. When the hits can't tell which tiles the change reaches, everything is.
+    // An edited emission lights tiles that never saw the emitter, so it calls for scene::rebuildLights()
+    // and a full render instead.
+    void renderChanged(tlas& t, framebuffer& image, tileHits& hits, const std::vector<int>& changed)
+    {
+        initialize();
+
+        tileHits* previousRecord = recordHits;
+        recordHits = &hits;
+        tile full {0, 0, imageWidth, imageHeight};
+        std::vector<uint8_t> cells;
+        bool sized = image.width == imageWidth && image.height == imageHeight;
+        if(sized && hits.matches(imageWidth, imageHeight, t) && hits.affected(t, changed, cells))
         {
-            thread.join();
+            int count = 0;
+            for(int cell = 0; cell < (int)cells.size(); cell++)
+            {
+                if(cells[cell])
+                {
+                    hits.clear(cell);
+                    count++;
+                }
+            }
+            std::cout << "INCREMENTAL: " << count << " of " << cells.size() << " tiles reached by " << changed.size()
+                      << " changed model(s)\n";
+            renderRegion({&t}, image, full, &cells);
         }
+        else
+        {
+            if(!sized)
+                image = framebuffer(imageWidth, imageHeight, framebufferFormat);
+            std::cout << "INCREMENTAL: the recorded hits do not cover the change, rendering every tile\n";
+            renderRegion({&t}, image, full, nullptr);
+        }
+        recordHits = previousRecord;
+        writeImage(image);
+    }
 
-        std::ofstream ppm;
-        ppm.open("output.ppm");
+    // Sets up the viewport, which render() does by itself. Callers rendering single tiles call it once first.
+    void prepare() { initialize(); }
 
-        ppm << "P3\n" << imageWidth << " " << imageHeight << " \n255\n";
+    int height() const { return imageHeight; }
 
-        for(int y = 0; y < imageHeight; y++)
+    // Renders one tile on the calling thread into pixels, row by row with the tile's width as stride
+    void renderTile(const tile& tl, tlas& t, color* pixels) const
+    {
+        tlasEntry entry = primaryEntry(tl, t);
+        for(int y = tl.y0; y < tl.y1; y++)
         {
-            for(int x = 0; x < imageWidth; x++)
+            for(int x = tl.x0; x < tl.x1; x++)
             {
-                writeColor(ppm, output[x + y * imageWidth]);
+                vec3 col {0,0,0};
+                for(int s = 0; s < samplesPerPixel; s++)
+                {
+                    ray r = getRay(x, y);
+                    col += rayColor(r, maxBounceDepth, t, true, &entry);
+                }
+                *pixels++ = col * getInvPixelSamples();
             }
-        } 
+        }
+    }
 
-        ppm.close();
+    void writeImage(const framebuffer& output) const
+    {
+        if(!output.write(outputPath))
+            std::cout << "ERROR::IMAGE::could not write " << outputPath << std::endl;
     }
 
     ray getRay(int i, int j) const
     {
         vec3 offset = sampleSquare();
-        vec3 pixelSample = pixel00Pos + ((i + offset.x()) * pixelDeltaU) + ((j + offset.y()) * pixelDeltaV);
-        //vec3 pixelSample = pixel00Pos + (i * pixelDeltaU) + (j * pixelDeltaV);
+        return getRay(i, j, offset.x(), offset.y());
+    }
+
+    // Ray through the point offset by dx, dy from the center of pixel i, j
+    ray getRay(int i, int j, float dx, float dy) const
+    {
+        vec3 pixelSample = pixel00Pos + ((i + dx) * pixelDeltaU) + ((j + dy) * pixelDeltaV);
+
+        ray r{cameraPos, pixelSample - cameraPos};
+        r.coneSpread = pixelSpread;
+        return r;
+    }
 
-        return ray{cameraPos, pixelSample - cameraPos};
+    // Color of sample s of pixel i, j from its rasterized visibility. The triangle found is confirmed
+    // with a ray test against it alone, which also gives the exact hit the ray tracer would find;
+    // samples it misses, on an edge or through an alpha mask, are traced the usual way, and so are
+    // samples nothing was rasterized at, which may be cracks between triangles or near clipped geometry.
+    color rasterSampleColor(int i, int j, int s, const visSample& vis, tlas& t) const
+    {
+        if(maxBounceDepth <= 0)
+            return vec3{0,0,0};
+
+        float dx, dy;
+        rasterSampleOffset(s, dx, dy);
+        ray r = getRay(i, j, dx, dy);
+        traversalStats& stats = threadStats();
+        stats.rasterSamples++;
+        if(vis.model >= 0)
+            t.hitTriangle(r, vis.model, vis.tri);
+        if(r.t == infinity)
+        {
+            stats.rasterFallbacks++;
+            t.hit(r);
+        }
+        return shade(r, maxBounceDepth, t, true);
+    }
+
+    // First hit of the ray through the center of pixel i, j, which finds the pixel in a frame's history.
+    // center is the pixel's rasterized sample 0, which lies at the center, when there is a raster:
+    // only its triangle is tested then, and the ray traced only where that misses.
+    surfaceSample firstHit(int i, int j, tlas& t, const tlasEntry& entry, const visSample* center = nullptr) const
+    {
+        ray r = getRay(i, j, 0.0f, 0.0f);
+        if(center && center->model >= 0)
+            t.hitTriangle(r, center->model, center->tri);
+        if(r.t == infinity)
+            t.hit(r, entry);
+        if(r.t == infinity)
+            return surfaceSample{};
+
+        hitRecord rec = t.resolve(r);
+        return surfaceSample{rec.p, rec.normal, rec.instIdx, rec.material};
+    }
+
+    // Where the primary rays of tl enter the TLAS. The frustum runs through the outer edges of the
+    // tile's pixels, widened by a pixel for the jittered samples and rounding.
+    tlasEntry primaryEntry(const tile& tl, const tlas& t) const
+    {
+        if(!tileCulling)
+            return tlasEntry{};
+
+        float x0 = tl.x0 - 1.5f, x1 = tl.x1 + 0.5f;
+        float y0 = tl.y0 - 1.5f, y1 = tl.y1 + 0.5f;
+        vec3 corners[4] = {pixel00Pos + x0 * pixelDeltaU + y0 * pixelDeltaV - cameraPos,
+                           pixel00Pos + x1 * pixelDeltaU + y0 * pixelDeltaV - cameraPos,
+                           pixel00Pos + x1 * pixelDeltaU + y1 * pixelDeltaV - cameraPos,
+                           pixel00Pos + x0 * pixelDeltaU + y1 * pixelDeltaV - cameraPos};
+        tlasEntry entry = t.cull(cameraPos, corners);
+
+        traversalStats& stats = threadStats();
+        stats.culledTiles++;
+        if(entry.leafCount >= 0)
+            stats.tileLeaves += entry.leafCount;
+        else
+            stats.subtreeTiles++;
+        return entry;
     }
 
-    color rayColor(ray& r, int depth, tlas& t) const 
+    // countEmission is false after a diffuse bounce when next event estimation already sampled the
+    // emitters from that point, so their light is not counted twice. entry is the culled TLAS of
+    // the primary ray's tile.
+    color rayColor(ray& r, int depth, tlas& t, bool countEmission = true, const tlasEntry* entry = nullptr) const 
     {
         if(depth <= 0)
             return vec3{0,0,0};
 
-        t.hit(r);
+        if(entry)
+            t.hit(r, *entry);
+        else
+            t.hit(r);
+        return shade(r, depth, t, countEmission);
+    }
 
+    // Rest of rayColor once r has been traced
+    color shade(ray& r, int depth, tlas& t, bool countEmission) const
+    {
         if(r.t != infinity)
         {
-            vec3 direction = r.normal + randomVectorOnHemisphere(r.normal);
-            r = ray{r.at(r.t), direction};
-            return 0.5f * rayColor(r, depth - 1, t);
+            hitRecord rec = t.resolve(r);
+            float coneWidth = r.coneWidth + r.coneSpread * r.t * r.direction().length();
+            color albedo = materials ? materials->albedo(rec, coneWidth, r.direction()) : color{0.5f, 0.5f, 0.5f};
+
+            color emitted {0,0,0};
+            if(materials && countEmission)
+                emitted += materials->emission(rec);
+            int bounce = r.bounce + 1;
+            bool sampleLights = nextEventEstimation && lights && !lights->empty();
+            if(sampleLights)
+                emitted += albedo * directLight(rec, coneWidth, bounce, t);
+
+            // Cosine distributed, which the albedo weight of the bounce below assumes
+            vec3 direction = rec.normal + randomUnitVector();
+            if(direction.squaredLength() < 1e-8f)
+                direction = rec.normal;
+            r = ray{rec.p, direction};
+            r.coneWidth = coneWidth;
+            r.coneSpread = diffuseConeSpread;
+            r.bounce = bounce;
+            r.originInst = rec.instIdx;
+            return emitted + albedo * rayColor(r, depth - 1, t, !sampleLights);
         }
 
         float a = r.direction().y() + 1.0f;
@@ -93,8 +297,136 @@ public:
     }
 
 private:
+    // Renders the tiles inside region into output, only those of the cells set in cells when given.
+    // Pixels outside are left as they are.
+    void renderRegion(const std::vector<tlas*>& nodeScenes, framebuffer& output, const tile& region,
+                      const std::vector<uint8_t>* cells)
+    {
+        std::vector<std::thread> threadPool;
+
+        int workers = threadCount > 0 ? threadCount : std::max(1, (int)std::thread::hardware_concurrency());
+
+        // Hits kept from an earlier render of the frame fix the tile grid, which they are recorded on
+        bool whole = !cells && region.pixels() == imageWidth * imageHeight;
+        bool keepHits = recordHits && !whole && recordHits->matches(imageWidth, imageHeight, *nodeScenes[0]);
+
+        tileScheduler scheduler;
+        scheduler.order = tileOrdering;
+        scheduler.tileSize = keepHits ? recordHits->edge() : tileSize;
+        scheduler.splitExpensive = splitTiles;
+        scheduler.build(imageWidth, imageHeight, workers);
+        if(recordHits && !keepHits)
+            recordHits->reset(imageWidth, imageHeight, scheduler.tileEdge(), *nodeScenes[0]);
+        scheduler.clip(region);
+        if(cells)
+            scheduler.select(*cells);
+
+        // Samples sit at fixed offsets in raster mode, the rasterizer has to know them up front
+        std::unique_ptr<primaryRaster> raster;
+        if(rasterPrimary && recordHits)
+            std::cout << "RASTER: off while recording tile hits, primaries are traced\n";
+        if(rasterPrimary && !recordHits && samplesPerPixel <= primaryRaster::maxSamples)
+        {
+            raster.reset(new primaryRaster{});
+            raster->build(*nodeScenes[0], cameraPos, pixel00Pos, pixelDeltaU, pixelDeltaV, imageWidth, imageHeight,
+                          samplesPerPixel, workers);
+        }
+
+        if(history)
+            history->begin(imageWidth, imageHeight);
+
+        numaTopology topology = numaTopology::detect();
+        bool placed = pinThreads || nodeScenes.size() > 1;
+        int nodes = placed ? topology.nodeCount() : 1;
+        std::vector<int> nodeWorkers(nodes, 0);
+        std::unique_ptr<statsAccumulator[]> nodeStats(new statsAccumulator[nodes]);
+
+        statsAccumulator stats;
+        auto start = std::chrono::steady_clock::now();
+        for(int i = 0; i < workers; i++)
+        {
+            int node = placed ? topology.nodeOf(i) : 0;
+            int cpu = pinThreads ? topology.cpuOf(i) : -1;
+            tlas* t = nodeScenes[node % nodeScenes.size()];
+            nodeWorkers[node]++;
+            threadPool.emplace_back([&, node, cpu, t]()
+            {
+                if(cpu >= 0)
+                    pinCurrentThread(cpu);
+                renderTiles(scheduler, *t, *this, &output, &stats, raster.get());
+                nodeStats[node].add(threadStats());
+            });
+        }
+
+        for(auto& thread : threadPool)
+        {
+            thread.join();
+        }
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        if(history)
+            history->end(cameraPos, pixel00Pos, pixelDeltaU, pixelDeltaV);
+
+        std::cout << "TILES: " << scheduler.tileCount() << " of " << scheduler.tileEdge() << "x" << scheduler.tileEdge()
+                  << " (" << tileOrderName(tileOrdering) << "), " << scheduler.splitCount() << " split, "
+                  << scheduler.helpedSplitCount() << " of the halves rendered by another worker\n";
+        if(raster)
+            raster->report(std::cout);
+        output.report(std::cout);
+        stats.result().report(std::cout, ms);
+        if(placed)
+        {
+            for(int node = 0; node < nodes; node++)
+                std::cout << "  NUMA node " << node << ": " << nodeWorkers[node] << " worker(s), "
+                          << (ms > 0.0 ? nodeStats[node].result().rays / (ms * 1000.0) : 0.0) << " Mrays/s\n";
+        }
+        if(nodeScenes[0]->pager)
+            nodeScenes[0]->pager->report(std::cout, stats.result().blasVisits);
+        if(materials && materials->textures.count() > 0)
+            materials->textures.report(std::cout, stats.result().textureLookups);
+    }
+
+    tile clipToImage(const tile& region) const
+    {
+        return tile{std::max(region.x0, 0), std::max(region.y0, 0), std::min(region.x1, imageWidth), std::min(region.y1, imageHeight)};
+    }
+
+    // Light from one emitter picked by the light BVH, reflected by a white diffuse surface at rec.
+    // One shadow ray through the TLAS decides whether it arrives. It gets the cone and bounce count
+    // of the diffuse bounce from rec, which picks its levels of detail.
+    color directLight(const hitRecord& rec, float coneWidth, int bounce, tlas& t) const
+    {
+        const emitter* light;
+        float probability;
+        if(!lights->sample(rec.p, rec.normal, randGen<float>(), light, probability))
+            return color{0,0,0};
+        touchBlas(light->model);
+
+        vec3 toLight = light->sample(randGen<float>(), randGen<float>()) - rec.p;
+        float distanceSquared = toLight.squaredLength();
+        float distance = std::sqrt(distanceSquared);
+        vec3 wi = toLight / distance;
+        float cosSurface = dot(rec.normal, wi);
+        float cosLight = -dot(light->normal, wi);
+        if(cosSurface <= 0.0f || cosLight <= 0.0f)
+            return color{0,0,0};
+
+        ray shadow{rec.p, wi};
+        shadow.t = distance * (1.0f - 1e-3f);
+        shadow.coneWidth = coneWidth;
+        shadow.coneSpread = diffuseConeSpread;
+        shadow.bounce = bounce;
+        shadow.originInst = rec.instIdx;
+        shadow.targetInst = light->model;
+        if(t.occluded(shadow))
+            return color{0,0,0};
+
+        // Diffuse BRDF 1/pi over the area density probability/area of the sampled point
+        return light->emission * (cosSurface * cosLight * light->area / (pi * distanceSquared * probability));
+    }
+
     int imageHeight;    // Rendered image height
     double pixelSamplesInv; // Inverse of pixel samples to scale result
+    float pixelSpread;      // Angle one pixel subtends, the spread of primary ray cones
     point3 cameraPos;   // Camera position
     point3 pixel00Pos;  // World pos of pixel 0,0
     vec3 pixelDeltaU;   // Offset to center of pixel to the right
@@ -118,6 +450,7 @@ private:
         const float focalLength = (lookFrom - lookAt).length();
         const double theta = degreesToRadians(vfov);
         const double h = tan(theta/2.0);
+        pixelSpread = float(atan(2.0 * h / imageHeight));
         const double viewportHeight = 2 * h * focalLength;
         const double viewportWidth = viewportHeight * (double(imageWidth) / imageHeight);
 
@@ -142,29 +475,82 @@ private:
     }
 };
 
-void renderRow(int tx, int ty, int nx, int ny, int ns, int maxBounceDepth, tlas& t, const camera& cam, std::vector<color>* output)
+// Renders tl into the full frame output. After every row the rest of the tile may be handed to an
+// idle worker, in which case tl shrinks to the rows already done, so each row accumulates in float
+// on its own and is converted into the framebuffer's format when it is done.
+// With a raster the tile's primary visibility is rasterized first and the rays start at its hits.
+void renderScheduledTile(tileScheduler& scheduler, tile tl, tlas& t, const camera& cam, framebuffer& output,
+                         const primaryRaster* raster = nullptr)
 {
-    for(int v = 0; v < 16; v++)
+    int ns = cam.samplesPerPixel;
+
+    auto start = std::chrono::steady_clock::now();
+    static thread_local std::vector<visSample> visibility;
+    static thread_local std::vector<color> row;
+    static thread_local std::vector<uint64_t> touched;
+    row.resize(tl.x1 - tl.x0);
+    if(cam.recordHits)
     {
-        for(int u = 0; u < 16; u++)
-        {
-            float x = (tx * 16 + u);
-            float y = (ty * 16 + v);
-
-            if(x >= nx || y >= ny)
-                continue;
+        touched.assign(cam.recordHits->words(), 0);
+        threadTouchedBlas() = touched.data();
+    }
+    tlasEntry entry{};
+    if(raster)
+    {
+        raster->rasterize(tl, visibility);
+        threadStats().rasterMicros += std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+    }
+    else
+        entry = cam.primaryEntry(tl, t);
 
+    for(int y = tl.y0; y < tl.y1; y++)
+    {
+        for(int x = tl.x0; x < tl.x1; x++)
+        {
             vec3 col {0,0,0};
+            const visSample* vis = raster ? &visibility[((y - tl.y0) * (tl.x1 - tl.x0) + x - tl.x0) * ns] : nullptr;
             for(int s = 0; s < ns; s++)
             {
+                if(vis)
+                {
+                    col += cam.rasterSampleColor(x, y, s, vis[s], t);
+                    continue;
+                }
                 ray r = cam.getRay(x, y);
-                col += cam.rayColor(r, maxBounceDepth, t);
+                col += cam.rayColor(r, cam.maxBounceDepth, t, true, &entry);
             }
 
             col *= cam.getInvPixelSamples();
+            if(cam.history)
+                col = cam.history->blend(x, y, col, ns, cam.firstHit(x, y, t, entry, vis));
 
-            (*output)[y * nx + x] = col;
+            row[x - tl.x0] = col;
         }
+        output.store(tl.x0, y, row.data(), tl.x1 - tl.x0);
+
+        double elapsed = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+        scheduler.trySplit(tl, y + 1, elapsed);
+    }
+
+    if(cam.recordHits)
+    {
+        threadTouchedBlas() = nullptr;
+        cam.recordHits->add(tl, touched.data());
     }
+
+    double elapsed = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+    scheduler.finished(tl, elapsed);
+}
+
+void renderTiles(tileScheduler& scheduler, tlas& t, const camera& cam, framebuffer* output, statsAccumulator* stats,
+                 const primaryRaster* raster)
+{
+    threadStats() = {};
+
+    tile tl;
+    while(scheduler.next(tl))
+        renderScheduledTile(scheduler, tl, t, cam, *output, raster);
+
+    stats->add(threadStats());
 }
 #endif
@@ -0,0 +1,341 @@
+#ifndef DISTRIBUTED_H
+#define DISTRIBUTED_H
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <deque>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#if !defined(_WIN32)
+#include <csignal>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+#include "camera.h"
+#include "scheduler.h"
+#include "tlas.h"
+
+// Coordinator/worker tile rendering across processes. The coordinator never loads the scene: it
+// splits the frame with the tile scheduler and streams tiles to worker processes, which are the
+// same binary started with --worker and load the scene from the same arguments (an --ooc-cache
+// file lets them share the BLAS data through the page cache). The messages are plain fixed size
+// records on a byte stream, so pipes could later be swapped for sockets to other hosts.
+
+struct tileRequest
+{
+    int32_t x0, y0, x1, y1;     // x0 < 0 asks the worker to exit
+};
+
+struct tileResult
+{
+    int32_t x0, y0;
+    int32_t pixelCount;         // Followed by pixelCount colors
+};
+
+#if !defined(_WIN32)
+
+inline bool readFull(int fd, void* data, size_t bytes)
+{
+    char* p = static_cast<char*>(data);
+    while(bytes > 0)
+    {
+        ssize_t n = read(fd, p, bytes);
+        if(n <= 0)
+            return false;
+        p += n;
+        bytes -= n;
+    }
+    return true;
+}
+
+inline bool writeFull(int fd, const void* data, size_t bytes)
+{
+    const char* p = static_cast<const char*>(data);
+    while(bytes > 0)
+    {
+        ssize_t n = write(fd, p, bytes);
+        if(n <= 0)
+            return false;
+        p += n;
+        bytes -= n;
+    }
+    return true;
+}
+
+// Worker side: renders requested tiles until told to stop or the coordinator goes away.
+// failAfter > 0 makes the worker die after that many tiles, to exercise the coordinator's recovery.
+inline void runRenderWorker(camera& cam, tlas& t, int in, int out, int failAfter)
+{
+    cam.prepare();
+    std::vector<color> pixels;
+    tileRequest request;
+    for(int done = 0; readFull(in, &request, sizeof(request)) && request.x0 >= 0; done++)
+    {
+        if(failAfter > 0 && done == failAfter)
+            _exit(1);
+
+        tile tl{request.x0, request.y0, request.x1, request.y1};
+        pixels.resize((tl.x1 - tl.x0) * (tl.y1 - tl.y0));
+        cam.renderTile(tl, t, pixels.data());
+
+        tileResult result{request.x0, request.y0, (int32_t)pixels.size()};
+        if(!writeFull(out, &result, sizeof(result)) || !writeFull(out, pixels.data(), pixels.size() * sizeof(color)))
+            break;
+    }
+}
+
+class renderCoordinator
+{
+public:
+    int inFlightPerWorker = 2;      // Tiles queued at each worker so it never waits on the coordinator
+    double startupTimeoutMs = 600000.0; // Longest wait for a worker's first tile, which includes loading the scene
+    double tileTimeoutMs = 60000.0;     // Longest wait for any later tile before the worker is killed as hung
+
+    // Starts workers copies of executable with args and renders cam's frame with them. failWorkerAfter
+    // is passed to the first worker only.
+    bool render(camera& cam, const std::string& executable, const std::vector<std::string>& args, int workers, int failWorkerAfter = 0)
+    {
+        signal(SIGPIPE, SIG_IGN);
+        cam.prepare();
+        int width = cam.imageWidth;
+        int height = cam.height();
+        framebuffer image(width, height, cam.framebufferFormat);
+
+        tileScheduler scheduler;
+        scheduler.order = cam.tileOrdering;
+        scheduler.tileSize = cam.tileSize;
+        scheduler.splitExpensive = false;       // Tiles are drained up front here and never reported finished
+        scheduler.build(width, height, workers);
+        std::deque<tile> pending;
+        for(tile tl; scheduler.next(tl); )
+            pending.push_back(tl);
+        int total = (int)pending.size();
+
+        auto start = std::chrono::steady_clock::now();
+        for(int i = 0; i < workers; i++)
+            spawn(executable, args, i == 0 ? failWorkerAfter : 0);
+
+        int done = 0;
+        std::vector<color> pixels;
+        while(done < total)
+        {
+            // Top every live worker up, failed tiles go out again first since they are at the front
+            for(workerProcess& w : pool)
+            {
+                while(w.alive && !pending.empty() && (int)w.inFlight.size() < inFlightPerWorker)
+                {
+                    tile tl = pending.front();
+                    tileRequest request{tl.x0, tl.y0, tl.x1, tl.y1};
+                    if(!writeFull(w.toWorker, &request, sizeof(request)))
+                    {
+                        fail(w, pending);
+                        break;
+                    }
+                    pending.pop_front();
+                    if(w.inFlight.empty())
+                        w.lastProgress = std::chrono::steady_clock::now();
+                    w.inFlight.push_back(tl);
+                }
+            }
+
+            // Wait for a result until the busy worker closest to its deadline runs out of time
+            std::vector<pollfd> fds;
+            std::vector<int> owners;
+            double wait = -1.0;
+            for(int i = 0; i < (int)pool.size(); i++)
+            {
+                if(pool[i].alive && !pool[i].inFlight.empty())
+                {
+                    fds.push_back({pool[i].fromWorker, POLLIN, 0});
+                    owners.push_back(i);
+                    double left = std::max(timeLeft(pool[i]), 0.0);
+                    wait = wait < 0.0 ? left : std::min(wait, left);
+                }
+            }
+            if(fds.empty())
+            {
+                std::cout << "DISTRIBUTED: every worker failed, " << total - done << " tile(s) not rendered\n";
+                break;
+            }
+            if(poll(fds.data(), fds.size(), (int)std::ceil(wait)) < 0)
+                continue;
+
+            for(int i = 0; i < (int)fds.size(); i++)
+            {
+                workerProcess& w = pool[owners[i]];
+                if(fds[i].revents == 0)
+                {
+                    if(timeLeft(w) <= 0.0)
+                    {
+                        hung++;
+                        fail(w, pending);
+                    }
+                    continue;
+                }
+
+                tile tl = w.inFlight.front();
+                int tilePixels = (tl.x1 - tl.x0) * (tl.y1 - tl.y0);
+                tileResult result;
+                pixels.resize(tilePixels);
+                if(!readFull(w.fromWorker, &result, sizeof(result)) || result.x0 != tl.x0 || result.y0 != tl.y0
+                   || result.pixelCount != tilePixels || !readFull(w.fromWorker, pixels.data(), tilePixels * sizeof(color)))
+                {
+                    fail(w, pending);
+                    continue;
+                }
+
+                int tileWidth = tl.x1 - tl.x0;
+                for(int y = tl.y0; y < tl.y1; y++)
+                    image.store(tl.x0, y, &pixels[(y - tl.y0) * tileWidth], tileWidth);
+                w.inFlight.pop_front();
+                w.tilesDone++;
+                w.lastProgress = std::chrono::steady_clock::now();
+                done++;
+            }
+        }
+
+        shutdownWorkers();
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+        std::cout << "DISTRIBUTED: " << done << " of " << total << " tiles by " << pool.size() << " worker process(es) in "
+                  << ms << " ms, " << failures << " failed (" << hung << " timed out), " << reassigned << " tile(s) reassigned\n";
+        for(int i = 0; i < (int)pool.size(); i++)
+            std::cout << "  worker " << i << ": " << pool[i].tilesDone << " tiles" << (pool[i].alive ? "" : " (failed)") << '\n';
+
+        pool.clear();
+        if(done < total)
+            return false;
+
+        cam.writeImage(image);
+        return true;
+    }
+
+private:
+    struct workerProcess
+    {
+        pid_t pid = -1;
+        int toWorker = -1;
+        int fromWorker = -1;
+        bool alive = false;
+        int tilesDone = 0;
+        std::deque<tile> inFlight;
+        std::chrono::steady_clock::time_point lastProgress{};  // Last result, or when it got work while idle
+    };
+
+    std::vector<workerProcess> pool;
+    int failures = 0;
+    int hung = 0;
+    int reassigned = 0;
+
+    // Milliseconds the worker has left to deliver its next tile
+    double timeLeft(const workerProcess& w) const
+    {
+        double limit = w.tilesDone == 0 ? startupTimeoutMs : tileTimeoutMs;
+        return limit - std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - w.lastProgress).count();
+    }
+
+    static void closeOnExec(int fd)
+    {
+        fcntl(fd, F_SETFD, fcntl(fd, F_GETFD) | FD_CLOEXEC);
+    }
+
+    void spawn(const std::string& executable, const std::vector<std::string>& args, int failAfter)
+    {
+        int requests[2], results[2];
+        if(pipe(requests) != 0)
+            return;
+        if(pipe(results) != 0)
+        {
+            close(requests[0]);
+            close(requests[1]);
+            return;
+        }
+
+        // Every end is close on exec, so no worker keeps a sibling's pipe open and hides its death
+        for(int fd : {requests[0], requests[1], results[0], results[1]})
+            closeOnExec(fd);
+
+        pid_t pid = fork();
+        if(pid == 0)
+        {
+            fcntl(requests[0], F_SETFD, 0);
+            fcntl(results[1], F_SETFD, 0);
+
+            std::vector<std::string> workerArgs = args;
+            workerArgs.insert(workerArgs.end(), {"--worker", std::to_string(requests[0]), std::to_string(results[1])});
+            if(failAfter > 0)
+                workerArgs.insert(workerArgs.end(), {"--fail-after", std::to_string(failAfter)});
+
+            std::vector<char*> argv;
+            argv.push_back(const_cast<char*>(executable.c_str()));
+            for(std::string& arg : workerArgs)
+                argv.push_back(const_cast<char*>(arg.c_str()));
+            argv.push_back(nullptr);
+
+            // Worker logs would interleave with the coordinator's
+            int devNull = open("/dev/null", O_WRONLY);
+            if(devNull >= 0)
+                dup2(devNull, STDOUT_FILENO);
+
+            execv(executable.c_str(), argv.data());
+            _exit(127);
+        }
+
+        close(requests[0]);
+        close(results[1]);
+        if(pid < 0)
+        {
+            close(requests[1]);
+            close(results[0]);
+            return;
+        }
+
+        workerProcess w;
+        w.pid = pid;
+        w.toWorker = requests[1];
+        w.fromWorker = results[0];
+        w.alive = true;
+        pool.push_back(std::move(w));
+    }
+
+    void fail(workerProcess& w, std::deque<tile>& pending)
+    {
+        w.alive = false;
+        failures++;
+        reassigned += (int)w.inFlight.size();
+        pending.insert(pending.begin(), w.inFlight.begin(), w.inFlight.end());
+        w.inFlight.clear();
+        close(w.toWorker);
+        close(w.fromWorker);
+
+        // A worker that stopped answering may still be running, or stuck
+        kill(w.pid, SIGKILL);
+        waitpid(w.pid, nullptr, 0);
+    }
+
+    void shutdownWorkers()
+    {
+        for(workerProcess& w : pool)
+        {
+            if(!w.alive)
+                continue;
+
+            tileRequest quit{-1, -1, -1, -1};
+            writeFull(w.toWorker, &quit, sizeof(quit));
+            close(w.toWorker);
+            close(w.fromWorker);
+            waitpid(w.pid, nullptr, 0);
+        }
+    }
+};
+
+#endif
+
+#endif
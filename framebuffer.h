@@ -0,0 +1,335 @@
+#ifndef FRAMEBUFFER_H
+#define FRAMEBUFFER_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "color.h"
+
+// Storage format of the final image. Tiles accumulate in float and are converted once per pixel
+// when they are flushed, so the full frame never exists as 12 byte float colors.
+enum class pixelFormat
+{
+    rgb8,       // 3 bytes, display encoded exactly like the PPM output, for previews
+    half,       // 6 bytes, half float RGB, HDR
+    rgb9e5,     // 4 bytes, shared exponent RGB, HDR
+};
+
+inline const char* pixelFormatName(pixelFormat f)
+{
+    switch(f)
+    {
+        case pixelFormat::half: return "half";
+        case pixelFormat::rgb9e5: return "rgb9e5";
+        default: return "rgb8";
+    }
+}
+
+inline bool parsePixelFormat(const std::string& name, pixelFormat& f)
+{
+    if(name == "rgb8") f = pixelFormat::rgb8;
+    else if(name == "half") f = pixelFormat::half;
+    else if(name == "rgb9e5") f = pixelFormat::rgb9e5;
+    else return false;
+    return true;
+}
+
+// IEEE half with round to nearest even, overflow goes to infinity and NaN stays NaN
+inline uint16_t floatToHalf(float value)
+{
+    uint32_t bits;
+    std::memcpy(&bits, &value, 4);
+    uint32_t sign = (bits >> 16) & 0x8000u;
+    uint32_t magnitude = bits & 0x7fffffffu;
+
+    if(magnitude >= 0x7f800000u)
+        return (uint16_t)(sign | 0x7c00u | (magnitude > 0x7f800000u ? 0x200u : 0u));
+    if(magnitude >= 0x477ff000u)    // Rounds to 65536 or more
+        return (uint16_t)(sign | 0x7c00u);
+    if(magnitude < 0x38800000u)     // Below the smallest normal half: denormal or zero
+    {
+        if(magnitude < 0x33000000u)
+            return (uint16_t)sign;
+        int shift = 126 - (int)(magnitude >> 23);
+        uint32_t mantissa = (magnitude & 0x7fffffu) | 0x800000u;
+        uint32_t half = mantissa >> shift;
+        uint32_t rest = mantissa & ((1u << shift) - 1);
+        uint32_t halfway = 1u << (shift - 1);
+        if(rest > halfway || (rest == halfway && (half & 1u)))
+            half++;
+        return (uint16_t)(sign | half);
+    }
+
+    uint32_t half = ((magnitude - 0x38000000u) >> 13);
+    uint32_t rest = magnitude & 0x1fffu;
+    if(rest > 0x1000u || (rest == 0x1000u && (half & 1u)))
+        half++;
+    return (uint16_t)(sign | half);
+}
+
+inline float halfToFloat(uint16_t h)
+{
+    uint32_t sign = (uint32_t)(h & 0x8000u) << 16;
+    uint32_t exponent = (h >> 10) & 0x1fu;
+    uint32_t mantissa = h & 0x3ffu;
+    uint32_t bits;
+    if(exponent == 0x1fu)
+        bits = sign | 0x7f800000u | (mantissa << 13);
+    else if(exponent != 0)
+        bits = sign | ((exponent + 112) << 23) | (mantissa << 13);
+    else if(mantissa == 0)
+        bits = sign;
+    else
+    {
+        // Denormal half, normalize it for the float
+        exponent = 113;
+        while(!(mantissa & 0x400u))
+        {
+            mantissa <<= 1;
+            exponent--;
+        }
+        bits = sign | (exponent << 23) | ((mantissa & 0x3ffu) << 13);
+    }
+    float f;
+    std::memcpy(&f, &bits, 4);
+    return f;
+}
+
+// Shared exponent encoding of GL_EXT_texture_shared_exponent: 9 bit mantissas and a 5 bit exponent
+// with bias 15. Negative and NaN channels become 0.
+inline uint32_t colorToRgb9e5(const color& c)
+{
+    const float maxValue = 65408.0f;    // (511 / 512) * 2^16
+    float r = std::min(std::max(c.x(), 0.0f), maxValue);
+    float g = std::min(std::max(c.y(), 0.0f), maxValue);
+    float b = std::min(std::max(c.z(), 0.0f), maxValue);
+    r = r == r ? r : 0.0f;
+    g = g == g ? g : 0.0f;
+    b = b == b ? b : 0.0f;
+    float largest = std::max(r, std::max(g, b));
+    if(largest < 1.52587890625e-5f * (1.0f / 512.0f))
+        return 0;
+
+    int exponent = std::max(-16, (int)std::floor(std::log2(largest))) + 16;
+    float scale = std::ldexp(1.0f, exponent - 15 - 9);
+    if((int)std::floor(largest / scale + 0.5f) == 512)
+    {
+        exponent++;
+        scale *= 2.0f;
+    }
+
+    uint32_t rm = (uint32_t)std::floor(r / scale + 0.5f);
+    uint32_t gm = (uint32_t)std::floor(g / scale + 0.5f);
+    uint32_t bm = (uint32_t)std::floor(b / scale + 0.5f);
+    return rm | (gm << 9) | (bm << 18) | ((uint32_t)exponent << 27);
+}
+
+inline color rgb9e5ToColor(uint32_t v)
+{
+    float scale = std::ldexp(1.0f, (int)(v >> 27) - 15 - 9);
+    return color{(v & 0x1ffu) * scale, ((v >> 9) & 0x1ffu) * scale, ((v >> 18) & 0x1ffu) * scale};
+}
+
+// The byte writeColor puts in the PPM for a linear value, computed in float
+inline uint8_t displayByte(float linear)
+{
+    float g = linearToGamma(linear);
+    return (uint8_t)(int)(256.0f * std::min(std::max(g, 0.0f), 0.999f));
+}
+
+// Final image in one of the compact formats
+class framebuffer
+{
+public:
+    int width = 0;
+    int height = 0;
+    pixelFormat format = pixelFormat::rgb8;
+
+    framebuffer(){}
+    framebuffer(int w, int h, pixelFormat f) : width(w), height(h), format(f), data((size_t)w * h * pixelBytes(f), 0) {}
+
+    static size_t pixelBytes(pixelFormat f)
+    {
+        return f == pixelFormat::half ? 6 : f == pixelFormat::rgb9e5 ? 4 : 3;
+    }
+
+    size_t bytes() const { return data.size(); }
+
+    // Converts count pixels starting at x, y
+    void store(int x, int y, const color* pixels, int count)
+    {
+        uint8_t* out = &data[((size_t)y * width + x) * pixelBytes(format)];
+        for(int i = 0; i < count; i++)
+        {
+            const color& c = pixels[i];
+            switch(format)
+            {
+                case pixelFormat::rgb8:
+                    out[0] = displayByte(c.x());
+                    out[1] = displayByte(c.y());
+                    out[2] = displayByte(c.z());
+                    out += 3;
+                    break;
+                case pixelFormat::half:
+                {
+                    uint16_t h[3] = {floatToHalf(c.x()), floatToHalf(c.y()), floatToHalf(c.z())};
+                    std::memcpy(out, h, 6);
+                    out += 6;
+                    break;
+                }
+                case pixelFormat::rgb9e5:
+                {
+                    uint32_t v = colorToRgb9e5(c);
+                    std::memcpy(out, &v, 4);
+                    out += 4;
+                    break;
+                }
+            }
+        }
+    }
+
+    // Linear color of a pixel; rgb8 pixels are decoded from the display encoding
+    color load(int x, int y) const
+    {
+        const uint8_t* in = &data[((size_t)y * width + x) * pixelBytes(format)];
+        switch(format)
+        {
+            case pixelFormat::half:
+            {
+                uint16_t h[3];
+                std::memcpy(h, in, 6);
+                return color{halfToFloat(h[0]), halfToFloat(h[1]), halfToFloat(h[2])};
+            }
+            case pixelFormat::rgb9e5:
+            {
+                uint32_t v;
+                std::memcpy(&v, in, 4);
+                return rgb9e5ToColor(v);
+            }
+            default:
+                return displayDecode(in);
+        }
+    }
+
+    // PPM as before, or a little endian PFM keeping the HDR values when the path ends in .pfm
+    bool write(const std::string& path) const
+    {
+        std::ofstream out(path, std::ios::binary);
+        if(!out)
+            return false;
+
+        if(path.size() >= 4 && path.compare(path.size() - 4, 4, ".pfm") == 0)
+        {
+            out << "PF\n" << width << " " << height << "\n-1.0\n";
+            std::vector<float> row(3 * width);
+            for(int y = height - 1; y >= 0; y--)
+            {
+                for(int x = 0; x < width; x++)
+                {
+                    color c = load(x, y);
+                    row[3 * x] = c.x();
+                    row[3 * x + 1] = c.y();
+                    row[3 * x + 2] = c.z();
+                }
+                out.write(reinterpret_cast<const char*>(row.data()), row.size() * sizeof(float));
+            }
+            return (bool)out;
+        }
+
+        out << "P3\n" << width << " " << height << " \n255\n";
+        for(int y = 0; y < height; y++)
+        {
+            for(int x = 0; x < width; x++)
+            {
+                if(format == pixelFormat::rgb8)
+                {
+                    const uint8_t* p = &data[((size_t)y * width + x) * 3];
+                    out << (int)p[0] << ' ' << (int)p[1] << ' ' << (int)p[2] << '\n';
+                }
+                else
+                {
+                    color c = load(x, y);
+                    out << (int)displayByte(c.x()) << ' ' << (int)displayByte(c.y()) << ' ' << (int)displayByte(c.z()) << '\n';
+                }
+            }
+        }
+        return (bool)out;
+    }
+
+    // Reads a PPM or PFM written by write() into this format, resizing to the file's dimensions
+    bool read(const std::string& path)
+    {
+        std::ifstream in(path, std::ios::binary);
+        std::string magic;
+        int w = 0, h = 0;
+        if(!(in >> magic >> w >> h) || w <= 0 || h <= 0 || (magic != "P3" && magic != "PF"))
+            return false;
+
+        framebuffer image(w, h, format);
+        std::vector<color> row(w);
+        if(magic == "PF")
+        {
+            float scale;
+            if(!(in >> scale) || scale >= 0.0f)     // Only the little endian files write() makes
+                return false;
+            in.get();
+            std::vector<float> values(3 * w);
+            for(int y = h - 1; y >= 0; y--)
+            {
+                if(!in.read(reinterpret_cast<char*>(values.data()), values.size() * sizeof(float)))
+                    return false;
+                for(int x = 0; x < w; x++)
+                    row[x] = color{values[3 * x], values[3 * x + 1], values[3 * x + 2]};
+                image.store(0, y, row.data(), w);
+            }
+        }
+        else
+        {
+            int maxValue, r, g, b;
+            if(!(in >> maxValue) || maxValue != 255)
+                return false;
+            for(int y = 0; y < h; y++)
+            {
+                for(int x = 0; x < w; x++)
+                {
+                    if(!(in >> r >> g >> b))
+                        return false;
+                    uint8_t bytes[3] = {(uint8_t)r, (uint8_t)g, (uint8_t)b};
+                    if(format == pixelFormat::rgb8)
+                        std::memcpy(&image.data[((size_t)y * w + x) * 3], bytes, 3);
+                    else
+                        row[x] = displayDecode(bytes);
+                }
+                if(format != pixelFormat::rgb8)
+                    image.store(0, y, row.data(), w);
+            }
+        }
+
+        *this = std::move(image);
+        return true;
+    }
+
+    void report(std::ostream& out) const
+    {
+        const double mb = 1.0 / (1024.0 * 1024.0);
+        out << "FRAMEBUFFER: " << width << "x" << height << " " << pixelFormatName(format) << ", " << bytes() * mb
+            << " MB (" << (double)width * height * sizeof(color) * mb << " MB as float colors)\n";
+    }
+
+private:
+    std::vector<uint8_t> data;
+
+    // Linear color at the middle of the range of values that display encode to these bytes
+    static color displayDecode(const uint8_t* bytes)
+    {
+        auto linear = [](uint8_t b) { float g = (b + 0.5f) / 256.0f; return g * g; };
+        return color{linear(bytes[0]), linear(bytes[1]), linear(bytes[2])};
+    }
+};
+
+#endif
@@ -0,0 +1,411 @@
+#ifndef IMAGE_H
+#define IMAGE_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <vector>
+
+// 8 bit RGBA image decoded from a PNG or binary PPM file. The PNG decoder is self contained (zlib
+// inflate included) and handles every non-interlaced color type and bit depth.
+struct image
+{
+    int width = 0;
+    int height = 0;
+    std::vector<uint8_t> rgba;
+};
+
+// Raw DEFLATE decoder after zlib's puff.c, trading speed for size since textures are decoded once
+class inflater
+{
+public:
+    inflater(const uint8_t* data, size_t size) : data(data), size(size) {}
+
+    bool inflate(std::vector<uint8_t>& out)
+    {
+        int last;
+        do
+        {
+            last = bits(1);
+            int type = bits(2);
+            if(type == 0) stored(out);
+            else if(type == 1) fixed(out);
+            else if(type == 2) dynamic(out);
+            else failed = true;
+        } while(!last && !failed);
+        return !failed;
+    }
+
+private:
+    struct huffman
+    {
+        uint16_t counts[16];
+        uint16_t symbols[320];
+    };
+
+    const uint8_t* data;
+    size_t size;
+    size_t pos = 0;
+    uint32_t bitBuffer = 0;
+    int bitCount = 0;
+    bool failed = false;
+
+    int bits(int n)
+    {
+        while(bitCount < n)
+        {
+            if(pos >= size)
+            {
+                failed = true;
+                return 0;
+            }
+            bitBuffer |= (uint32_t)data[pos++] << bitCount;
+            bitCount += 8;
+        }
+        int value = bitBuffer & ((1u << n) - 1);
+        bitBuffer >>= n;
+        bitCount -= n;
+        return value;
+    }
+
+    static void build(huffman& h, const uint8_t* lengths, int n)
+    {
+        std::memset(h.counts, 0, sizeof(h.counts));
+        for(int i = 0; i < n; i++)
+            h.counts[lengths[i]]++;
+        h.counts[0] = 0;
+
+        uint16_t offsets[16];
+        offsets[1] = 0;
+        for(int len = 1; len < 15; len++)
+            offsets[len + 1] = offsets[len] + h.counts[len];
+        for(int i = 0; i < n; i++)
+            if(lengths[i] != 0)
+                h.symbols[offsets[lengths[i]]++] = (uint16_t)i;
+    }
+
+    int decode(const huffman& h)
+    {
+        int code = 0, first = 0, index = 0;
+        for(int len = 1; len < 16; len++)
+        {
+            code |= bits(1);
+            int count = h.counts[len];
+            if(code - count < first)
+                return h.symbols[index + (code - first)];
+            index += count;
+            first = (first + count) << 1;
+            code <<= 1;
+        }
+        failed = true;
+        return 0;
+    }
+
+    void stored(std::vector<uint8_t>& out)
+    {
+        bitBuffer = 0;
+        bitCount = 0;
+        if(pos + 4 > size)
+        {
+            failed = true;
+            return;
+        }
+        size_t len = data[pos] | (data[pos + 1] << 8);
+        pos += 4;
+        if(pos + len > size)
+        {
+            failed = true;
+            return;
+        }
+        out.insert(out.end(), data + pos, data + pos + len);
+        pos += len;
+    }
+
+    void codes(std::vector<uint8_t>& out, const huffman& lengthCodes, const huffman& distCodes)
+    {
+        static const uint16_t lengthBase[29] = {3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+        static const uint16_t lengthExtra[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+        static const uint16_t distBase[30] = {1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073,
+                                              4097, 6145, 8193, 12289, 16385, 24577};
+        static const uint16_t distExtra[30] = {0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+
+        while(!failed)
+        {
+            int symbol = decode(lengthCodes);
+            if(symbol < 256)
+            {
+                out.push_back((uint8_t)symbol);
+                continue;
+            }
+            if(symbol == 256)
+                return;
+
+            symbol -= 257;
+            if(symbol >= 29)
+            {
+                failed = true;
+                return;
+            }
+            int len = lengthBase[symbol] + bits(lengthExtra[symbol]);
+            int distSymbol = decode(distCodes);
+            if(distSymbol >= 30)
+            {
+                failed = true;
+                return;
+            }
+            size_t dist = distBase[distSymbol] + bits(distExtra[distSymbol]);
+            if(dist > out.size())
+            {
+                failed = true;
+                return;
+            }
+            size_t from = out.size() - dist;
+            for(int i = 0; i < len; i++)
+                out.push_back(out[from + i]);
+        }
+    }
+
+    void fixed(std::vector<uint8_t>& out)
+    {
+        uint8_t lengths[320];
+        int i = 0;
+        for(; i < 144; i++) lengths[i] = 8;
+        for(; i < 256; i++) lengths[i] = 9;
+        for(; i < 280; i++) lengths[i] = 7;
+        for(; i < 288; i++) lengths[i] = 8;
+        huffman lengthCodes, distCodes;
+        build(lengthCodes, lengths, 288);
+        for(i = 0; i < 30; i++) lengths[i] = 5;
+        build(distCodes, lengths, 30);
+        codes(out, lengthCodes, distCodes);
+    }
+
+    void dynamic(std::vector<uint8_t>& out)
+    {
+        static const uint8_t order[19] = {16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
+        int lengthCount = bits(5) + 257;
+        int distCount = bits(5) + 1;
+        int codeCount = bits(4) + 4;
+        if(lengthCount > 286 || distCount > 30)
+        {
+            failed = true;
+            return;
+        }
+
+        uint8_t lengths[320] = {};
+        for(int i = 0; i < codeCount; i++)
+            lengths[order[i]] = (uint8_t)bits(3);
+        huffman lengthCodes, distCodes;
+        build(lengthCodes, lengths, 19);
+
+        int index = 0;
+        while(index < lengthCount + distCount && !failed)
+        {
+            int symbol = decode(lengthCodes);
+            if(symbol < 16)
+            {
+                lengths[index++] = (uint8_t)symbol;
+                continue;
+            }
+
+            uint8_t len = 0;
+            int repeat;
+            if(symbol == 16)
+            {
+                if(index == 0)
+                {
+                    failed = true;
+                    return;
+                }
+                len = lengths[index - 1];
+                repeat = 3 + bits(2);
+            }
+            else if(symbol == 17)
+                repeat = 3 + bits(3);
+            else
+                repeat = 11 + bits(7);
+
+            if(index + repeat > lengthCount + distCount)
+            {
+                failed = true;
+                return;
+            }
+            while(repeat--)
+                lengths[index++] = len;
+        }
+
+        build(lengthCodes, lengths, lengthCount);
+        build(distCodes, lengths + lengthCount, distCount);
+        codes(out, lengthCodes, distCodes);
+    }
+};
+
+inline uint32_t readBigEndian(const uint8_t* p)
+{
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+inline int paeth(int a, int b, int c)
+{
+    int p = a + b - c;
+    int pa = std::abs(p - a), pb = std::abs(p - b), pc = std::abs(p - c);
+    if(pa <= pb && pa <= pc) return a;
+    return pb <= pc ? b : c;
+}
+
+inline bool decodePng(const std::vector<uint8_t>& file, image& img)
+{
+    static const uint8_t signature[8] = {137, 80, 78, 71, 13, 10, 26, 10};
+    if(file.size() < 8 || std::memcmp(file.data(), signature, 8) != 0)
+        return false;
+
+    int depth = 0, colorType = 0, interlace = 0;
+    std::vector<uint8_t> idat, palette, paletteAlpha;
+    for(size_t pos = 8; pos + 8 <= file.size(); )
+    {
+        uint32_t len = readBigEndian(&file[pos]);
+        const uint8_t* type = &file[pos + 4];
+        const uint8_t* chunk = &file[pos + 8];
+        if(pos + 12 + len > file.size())
+            return false;
+
+        if(std::memcmp(type, "IHDR", 4) == 0)
+        {
+            if(len < 13)
+                return false;
+            img.width = readBigEndian(chunk);
+            img.height = readBigEndian(chunk + 4);
+            depth = chunk[8];
+            colorType = chunk[9];
+            interlace = chunk[12];
+        }
+        else if(std::memcmp(type, "PLTE", 4) == 0)
+            palette.assign(chunk, chunk + len);
+        else if(std::memcmp(type, "tRNS", 4) == 0)
+            paletteAlpha.assign(chunk, chunk + len);
+        else if(std::memcmp(type, "IDAT", 4) == 0)
+            idat.insert(idat.end(), chunk, chunk + len);
+        else if(std::memcmp(type, "IEND", 4) == 0)
+            break;
+        pos += 12 + len;
+    }
+
+    const int channelsOf[7] = {1, 0, 3, 1, 2, 0, 4};
+    if(img.width <= 0 || img.height <= 0 || interlace != 0 || colorType > 6 || channelsOf[colorType] == 0 || idat.size() < 2)
+        return false;
+
+    // Bit depths the format allows for each color type
+    bool depthAllowed = colorType == 3 ? depth == 1 || depth == 2 || depth == 4 || depth == 8
+                      : colorType == 0 ? depth == 1 || depth == 2 || depth == 4 || depth == 8 || depth == 16
+                      : depth == 8 || depth == 16;
+    if(!depthAllowed)
+        return false;
+
+    // zlib stream: two header bytes, raw deflate, adler32 which is not checked
+    std::vector<uint8_t> raw;
+    inflater zlib(idat.data() + 2, idat.size() - 2);
+    if(!zlib.inflate(raw))
+        return false;
+
+    int channels = channelsOf[colorType];
+    size_t stride = ((size_t)img.width * channels * depth + 7) / 8;
+    int bpp = std::max(1, channels * depth / 8);
+    if(raw.size() < (stride + 1) * img.height)
+        return false;
+
+    std::vector<uint8_t> prior(stride, 0);
+    img.rgba.resize((size_t)img.width * img.height * 4);
+    for(int y = 0; y < img.height; y++)
+    {
+        uint8_t filter = raw[y * (stride + 1)];
+        uint8_t* line = &raw[y * (stride + 1) + 1];
+        for(size_t i = 0; i < stride; i++)
+        {
+            int a = i >= (size_t)bpp ? line[i - bpp] : 0;
+            int b = prior[i];
+            int c = i >= (size_t)bpp ? prior[i - bpp] : 0;
+            int add = filter == 1 ? a : filter == 2 ? b : filter == 3 ? (a + b) / 2 : filter == 4 ? paeth(a, b, c) : 0;
+            line[i] = (uint8_t)(line[i] + add);
+        }
+        std::memcpy(prior.data(), line, stride);
+
+        for(int x = 0; x < img.width; x++)
+        {
+            // Samples scaled to 8 bits, 16 bit samples keep their high byte
+            uint8_t s[4] = {0, 0, 0, 255};
+            for(int ch = 0; ch < channels; ch++)
+            {
+                if(depth == 8)
+                    s[ch] = line[x * channels + ch];
+                else if(depth == 16)
+                    s[ch] = line[(x * channels + ch) * 2];
+                else
+                {
+                    size_t bit = (size_t)(x * channels + ch) * depth;
+                    int value = (line[bit / 8] >> (8 - depth - bit % 8)) & ((1 << depth) - 1);
+                    s[ch] = colorType == 3 ? (uint8_t)value : (uint8_t)(value * 255 / ((1 << depth) - 1));
+                }
+            }
+
+            uint8_t* out = &img.rgba[((size_t)y * img.width + x) * 4];
+            switch(colorType)
+            {
+                case 0: out[0] = out[1] = out[2] = s[0]; out[3] = 255; break;
+                case 2: out[0] = s[0]; out[1] = s[1]; out[2] = s[2]; out[3] = 255; break;
+                case 3:
+                {
+                    int idx = s[0];
+                    bool valid = idx * 3 + 2 < (int)palette.size();
+                    out[0] = valid ? palette[idx * 3] : 0;
+                    out[1] = valid ? palette[idx * 3 + 1] : 0;
+                    out[2] = valid ? palette[idx * 3 + 2] : 0;
+                    out[3] = idx < (int)paletteAlpha.size() ? paletteAlpha[idx] : 255;
+                    break;
+                }
+                case 4: out[0] = out[1] = out[2] = s[0]; out[3] = s[1]; break;
+                case 6: out[0] = s[0]; out[1] = s[1]; out[2] = s[2]; out[3] = s[3]; break;
+            }
+        }
+    }
+    return true;
+}
+
+// Binary P6 with maxval 255, the format the renderer can also be pointed at for quick tests
+inline bool decodePpm(const std::vector<uint8_t>& file, image& img)
+{
+    std::string header(file.begin(), file.begin() + std::min<size_t>(file.size(), 64));
+    int maxval = 0, consumed = 0;
+    if(std::sscanf(header.c_str(), "P6 %d %d %d%n", &img.width, &img.height, &maxval, &consumed) != 3 || maxval != 255)
+        return false;
+
+    size_t offset = consumed + 1;
+    size_t pixels = (size_t)img.width * img.height;
+    if(file.size() < offset + pixels * 3)
+        return false;
+
+    img.rgba.resize(pixels * 4);
+    for(size_t i = 0; i < pixels; i++)
+    {
+        img.rgba[i * 4] = file[offset + i * 3];
+        img.rgba[i * 4 + 1] = file[offset + i * 3 + 1];
+        img.rgba[i * 4 + 2] = file[offset + i * 3 + 2];
+        img.rgba[i * 4 + 3] = 255;
+    }
+    return true;
+}
+
+inline bool loadImage(const std::string& path, image& img)
+{
+    std::ifstream in(path, std::ios::binary);
+    if(!in)
+        return false;
+    std::vector<uint8_t> file((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    return decodePng(file, img) || decodePpm(file, img);
+}
+
+#endif
@@ -0,0 +1,671 @@
+#ifndef IMPORTER_H
+#define IMPORTER_H
+
+#include <assimp/Importer.hpp>
+#include <assimp/scene.h>
+#include <assimp/postprocess.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "scene.h"
+
+// Wall clock time of each import stage plus the CPU time summed over the workers for the
+// per mesh stages, which run interleaved
+struct importTimings
+{
+    double readMs = 0;
+    double convertCpuMs = 0;
+    double bvhCpuMs = 0;
+    double meshStageMs = 0;     // Wall clock of the parallel convert + BLAS build stage
+    double tlasMs = 0;
+    double totalMs = 0;
+
+    void report(std::ostream& out) const
+    {
+        out << "IMPORT: read " << readMs << " ms, convert + blas " << meshStageMs << " ms (convert " << convertCpuMs
+            << " ms cpu, blas " << bvhCpuMs << " ms cpu), tlas " << tlasMs << " ms, total " << totalMs << " ms\n";
+    }
+};
+
+struct importOptions
+{
+    int threads = 1;
+    bool optimizeLayout = true;     // Depth first node reordering of every BLAS and the TLAS
+    bool stackless = false;         // Stackless traversal for every tree, not just the ones too deep for the fixed stacks
+    bool regroupBlas = true;        // Merge small meshes and split large ones instead of one BLAS per mesh
+    bvhBuildProfile bvhProfile{};
+    bool quantizePositions = false; // 16 bit positions relative to the model bounds
+    bool compactIndices = true;     // 16 bit indices for meshes with at most 65536 vertices
+    std::string cachePath;          // When set, BLASes are written to this out-of-core cache instead of kept in memory
+    size_t residentBudget = 0;      // Bytes of BLAS data the pager may keep resident
+    bool materials = true;          // Without materials every model keeps the constant 0.5 albedo
+    size_t textureBudget = 512u << 20;  // Bytes of decoded mip levels the texture cache may keep resident
+    int lodLevels = 0;              // Simplified levels per model for wide secondary rays, none when out-of-core
+    float lodMaxError = 0.05f;      // Largest error of a level, as a fraction of its model's bounds diagonal
+
+    // Hash of every option that changes what goes into an out-of-core cache
+    uint64_t cacheFingerprint() const
+    {
+        uint64_t hash = 14695981039346656037ull;
+        bool flags[] = {optimizeLayout, stackless, regroupBlas, quantizePositions, compactIndices, materials};
+        hash = fingerprintBytes(hash, flags, sizeof(flags));
+        hash = fingerprintBytes(hash, bvhProfile.name, std::strlen(bvhProfile.name));
+        int counts[] = {bvhProfile.binCount, bvhProfile.maxLeafSize, bvhProfile.fullSweepBelow, lodLevels};
+        hash = fingerprintBytes(hash, counts, sizeof(counts));
+        float costs[] = {bvhProfile.traversalCost, bvhProfile.intersectCost, lodMaxError};
+        return fingerprintBytes(hash, costs, sizeof(costs));
+    }
+};
+
+inline double msSince(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+inline void gatherMeshes(const aiNode* node, const aiScene* imported, std::vector<const aiMesh*>& meshes)
+{
+    for(int i = 0; i < node->mNumMeshes; i++)
+    {
+        meshes.push_back(imported->mMeshes[node->mMeshes[i]]);
+    }
+
+    for(int i = 0; i < node->mNumChildren; i++)
+    {
+        gatherMeshes(node->mChildren[i], imported, meshes);
+    }
+}
+
+// Faces of one Assimp mesh that go into a model, all of them unless faces lists a subset
+struct meshPiece
+{
+    const aiMesh* mesh = nullptr;
+    std::vector<int> faces;
+    int vertexCount = 0;
+};
+
+// One model of the import, made of one or more meshes or of a chunk of one
+struct modelPlan
+{
+    std::vector<meshPiece> pieces;
+    aabb bounds{};
+    int vertexCount = 0;
+    int faceCount = 0;
+    int material = -1;
+    bool texcoords = false;
+};
+
+// Merges small neighbouring meshes into shared BLASes and splits large sprawling meshes into spatial
+// chunks. Both are decided by the SAH cost of the two-level tree, where a ray entering a model's box
+// pays for the TLAS leaf and the BLAS acquisition plus a descent of about log2 of its triangles.
+class blasRegrouper
+{
+public:
+    static constexpr int mergeBelow = 4096;             // Only models with fewer triangles are merged
+    static constexpr int maxMergedVertices = 65536;     // Merged models keep 16 bit indices
+    static constexpr int splitAbove = 65536;            // Only meshes with more triangles are split
+    static constexpr int minChunkTriangles = 8192;
+
+    int meshCount = 0;
+    int mergedMeshes = 0;       // Meshes that ended up sharing a model
+    int mergedModels = 0;       // Models they were merged into
+    int splitMeshes = 0;
+    int chunks = 0;
+
+    static float entryCost(int triangles)
+    {
+        return 2.0f + std::log2(triangles + 1.0f);
+    }
+
+    static float cost(const aabb& bounds, int triangles)
+    {
+        return bounds.area() * entryCost(triangles);
+    }
+
+    // One model per mesh, or the regrouped models when optimize is set. materials keeps meshes of
+    // different materials apart since a model has a single material.
+    std::vector<modelPlan> plan(const std::vector<const aiMesh*>& meshes, bool materials, bool optimize)
+    {
+        meshCount = (int)meshes.size();
+        std::vector<modelPlan> plans;
+        for(const aiMesh* mesh : meshes)
+        {
+            if(optimize && (int)mesh->mNumFaces > splitAbove && split(mesh, materials, plans))
+                continue;
+
+            modelPlan p;
+            p.pieces.push_back({mesh, {}, (int)mesh->mNumVertices});
+            const aiAABB& b = mesh->mAABB;
+            p.bounds = aabb{point3{b.mMin.x, b.mMin.y, b.mMin.z}, point3{b.mMax.x, b.mMax.y, b.mMax.z}};
+            p.vertexCount = mesh->mNumVertices;
+            p.faceCount = mesh->mNumFaces;
+            p.material = materials ? (int)mesh->mMaterialIndex : -1;
+            p.texcoords = mesh->HasTextureCoords(0);
+            plans.push_back(std::move(p));
+        }
+
+        if(optimize)
+            merge(plans);
+        return plans;
+    }
+
+    void report(std::ostream& out, int models) const
+    {
+        out << "BLAS REGROUP: " << meshCount << " mesh(es) -> " << models << " BLAS, " << mergedMeshes << " merged into "
+            << mergedModels << ", " << splitMeshes << " split into " << chunks << " chunk(s)\n";
+    }
+
+private:
+    // Greedy passes pairing every small model with the partner that lowers the cost the most, until
+    // no pair does. Quadratic per pass, which only matters for scenes with thousands of small meshes.
+    void merge(std::vector<modelPlan>& plans)
+    {
+        std::vector<bool> alive(plans.size(), true);
+        std::vector<int> pieceCounts(plans.size(), 1);
+        bool merged = true;
+        while(merged)
+        {
+            merged = false;
+            for(int i = 0; i < (int)plans.size(); i++)
+            {
+                if(!alive[i] || plans[i].faceCount >= mergeBelow)
+                    continue;
+
+                int best = -1;
+                float bestGain = 0.0f;
+                float costI = cost(plans[i].bounds, plans[i].faceCount);
+                for(int j = i + 1; j < (int)plans.size(); j++)
+                {
+                    const modelPlan& other = plans[j];
+                    if(!alive[j] || other.faceCount >= mergeBelow || other.material != plans[i].material
+                       || plans[i].vertexCount + other.vertexCount > maxMergedVertices)
+                        continue;
+
+                    aabb both = plans[i].bounds;
+                    both.grow(other.bounds);
+                    float gain = costI + cost(other.bounds, other.faceCount) - cost(both, plans[i].faceCount + other.faceCount);
+                    if(gain > bestGain)
+                    {
+                        bestGain = gain;
+                        best = j;
+                    }
+                }
+                if(best < 0)
+                    continue;
+
+                modelPlan& into = plans[i];
+                modelPlan& from = plans[best];
+                for(meshPiece& piece : from.pieces)
+                    into.pieces.push_back(std::move(piece));
+                into.bounds.grow(from.bounds);
+                into.vertexCount += from.vertexCount;
+                into.faceCount += from.faceCount;
+                into.texcoords = into.texcoords || from.texcoords;
+                pieceCounts[i] += pieceCounts[best];
+                alive[best] = false;
+                merged = true;
+            }
+        }
+
+        std::vector<modelPlan> kept;
+        for(int i = 0; i < (int)plans.size(); i++)
+        {
+            if(!alive[i])
+                continue;
+            if(pieceCounts[i] > 1)
+            {
+                mergedMeshes += pieceCounts[i];
+                mergedModels++;
+            }
+            kept.push_back(std::move(plans[i]));
+        }
+        plans.swap(kept);
+    }
+
+    // Recursive binned SAH splits of the mesh's faces, accepted while the chunks cost less than the
+    // part they came from. Returns false when the mesh stays whole.
+    bool split(const aiMesh* mesh, bool materials, std::vector<modelPlan>& plans)
+    {
+        std::vector<aabb> faceBounds(mesh->mNumFaces);
+        std::vector<int> faces(mesh->mNumFaces);
+        for(int i = 0; i < (int)mesh->mNumFaces; i++)
+        {
+            faces[i] = i;
+            for(int k = 0; k < 3; k++)
+            {
+                const aiVector3D& v = mesh->mVertices[mesh->mFaces[i].mIndices[k]];
+                faceBounds[i].grow(point3{v.x, v.y, v.z});
+            }
+        }
+
+        size_t first = plans.size();
+        splitFaces(mesh, faces, faceBounds, materials, plans);
+        if(plans.size() - first == 1)
+        {
+            plans.pop_back();
+            return false;
+        }
+        splitMeshes++;
+        chunks += (int)(plans.size() - first);
+        return true;
+    }
+
+    void splitFaces(const aiMesh* mesh, std::vector<int>& faces, const std::vector<aabb>& faceBounds, bool materials, std::vector<modelPlan>& plans)
+    {
+        constexpr int binCount = 16;
+        int n = (int)faces.size();
+        aabb bounds{}, centroidBounds{};
+        for(int f : faces)
+        {
+            bounds.grow(faceBounds[f]);
+            centroidBounds.grow((faceBounds[f].min() + faceBounds[f].max()) * 0.5f);
+        }
+
+        float bestCost = cost(bounds, n);
+        int bestAxis = -1;
+        float bestPos = 0.0f;
+        for(int x = 0; n >= 2 * minChunkTriangles && x < 3; x++)
+        {
+            float lo = centroidBounds.min()[x], hi = centroidBounds.max()[x];
+            if(hi <= lo)
+                continue;
+
+            aabb binBounds[binCount];
+            int binFaces[binCount] = {};
+            float scale = binCount / (hi - lo);
+            for(int f : faces)
+            {
+                float c = 0.5f * (faceBounds[f].min()[x] + faceBounds[f].max()[x]);
+                int b = std::min(binCount - 1, (int)((c - lo) * scale));
+                binBounds[b].grow(faceBounds[f]);
+                binFaces[b]++;
+            }
+
+            for(int plane = 1; plane < binCount; plane++)
+            {
+                aabb left{}, right{};
+                int leftFaces = 0;
+                for(int b = 0; b < binCount; b++)
+                {
+                    if(binFaces[b] == 0)
+                        continue;
+                    (b < plane ? left : right).grow(binBounds[b]);
+                    leftFaces += b < plane ? binFaces[b] : 0;
+                }
+                if(leftFaces < minChunkTriangles || n - leftFaces < minChunkTriangles)
+                    continue;
+
+                float c = cost(left, leftFaces) + cost(right, n - leftFaces);
+                if(c < bestCost)
+                {
+                    bestCost = c;
+                    bestAxis = x;
+                    bestPos = lo + plane / scale;
+                }
+            }
+        }
+
+        if(bestAxis < 0)
+        {
+            modelPlan p;
+            meshPiece piece{mesh, faces, 0};
+            std::vector<bool> used(mesh->mNumVertices, false);
+            for(int f : faces)
+            {
+                for(int k = 0; k < 3; k++)
+                {
+                    unsigned v = mesh->mFaces[f].mIndices[k];
+                    piece.vertexCount += used[v] ? 0 : 1;
+                    used[v] = true;
+                }
+            }
+            p.bounds = bounds;
+            p.vertexCount = piece.vertexCount;
+            p.faceCount = n;
+            p.material = materials ? (int)mesh->mMaterialIndex : -1;
+            p.texcoords = mesh->HasTextureCoords(0);
+            p.pieces.push_back(std::move(piece));
+            plans.push_back(std::move(p));
+            return;
+        }
+
+        std::vector<int> left, right;
+        for(int f : faces)
+        {
+            float c = 0.5f * (faceBounds[f].min()[bestAxis] + faceBounds[f].max()[bestAxis]);
+            (c < bestPos ? left : right).push_back(f);
+        }
+        faces.clear();
+        faces.shrink_to_fit();
+        splitFaces(mesh, left, faceBounds, materials, plans);
+        splitFaces(mesh, right, faceBounds, materials, plans);
+    }
+};
+
+// Fills target with the faces of every piece in plan order. Whole meshes are copied as they are,
+// chunks only get the vertices their faces use.
+inline void addFaces(indexedMesh& target, const modelPlan& plan)
+{
+    int vertexBase = 0;
+    int faceBase = 0;
+    std::vector<int> remap;
+    for(const meshPiece& piece : plan.pieces)
+    {
+        const aiMesh* mesh = piece.mesh;
+        bool texcoords = target.hasTexcoords() && mesh->HasTextureCoords(0);
+        auto copyVertex = [&](unsigned from, int to)
+        {
+            aiVector3D v = mesh->mVertices[from];
+            target.setVertex(to, point3(v.x, v.y, v.z));
+            if(texcoords)
+                target.setTexcoord(to, mesh->mTextureCoords[0][from].x, mesh->mTextureCoords[0][from].y);
+            else if(target.hasTexcoords())
+                target.setTexcoord(to, 0.0f, 0.0f);
+        };
+
+        if(piece.faces.empty())
+        {
+            for(int i = 0; i < mesh->mNumVertices; i++)
+                copyVertex(i, vertexBase + i);
+
+            for(int i = 0; i < mesh->mNumFaces; i++)
+            {
+                const aiFace& face = mesh->mFaces[i];
+                target.setTriangle(faceBase++, vertexBase + face.mIndices[0], vertexBase + face.mIndices[1], vertexBase + face.mIndices[2]);
+            }
+            vertexBase += mesh->mNumVertices;
+            continue;
+        }
+
+        remap.assign(mesh->mNumVertices, -1);
+        for(int f : piece.faces)
+        {
+            const aiFace& face = mesh->mFaces[f];
+            uint32_t idx[3];
+            for(int k = 0; k < 3; k++)
+            {
+                unsigned v = face.mIndices[k];
+                if(remap[v] < 0)
+                {
+                    remap[v] = vertexBase++;
+                    copyVertex(v, remap[v]);
+                }
+                idx[k] = remap[v];
+            }
+            target.setTriangle(faceBase++, idx[0], idx[1], idx[2]);
+        }
+    }
+}
+
+// Diffuse and emissive colors and textures of every material. Texture files are only registered here, the
+// texture cache decodes them the first time a ray needs them.
+inline void addMaterials(const aiScene* imported, const std::string& path, materialLibrary& library)
+{
+    size_t slash = path.find_last_of("/\\");
+    std::string directory = slash == std::string::npos ? "" : path.substr(0, slash + 1);
+
+    for(int i = 0; i < imported->mNumMaterials; i++)
+    {
+        const aiMaterial* source = imported->mMaterials[i];
+        material m;
+
+        aiColor3D kd;
+        if(source->Get(AI_MATKEY_COLOR_DIFFUSE, kd) == aiReturn_SUCCESS)
+            m.albedo = color{kd.r, kd.g, kd.b};
+        aiColor3D ke;
+        if(source->Get(AI_MATKEY_COLOR_EMISSIVE, ke) == aiReturn_SUCCESS)
+            m.emission = color{ke.r, ke.g, ke.b};
+
+        aiString texturePath;
+        if(source->GetTextureCount(aiTextureType_DIFFUSE) > 0 && source->GetTexture(aiTextureType_DIFFUSE, 0, &texturePath) == aiReturn_SUCCESS)
+        {
+            std::string file = texturePath.C_Str();
+#if !defined(_WIN32)
+            std::replace(file.begin(), file.end(), '\\', '/');
+#endif
+            m.diffuseTexture = library.textures.add(directory + file);
+        }
+        if(source->GetTextureCount(aiTextureType_OPACITY) > 0 && source->GetTexture(aiTextureType_OPACITY, 0, &texturePath) == aiReturn_SUCCESS)
+        {
+            std::string file = texturePath.C_Str();
+#if !defined(_WIN32)
+            std::replace(file.begin(), file.end(), '\\', '/');
+#endif
+            m.opacityTexture = library.textures.add(directory + file);
+        }
+        library.materials.push_back(m);
+    }
+}
+
+// Imports path into world. Meshes are converted in parallel and each model's BLAS is built by the
+// same worker right after its mesh is converted, so conversion and BVH builds of different meshes
+// overlap. The TLAS is built once every BLAS bound is known. With a cache path each worker builds
+// its model in a scratch arena, appends it to the cache file and keeps only the bounds.
+inline bool importScene(const std::string& path, scene& world, const importOptions& options, importTimings& timings)
+{
+    auto start = std::chrono::steady_clock::now();
+
+    Assimp::Importer importer{};
+    const aiScene* imported = importer.ReadFile(path, aiProcess_Triangulate | aiProcess_FlipUVs | aiProcess_JoinIdenticalVertices
+                                                    | aiProcess_CalcTangentSpace | aiProcess_GenBoundingBoxes);
+
+    if (!imported || imported->mFlags & AI_SCENE_FLAGS_INCOMPLETE || !imported->mRootNode)
+    {
+        std::cout << "ERROR::ASSIMP::" << importer.GetErrorString() << std::endl;
+        return false;
+    }
+    else
+    {
+        std::cout << "HEY WE IMPORTED THE THING!!! " << imported->mRootNode->mName.C_Str() << "\n";
+    }
+    timings.readMs = msSince(start);
+
+    std::vector<const aiMesh*> meshes;
+    gatherMeshes(imported->mRootNode, imported, meshes);
+    world.materials.textures.budget = options.textureBudget;
+    if(options.materials)
+        addMaterials(imported, path, world.materials);
+
+    blasRegrouper regrouper;
+    std::vector<modelPlan> plans = regrouper.plan(meshes, options.materials, options.regroupBlas);
+    if(options.regroupBlas)
+        regrouper.report(std::cout, (int)plans.size());
+
+    long long vertexCount = 0;
+    long long faceCount = 0;
+    for(const modelPlan& plan : plans)
+    {
+        vertexCount += plan.vertexCount;
+        faceCount += plan.faceCount;
+    }
+
+    blasCacheWriter writer;
+    bool outOfCore = !options.cachePath.empty();
+    if(outOfCore && !writer.open(options.cachePath, (int)plans.size(), blasCacheSource{path, options.cacheFingerprint()}))
+    {
+        std::cout << "ERROR::CACHE::could not create " << options.cachePath << std::endl;
+        return false;
+    }
+
+    // Model slots and triangle storage are handed out up front so the models keep node tree order
+    // no matter which worker finishes first
+    world.reserve((int)plans.size(), outOfCore ? 0 : vertexCount, outOfCore ? 0 : faceCount);
+    for(const modelPlan& plan : plans)
+    {
+        model& m = outOfCore ? world.addModel(plan.bounds.min(), plan.bounds.max())
+                             : world.addModel(plan.bounds.min(), plan.bounds.max(), plan.vertexCount, plan.faceCount,
+                                              options.quantizePositions, options.compactIndices);
+        if(!options.materials)
+            continue;
+        m.material = plan.material;
+        if(!outOfCore && plan.texcoords)
+            m.mesh.allocateTexcoords(world.arena);
+    }
+
+    // Masks are only needed to classify triangles, so they are decoded here once and dropped after the import
+    std::vector<std::unique_ptr<opacityPyramid>> masks(world.materials.textures.count());
+    for(int i = 0; i < (int)plans.size(); i++)
+    {
+        int mask = world.models[i].material >= 0 ? world.materials.materials[world.models[i].material].opacityTexture : -1;
+        if(mask < 0 || masks[mask] || !plans[i].texcoords)
+            continue;
+
+        masks[mask].reset(new opacityPyramid{});
+        if(!masks[mask]->load(world.materials.textures.path(mask)))
+            std::cout << "ERROR::TEXTURE::could not decode " << world.materials.textures.path(mask) << ", treating it as opaque\n";
+    }
+    std::atomic<int> opacityCounts[3] = {{0}, {0}, {0}};
+
+    // Emitters are collected per model and joined in model order, so the light BVH does not depend
+    // on which worker finished first
+    std::vector<std::vector<emitter>> emitters(plans.size());
+
+    // Largest meshes first so one big mesh does not end up as the tail of the stage
+    std::vector<int> order(plans.size());
+    for(int i = 0; i < (int)order.size(); i++)
+        order[i] = i;
+    std::sort(order.begin(), order.end(), [&](int a, int b) { return plans[a].faceCount > plans[b].faceCount; });
+
+    auto meshStart = std::chrono::steady_clock::now();
+    std::atomic<int> next {0};
+    std::atomic<long long> convertMicros {0};
+    std::atomic<long long> bvhMicros {0};
+    std::atomic<long long> lodMicros {0};
+    std::atomic<int> lodModels {0};
+    std::atomic<long long> lodTriangles[maxLodLevels + 1] = {};
+
+    auto worker = [&]()
+    {
+        for(int job = next++; job < (int)order.size(); job = next++)
+        {
+            int idx = order[job];
+            model& hitMesh = world.models[idx];
+
+            const modelPlan& plan = plans[idx];
+            sceneArena scratch;
+            if(outOfCore)
+            {
+                scratch.reserve(indexedMesh::memoryRequired(plan.vertexCount, plan.faceCount) + bvh::memoryRequired(plan.faceCount));
+                hitMesh.mesh = indexedMesh{plan.vertexCount, plan.faceCount, hitMesh.bounds, options.quantizePositions,
+                                           options.compactIndices, scratch};
+                if(options.materials && plan.texcoords)
+                    hitMesh.mesh.allocateTexcoords(scratch);
+            }
+            sceneArena& arena = outOfCore ? scratch : world.arena;
+
+            auto t0 = std::chrono::steady_clock::now();
+            addFaces(hitMesh.mesh, plan);
+            int mask = hitMesh.material >= 0 ? world.materials.materials[hitMesh.material].opacityTexture : -1;
+            if(mask >= 0 && masks[mask] && masks[mask]->width() > 0 && hitMesh.mesh.hasTexcoords())
+            {
+                int counts[3] = {0, 0, 0};
+                if(hitMesh.mesh.classifyOpacity(*masks[mask], arena, counts))
+                    hitMesh.alpha = alphaTest{&world.materials.textures, mask};
+                for(int i = 0; i < 3; i++)
+                    opacityCounts[i] += counts[i];
+            }
+            if(hitMesh.material >= 0)
+            {
+                const color& emission = world.materials.materials[hitMesh.material].emission;
+                if(emission.x() > 0.0f || emission.y() > 0.0f || emission.z() > 0.0f)
+                    gatherEmitters(hitMesh.mesh, emission, idx, emitters[idx]);
+            }
+            auto t1 = std::chrono::steady_clock::now();
+            hitMesh.mbvh = { &hitMesh.mesh, arena, options.bvhProfile };
+            if(options.optimizeLayout)
+                hitMesh.mbvh.optimizeLayout();
+            if(options.stackless)
+                hitMesh.mbvh.linkParents(arena);
+            auto t2 = std::chrono::steady_clock::now();
+
+            // Alpha tested models keep their full mesh, simplifying foliage cards changes what they cover
+            if(options.lodLevels > 0 && !outOfCore && !hitMesh.alpha.active())
+            {
+                meshSimplifier simplifier;
+                float maxError = options.lodMaxError * hitMesh.bounds.size().length();
+                hitMesh.lodCount = simplifier.build(hitMesh.mesh, hitMesh.bounds, options.quantizePositions, options.compactIndices,
+                                                    std::min(options.lodLevels, maxLodLevels), maxError, options.bvhProfile,
+                                                    arena, hitMesh.lods);
+                for(int l = 0; l < hitMesh.lodCount; l++)
+                {
+                    if(options.optimizeLayout)
+                        hitMesh.lods[l].tree.optimizeLayout();
+                    if(options.stackless)
+                        hitMesh.lods[l].tree.linkParents(arena);
+                    lodTriangles[l + 1] += hitMesh.lods[l].mesh.triCount;
+                }
+                if(hitMesh.lodCount > 0)
+                {
+                    lodModels++;
+                    lodTriangles[0] += hitMesh.mesh.triCount;
+                }
+                lodMicros += std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - t2).count();
+            }
+
+            if(outOfCore)
+            {
+                writer.write(idx, hitMesh.bounds, hitMesh.mesh, hitMesh.mbvh, hitMesh.material);
+                aabb rootBounds = hitMesh.mbvh.bvhBounds;
+                hitMesh.mesh = indexedMesh{};
+                hitMesh.mbvh = bvh{};
+                hitMesh.mbvh.bvhBounds = rootBounds;
+            }
+
+            convertMicros += std::chrono::duration_cast<std::chrono::microseconds>(t1 - t0).count();
+            bvhMicros += std::chrono::duration_cast<std::chrono::microseconds>(t2 - t1).count();
+        }
+    };
+
+    int workers = std::max(1, std::min(options.threads, (int)plans.size()));
+    std::vector<std::thread> pool;
+    for(int i = 1; i < workers; i++)
+        pool.emplace_back(worker);
+    worker();
+    for(auto& thread : pool)
+        thread.join();
+
+    timings.meshStageMs = msSince(meshStart);
+    if(opacityCounts[0] + opacityCounts[1] + opacityCounts[2] > 0)
+        std::cout << "OPACITY: " << opacityCounts[0] << " opaque, " << opacityCounts[1] << " transparent, " << opacityCounts[2]
+                  << " mixed triangle(s) on masked materials\n";
+    if(options.lodLevels > 0 && !outOfCore)
+    {
+        std::cout << "LOD: " << lodModels << " of " << plans.size() << " models simplified, " << lodTriangles[0] << " triangles";
+        for(int l = 1; l <= maxLodLevels; l++)
+            std::cout << (l == 1 ? " -> " : " / ") << lodTriangles[l];
+        std::cout << " over the levels, " << lodMicros / 1000.0 << " ms cpu\n";
+    }
+    std::vector<emitter> lights;
+    for(std::vector<emitter>& e : emitters)
+        lights.insert(lights.end(), e.begin(), e.end());
+    world.lights.build(std::move(lights));
+    if(!world.lights.empty())
+        world.lights.report(std::cout);
+    timings.convertCpuMs = convertMicros / 1000.0;
+    timings.bvhCpuMs = bvhMicros / 1000.0;
+
+    auto tlasStart = std::chrono::steady_clock::now();
+    world.buildTopLevel(options.optimizeLayout, options.stackless);
+    timings.tlasMs = msSince(tlasStart);
+
+    if(outOfCore)
+    {
+        std::vector<blasCacheRecord> table;
+        if(!writer.finish(world.materials, world.lights.emitters()) || !readBlasCacheTable(options.cachePath, table) || !world.attachCache(options.cachePath, table, options.residentBudget))
+        {
+            std::cout << "ERROR::CACHE::could not write " << options.cachePath << std::endl;
+            return false;
+        }
+    }
+
+    timings.totalMs = msSince(start);
+    return true;
+}
+
+#endif
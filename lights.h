@@ -0,0 +1,289 @@
+#ifndef LIGHTS_H
+#define LIGHTS_H
+
+#include <algorithm>
+#include <cmath>
+#include <ostream>
+#include <vector>
+
+#include "aabb.h"
+#include "color.h"
+#include "mesh.h"
+
+// One emissive triangle in world space. Lights are one sided and emit on the side of the geometric
+// normal, which is the side rays hit since back faces are culled.
+struct emitter
+{
+    point3 p0{}, p1{}, p2{};
+    vec3 normal{};
+    float area = 0.0f;
+    color emission{};
+    int model = -1;     // Index of the model the triangle belongs to
+
+    float power() const
+    {
+        return (0.2126f * emission.x() + 0.7152f * emission.y() + 0.0722f * emission.z()) * area * pi;
+    }
+
+    // Uniformly distributed point for the random numbers a and b in [0, 1)
+    point3 sample(float a, float b) const
+    {
+        float s = std::sqrt(a);
+        return (1.0f - s) * p0 + s * (1.0f - b) * p1 + s * b * p2;
+    }
+};
+
+// Emissive triangles of model's mesh, appended to lights
+inline void gatherEmitters(const indexedMesh& mesh, const color& emission, int model, std::vector<emitter>& lights)
+{
+    for(int i = 0; i < mesh.triCount; i++)
+    {
+        triangle tri = mesh.get(i);
+        vec3 n = cross(tri.v1() - tri.v0(), tri.v2() - tri.v0());
+        float doubleArea = n.length();
+        if(doubleArea <= 0.0f)
+            continue;
+        lights.push_back({tri.v0(), tri.v1(), tri.v2(), n / doubleArea, 0.5f * doubleArea, emission, model});
+    }
+}
+
+// Light BVH over the emitters for many-light next event estimation, after Conty Estevez and Kulla,
+// "Importance Sampling of Many Lights with Adaptive Tree Splitting". Every node bounds its lights'
+// positions, the cone of their normals and their total power. Sampling walks down from the root and
+// picks a child proportionally to a bound of its contribution at the shading point, so a light is
+// drawn in O(log n) with a probability that follows its estimated contribution.
+class lightTree
+{
+private:
+    struct lightNode
+    {
+        aabb bounds{};
+        point3 center{};        // Bounding sphere of bounds, which is what importance() measures
+        float radius = 0.0f;
+        vec3 axis{};            // Orientation cone of the light normals
+        float cosSpread = 1.0f; // Cosine and sine of the cone's half angle
+        float sinSpread = 0.0f;
+        float power = 0.0f;
+        int left = -1;          // Interior nodes: children left and left + 1
+        int light = -1;         // Leaves: index into lights
+    };
+
+    std::vector<emitter> lights;
+    std::vector<lightNode> nodes;
+
+    static float angleBetween(const vec3& a, const vec3& b)
+    {
+        return std::acos(std::clamp(dot(a, b), -1.0f, 1.0f));
+    }
+
+    // Smallest cone around both cones a and b
+    static void mergeCones(vec3 axisA, float spreadA, vec3 axisB, float spreadB, vec3& axis, float& spread)
+    {
+        if(spreadB > spreadA)
+        {
+            std::swap(axisA, axisB);
+            std::swap(spreadA, spreadB);
+        }
+
+        float between = angleBetween(axisA, axisB);
+        axis = axisA;
+        spread = spreadA;
+        if(std::min(between + spreadB, pi) <= spreadA)
+            return;
+
+        spread = 0.5f * (spreadA + between + spreadB);
+        if(spread >= pi)
+        {
+            spread = pi;
+            return;
+        }
+
+        // Rotate a's axis towards b's by the growth of the cone
+        vec3 ortho = axisB - dot(axisA, axisB) * axisA;
+        if(ortho.squaredLength() < 1e-12f)
+            return;
+        float rotation = spread - spreadA;
+        axis = (std::cos(rotation) * axisA + std::sin(rotation) * ortho.normalize()).normalize();
+    }
+
+    static point3 centroid(const emitter& e)
+    {
+        return (e.p0 + e.p1 + e.p2) * (1.0f / 3.0f);
+    }
+
+    // Fills node idx with the lights order[first, last), split at the middle of the longest axis of
+    // their centroids or at the median when that leaves one side empty
+    void build(int idx, std::vector<int>& order, int first, int last)
+    {
+        if(last - first == 1)
+        {
+            const emitter& e = lights[order[first]];
+            lightNode& leaf = nodes[idx];
+            leaf.bounds.grow(e.p0);
+            leaf.bounds.grow(e.p1);
+            leaf.bounds.grow(e.p2);
+            leaf.axis = e.normal;
+            leaf.power = e.power();
+            leaf.light = order[first];
+            fitSphere(leaf);
+            return;
+        }
+
+        aabb centroids{};
+        for(int i = first; i < last; i++)
+            centroids.grow(centroid(lights[order[i]]));
+        vec3 extent = centroids.size();
+        int axis = extent.x() > extent.y() ? (extent.x() > extent.z() ? 0 : 2) : (extent.y() > extent.z() ? 1 : 2);
+        float split = 0.5f * (centroids.min()[axis] + centroids.max()[axis]);
+
+        auto begin = order.begin();
+        int middle = (int)(std::partition(begin + first, begin + last, [&](int l) { return centroid(lights[l])[axis] < split; }) - begin);
+        if(middle == first || middle == last)
+        {
+            middle = (first + last) / 2;
+            std::nth_element(begin + first, begin + middle, begin + last,
+                             [&](int a, int b) { return centroid(lights[a])[axis] < centroid(lights[b])[axis]; });
+        }
+
+        int left = (int)nodes.size();
+        nodes.resize(left + 2);
+        build(left, order, first, middle);
+        build(left + 1, order, middle, last);
+
+        const lightNode& a = nodes[left];
+        const lightNode& b = nodes[left + 1];
+        lightNode& n = nodes[idx];
+        n.bounds = a.bounds;
+        n.bounds.grow(b.bounds);
+        float spread;
+        mergeCones(a.axis, std::acos(a.cosSpread), b.axis, std::acos(b.cosSpread), n.axis, spread);
+        n.cosSpread = std::cos(spread);
+        n.sinSpread = std::sin(spread);
+        n.power = a.power + b.power;
+        n.left = left;
+        fitSphere(n);
+    }
+
+    static void fitSphere(lightNode& n)
+    {
+        n.center = (n.bounds.min() + n.bounds.max()) * 0.5f;
+        n.radius = 0.5f * n.bounds.size().length();
+    }
+
+    // cos(max(0, a - b)) from the sines and cosines of a and b
+    static float cosSubClamped(float sinA, float cosA, float sinB, float cosB)
+    {
+        if(cosA > cosB)
+            return 1.0f;
+        return cosA * cosB + sinA * sinB;
+    }
+
+    static float sinSubClamped(float sinA, float cosA, float sinB, float cosB)
+    {
+        if(cosA > cosB)
+            return 0.0f;
+        return sinA * cosB - cosA * sinB;
+    }
+
+    // Bound of what the lights under node idx can contribute to a surface at p facing n: their power
+    // over the squared distance, scaled by the best emission and incidence cosines any point in the
+    // node's box and normal cone can reach. Angles are subtracted through their sines and cosines.
+    float importance(int idx, const point3& p, const vec3& n) const
+    {
+        const lightNode& node = nodes[idx];
+        vec3 toPoint = p - node.center;
+        float distanceSquared = toPoint.squaredLength();
+        if(distanceSquared <= node.radius * node.radius)
+            return node.power / std::max(distanceSquared, 1e-4f);
+
+        float invDistance = 1.0f / std::sqrt(distanceSquared);
+        toPoint = toPoint * invDistance;
+        float sinBounds = node.radius * invDistance;
+        float cosBounds = std::sqrt(1.0f - sinBounds * sinBounds);
+
+        // Lights are one sided, nothing is emitted beyond 90 degrees from the normals
+        float cosToPoint = dot(node.axis, toPoint);
+        float sinToPoint = std::sqrt(std::max(0.0f, 1.0f - cosToPoint * cosToPoint));
+        float cosOutside = cosSubClamped(sinToPoint, cosToPoint, node.sinSpread, node.cosSpread);
+        float sinOutside = sinSubClamped(sinToPoint, cosToPoint, node.sinSpread, node.cosSpread);
+        float cosEmit = cosSubClamped(sinOutside, cosOutside, sinBounds, cosBounds);
+        if(cosEmit <= 0.0f)
+            return 0.0f;
+
+        float cosIncident = -dot(n, toPoint);
+        float sinIncident = std::sqrt(std::max(0.0f, 1.0f - cosIncident * cosIncident));
+        cosIncident = cosSubClamped(sinIncident, cosIncident, sinBounds, cosBounds);
+        if(cosIncident <= 0.0f)
+            return 0.0f;
+
+        return node.power * cosEmit * cosIncident / distanceSquared;
+    }
+
+public:
+    void build(std::vector<emitter>&& emitters)
+    {
+        lights = std::move(emitters);
+        nodes.clear();
+        if(lights.empty())
+            return;
+
+        std::vector<int> order(lights.size());
+        for(int i = 0; i < (int)order.size(); i++)
+            order[i] = i;
+        nodes.reserve(2 * lights.size() - 1);
+        nodes.resize(1);
+        build(0, order, 0, (int)lights.size());
+    }
+
+    bool empty() const { return lights.empty(); }
+    int lightCount() const { return (int)lights.size(); }
+    const std::vector<emitter>& emitters() const { return lights; }
+    int nodeCount() const { return (int)nodes.size(); }
+
+    float totalPower() const { return nodes.empty() ? 0.0f : nodes[0].power; }
+
+    // Picks a light for the surface at p facing n with the random number u. probability is the chance
+    // of that pick. False when no light can reach the surface.
+    bool sample(const point3& p, const vec3& n, float u, const emitter*& light, float& probability) const
+    {
+        if(nodes.empty())
+            return false;
+
+        int idx = 0;
+        probability = 1.0f;
+        while(nodes[idx].left >= 0)
+        {
+            int left = nodes[idx].left;
+            float a = importance(left, p, n);
+            float b = importance(left + 1, p, n);
+            if(a + b <= 0.0f)
+                return false;
+
+            float pickLeft = a / (a + b);
+            if(u < pickLeft)
+            {
+                u /= pickLeft;
+                probability *= pickLeft;
+                idx = left;
+            }
+            else
+            {
+                u = (u - pickLeft) / (1.0f - pickLeft);
+                probability *= 1.0f - pickLeft;
+                idx = left + 1;
+            }
+            u = std::min(u, 0.99999994f);
+        }
+
+        light = &lights[nodes[idx].light];
+        return true;
+    }
+
+    void report(std::ostream& out) const
+    {
+        out << "LIGHTS: " << lights.size() << " emissive triangle(s), light BVH " << nodes.size() << " nodes, total power "
+            << totalPower() << '\n';
+    }
+};
+
+#endif
@@ -0,0 +1,345 @@
+#ifndef LOD_H
+#define LOD_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <queue>
+#include <unordered_map>
+#include <vector>
+
+#include "aabb.h"
+#include "arena.h"
+#include "bvh.h"
+#include "bvhprofile.h"
+#include "mesh.h"
+
+constexpr int maxLodLevels = 3;
+
+// Simplified copy of a model's mesh with its own BVH, traced by secondary rays whose footprint is
+// wide enough to hide what it lost
+struct lodLevel
+{
+    indexedMesh mesh{};
+    bvh tree{};
+    float error = 0.0f;     // Bound on the distance between this level's surface and the full mesh, both ways
+};
+
+// Half edge collapses ordered by quadric error (Garland and Heckbert, "Surface Simplification Using
+// Quadric Error Metrics"). A vertex only ever moves onto a neighbour, so each level keeps a subset
+// of the vertices with their texture coordinates, and every triangle left is an original one with
+// moved corners. The farthest any original vertex lies from the one it was merged into therefore
+// bounds how far the simplified and full surfaces are apart. Vertices on open edges, texture seams
+// included, stay put so levels neither shrink the silhouette of open meshes nor tear seams open.
+class meshSimplifier
+{
+public:
+    // Fills levels with up to maxLevels simplifications of mesh, each with about half the triangles
+    // of the one before, and returns how many it made. It stops early when a level would move the
+    // surface more than maxError or no longer removes a quarter of the triangles.
+    int build(const indexedMesh& mesh, const aabb& bounds, bool quantize, bool compactIndices, int maxLevels,
+              float maxError, const bvhBuildProfile& profile, sceneArena& arena, lodLevel* levels)
+    {
+        load(mesh);
+
+        int count = 0;
+        int previous = mesh.triCount;
+        while(count < maxLevels)
+        {
+            collapse(previous / 2, maxError);
+            if(trisAlive > previous * 3 / 4 || trisAlive == 0)
+                break;
+
+            emit(mesh, bounds, quantize, compactIndices, profile, arena, levels[count]);
+            previous = trisAlive;
+            count++;
+        }
+        return count;
+    }
+
+private:
+    // Sum of squared distances to a set of planes, as the symmetric 4x4 matrix's upper triangle
+    struct quadric
+    {
+        double a[10] = {};
+
+        void addPlane(double nx, double ny, double nz, double d, double weight)
+        {
+            double p[4] = {nx, ny, nz, d};
+            int k = 0;
+            for(int i = 0; i < 4; i++)
+                for(int j = i; j < 4; j++)
+                    a[k++] += weight * p[i] * p[j];
+        }
+
+        void add(const quadric& q)
+        {
+            for(int i = 0; i < 10; i++)
+                a[i] += q.a[i];
+        }
+
+        double evaluate(const point3& v) const
+        {
+            double x = v.x(), y = v.y(), z = v.z();
+            return a[0] * x * x + 2 * a[1] * x * y + 2 * a[2] * x * z + 2 * a[3] * x
+                 + a[4] * y * y + 2 * a[5] * y * z + 2 * a[6] * y
+                 + a[7] * z * z + 2 * a[8] * z + a[9];
+        }
+    };
+
+    struct candidate
+    {
+        double cost;
+        int from, to;
+        unsigned int fromVersion, toVersion;
+
+        bool operator<(const candidate& o) const { return cost > o.cost; }
+    };
+
+    std::vector<point3> positions;
+    std::vector<uint32_t> corners;          // Three per triangle
+    std::vector<uint8_t> triAlive;
+    std::vector<std::vector<int>> vertexTris;   // Triangles around each vertex, dead ones dropped lazily
+    std::vector<quadric> quadrics;
+    std::vector<std::vector<int>> merged;   // Original vertices each vertex stands for, itself included
+    std::vector<float> carried;             // Distance to the farthest of them
+    std::vector<uint8_t> pinned;            // On an open or non-manifold edge
+    std::vector<uint8_t> vertexAlive;
+    std::vector<unsigned int> versions;
+    std::priority_queue<candidate> queue;
+    int trisAlive = 0;
+    std::vector<int> aroundFrom, aroundTo;  // Scratch lists of neighbours
+
+    void load(const indexedMesh& mesh)
+    {
+        int vertices = mesh.vertexCount;
+        positions.resize(vertices);
+        for(int i = 0; i < vertices; i++)
+            positions[i] = mesh.vertex(i);
+
+        corners.resize(3 * mesh.triCount);
+        triAlive.assign(mesh.triCount, 1);
+        vertexTris.assign(vertices, {});
+        quadrics.assign(vertices, quadric{});
+        merged.resize(vertices);
+        for(int i = 0; i < vertices; i++)
+            merged[i].assign(1, i);
+        carried.assign(vertices, 0.0f);
+        pinned.assign(vertices, 0);
+        vertexAlive.assign(vertices, 1);
+        versions.assign(vertices, 0);
+        queue = {};
+        trisAlive = mesh.triCount;
+
+        std::unordered_map<uint64_t, int> edgeUses;
+        for(int t = 0; t < mesh.triCount; t++)
+        {
+            uint32_t* c = &corners[3 * t];
+            mesh.vertexIndices(t, c[0], c[1], c[2]);
+            for(int k = 0; k < 3; k++)
+            {
+                vertexTris[c[k]].push_back(t);
+                edgeUses[edgeKey(c[k], c[(k + 1) % 3])]++;
+            }
+
+            // Area weighted plane of the triangle
+            vec3 n = cross(positions[c[1]] - positions[c[0]], positions[c[2]] - positions[c[0]]);
+            double length = n.length();
+            if(length <= 0.0)
+                continue;
+            double nx = n.x() / length, ny = n.y() / length, nz = n.z() / length;
+            double d = -(nx * positions[c[0]].x() + ny * positions[c[0]].y() + nz * positions[c[0]].z());
+            quadric q;
+            q.addPlane(nx, ny, nz, d, 0.5 * length);
+            for(int k = 0; k < 3; k++)
+                quadrics[c[k]].add(q);
+        }
+
+        for(const auto& edge : edgeUses)
+        {
+            if(edge.second != 2)
+            {
+                pinned[edge.first >> 32] = 1;
+                pinned[edge.first & 0xffffffffu] = 1;
+            }
+        }
+
+        for(int v = 0; v < vertices; v++)
+            pushEdges(v);
+    }
+
+    static uint64_t edgeKey(uint32_t a, uint32_t b)
+    {
+        return a < b ? ((uint64_t)a << 32) | b : ((uint64_t)b << 32) | a;
+    }
+
+    bool contains(int t, int v) const
+    {
+        const uint32_t* c = &corners[3 * t];
+        return c[0] == (uint32_t)v || c[1] == (uint32_t)v || c[2] == (uint32_t)v;
+    }
+
+    void neighbours(int v, std::vector<int>& out) const
+    {
+        out.clear();
+        for(int t : vertexTris[v])
+        {
+            if(!triAlive[t])
+                continue;
+            for(int k = 0; k < 3; k++)
+            {
+                int w = (int)corners[3 * t + k];
+                if(w != v && std::find(out.begin(), out.end(), w) == out.end())
+                    out.push_back(w);
+            }
+        }
+    }
+
+    void push(int from, int to)
+    {
+        if(pinned[from])
+            return;
+        quadric q = quadrics[from];
+        q.add(quadrics[to]);
+        queue.push({q.evaluate(positions[to]), from, to, versions[from], versions[to]});
+    }
+
+    void pushEdges(int v)
+    {
+        neighbours(v, aroundTo);
+        for(int w : aroundTo)
+        {
+            push(v, w);
+            push(w, v);
+        }
+    }
+
+    // Checks that moving from onto to keeps the mesh manifold, flips no triangle and stays within
+    // maxError, and does it
+    bool tryCollapse(int from, int to, float maxError)
+    {
+        float moved = carried[to];
+        for(int v : merged[from])
+            moved = std::max(moved, (positions[v] - positions[to]).length());
+        if(moved > maxError)
+            return false;
+
+        // An interior edge has exactly two vertices next to both its ends, more would pinch the mesh
+        neighbours(from, aroundFrom);
+        neighbours(to, aroundTo);
+        if(std::find(aroundFrom.begin(), aroundFrom.end(), to) == aroundFrom.end())
+            return false;
+        int shared = 0;
+        for(int w : aroundFrom)
+            shared += std::find(aroundTo.begin(), aroundTo.end(), w) != aroundTo.end();
+        if(shared != 2)
+            return false;
+
+        for(int t : vertexTris[from])
+        {
+            if(!triAlive[t] || contains(t, to))
+                continue;
+            point3 p[3];
+            for(int k = 0; k < 3; k++)
+            {
+                int c = (int)corners[3 * t + k];
+                p[k] = positions[c == from ? to : c];
+            }
+            vec3 before = cross(positions[corners[3 * t + 1]] - positions[corners[3 * t]],
+                                positions[corners[3 * t + 2]] - positions[corners[3 * t]]);
+            vec3 after = cross(p[1] - p[0], p[2] - p[0]);
+            float area = after.length();
+            if(area <= 1e-6f * before.length() || dot(before, after) < 0.2f * before.length() * area)
+                return false;
+        }
+
+        for(int t : vertexTris[from])
+        {
+            if(!triAlive[t])
+                continue;
+            if(contains(t, to))
+            {
+                triAlive[t] = 0;
+                trisAlive--;
+                continue;
+            }
+            for(int k = 0; k < 3; k++)
+            {
+                if(corners[3 * t + k] == (uint32_t)from)
+                    corners[3 * t + k] = to;
+            }
+            vertexTris[to].push_back(t);
+        }
+        vertexTris[from].clear();
+        vertexTris[from].shrink_to_fit();
+        vertexAlive[from] = 0;
+
+        auto& list = vertexTris[to];
+        list.erase(std::remove_if(list.begin(), list.end(), [&](int t) { return !triAlive[t]; }), list.end());
+        quadrics[to].add(quadrics[from]);
+        merged[to].insert(merged[to].end(), merged[from].begin(), merged[from].end());
+        merged[from] = {};
+        carried[to] = moved;
+        versions[to]++;
+        pushEdges(to);
+        return true;
+    }
+
+    void collapse(int target, float maxError)
+    {
+        while(trisAlive > target && !queue.empty())
+        {
+            candidate c = queue.top();
+            queue.pop();
+            if(!vertexAlive[c.from] || !vertexAlive[c.to] || versions[c.from] != c.fromVersion || versions[c.to] != c.toVersion)
+                continue;
+            tryCollapse(c.from, c.to, maxError);
+        }
+    }
+
+    void emit(const indexedMesh& mesh, const aabb& bounds, bool quantize, bool compactIndices,
+              const bvhBuildProfile& profile, sceneArena& arena, lodLevel& level)
+    {
+        std::vector<int> remap(positions.size(), -1);
+        int vertices = 0;
+        float error = 0.0f;
+        for(int t = 0; t < (int)triAlive.size(); t++)
+        {
+            if(!triAlive[t])
+                continue;
+            for(int k = 0; k < 3; k++)
+            {
+                int v = (int)corners[3 * t + k];
+                if(remap[v] < 0)
+                {
+                    remap[v] = vertices++;
+                    error = std::max(error, carried[v]);
+                }
+            }
+        }
+
+        level.mesh = indexedMesh{vertices, trisAlive, bounds, quantize, compactIndices, arena};
+        if(mesh.hasTexcoords())
+            level.mesh.allocateTexcoords(arena);
+        for(int v = 0; v < (int)remap.size(); v++)
+        {
+            if(remap[v] < 0)
+                continue;
+            level.mesh.setVertex(remap[v], positions[v]);
+            if(mesh.hasTexcoords())
+                level.mesh.setTexcoord(remap[v], mesh.texcoordU(v), mesh.texcoordV(v));
+        }
+
+        int tri = 0;
+        for(int t = 0; t < (int)triAlive.size(); t++)
+        {
+            if(triAlive[t])
+                level.mesh.setTriangle(tri++, remap[corners[3 * t]], remap[corners[3 * t + 1]], remap[corners[3 * t + 2]]);
+        }
+
+        level.tree = bvh{&level.mesh, arena, profile};
+        level.error = error;
+    }
+};
+
+#endif
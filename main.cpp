@@ -1,95 +1,338 @@
 #include "utilities.h"
-#include <assimp/Importer.hpp> 
-#include <assimp/scene.h>
-#include <assimp/postprocess.h>
 #include <chrono>
+#include "batch.h"
 #include "camera.h"
+#include "distributed.h"
+#include "importer.h"
 #include "model.h"
 #include "triangle.h"
 #include "aabb.h"
 #include "tlas.h"
+#include "scene.h"
+#include "sequence.h"
+#include "service.h"
+#include <string>
 #include <thread>
 
-void addFaces(std::vector<shared_ptr<model>>& modelList, const aiMesh* mesh)
+int main(int argc, char* argv[])
 {
-    const aiAABB& bounds = mesh->mAABB;
-    vec3 min {bounds.mMin.x, bounds.mMin.y, bounds.mMin.z};
-    vec3 max {bounds.mMax.x, bounds.mMax.y, bounds.mMax.z};
+    camera cam;
+    cam.aspectRatio = 16.0 / 9.0;
+    cam.imageWidth = 1920;
+    cam.samplesPerPixel = 10;
+    cam.maxBounceDepth = 50;
+    cam.vfov = 90;
+    cam.lookFrom = point3{0.0, 530.0, 0.0};
+    cam.lookAt = point3{-3.0, 530.0, 0.0};
+    cam.vUp = vec3{0,1,0};
+
+    importOptions importOpts;
+    bool reportBvh = false;
+    float lodTolerance = 0.5f;
+    double residentBudgetMb = 256.0;
+    double textureBudgetMb = 512.0;
+    bool numaReplicate = false;
+    std::string serveJobs;
+    std::string serveSocket;
+    int processes = 0;
+    int failWorkerAfter = 0;
+    double workerTimeoutMs = 0.0;
+    int workerIn = -1, workerOut = -1;
+    int failAfter = 0;
+    std::string viewsPath;
+    float stereoSeparation = 0.0f;
+    bool cubemap = false;
+    int turntableFrames = 0;
+    std::string sequencePath;
+    int sequenceFrames = 24;
+    bool temporal = false;
+    float historyFrames = 8.0f;
+    std::string scenePath = "sponza\\sponza.obj";
+    //std::string scenePath = "teapot.obj";
 
-    shared_ptr<model> hitMesh = make_shared<model>(min, max);
-    for(int i = 0; i < mesh->mNumFaces; i++)
+    for(int i = 1; i < argc; i++)
     {
-        aiFace face = mesh->mFaces[i];
-        aiVector3D v0 = mesh->mVertices[face.mIndices[0]];
-        aiVector3D v1 = mesh->mVertices[face.mIndices[1]];
-        aiVector3D v2 = mesh->mVertices[face.mIndices[2]];
-
-        hitMesh->addTriangle(make_shared<triangle>(
-            point3(v0.x, v0.y, v0.z),
-            point3(v1.x, v1.y, v1.z),
-            point3(v2.x, v2.y, v2.z)
-        ));
+        std::string arg = argv[i];
+        if(arg == "--scene" && i + 1 < argc)
+            scenePath = argv[++i];
+        else if(arg == "--tile-order" && i + 1 < argc)
+        {
+            if(!parseTileOrder(argv[++i], cam.tileOrdering))
+                std::cout << "Unknown tile order " << argv[i] << ", expected row, morton, hilbert or spiral\n";
+        }
+        else if(arg == "--tile-size" && i + 1 < argc)
+            cam.tileSize = std::atoi(argv[++i]);
+        else if(arg == "--no-tile-split")
+            cam.splitTiles = false;
+        else if(arg == "--no-tile-culling")
+            cam.tileCulling = false;
+        else if(arg == "--raster-primary")
+            cam.rasterPrimary = true;
+        else if(arg == "--crop" && i + 1 < argc)
+        {
+            if(!parseTile(argv[++i], cam.crop))
+                std::cout << "Bad crop window " << argv[i] << ", expected x0,y0,x1,y1\n";
+        }
+        else if(arg == "--out" && i + 1 < argc)
+            cam.outputPath = argv[++i];
+        else if(arg == "--framebuffer" && i + 1 < argc)
+        {
+            if(!parsePixelFormat(argv[++i], cam.framebufferFormat))
+                std::cout << "Unknown framebuffer format " << argv[i] << ", expected rgb8, half or rgb9e5\n";
+        }
+        else if(arg == "--threads" && i + 1 < argc)
+            cam.threadCount = std::atoi(argv[++i]);
+        else if(arg == "--pin-threads")
+            cam.pinThreads = true;
+        else if(arg == "--numa-replicate")
+        {
+            numaReplicate = true;
+            cam.pinThreads = true;
+        }
+        else if(arg == "--no-bvh-layout")
+            importOpts.optimizeLayout = false;
+        else if(arg == "--bvh-profile" && i + 1 < argc)
+        {
+            if(!parseBvhProfile(argv[++i], importOpts.bvhProfile))
+                std::cout << "Unknown BVH profile " << argv[i] << ", expected fast, balanced or quality\n";
+        }
+        else if(arg == "--no-blas-regroup")
+            importOpts.regroupBlas = false;
+        else if(arg == "--lod")
+            importOpts.lodLevels = maxLodLevels;
+        else if(arg == "--lod-tolerance" && i + 1 < argc)
+            lodTolerance = std::atof(argv[++i]);
+        else if(arg == "--stackless")
+            importOpts.stackless = true;
+        else if(arg == "--bvh-report")
+            reportBvh = true;
+        else if(arg == "--quantize")
+            importOpts.quantizePositions = true;
+        else if(arg == "--index32")
+            importOpts.compactIndices = false;
+        else if(arg == "--serve" && i + 1 < argc)
+            serveJobs = argv[++i];
+        else if(arg == "--serve-socket" && i + 1 < argc)
+            serveSocket = argv[++i];
+        else if(arg == "--ooc-cache" && i + 1 < argc)
+            importOpts.cachePath = argv[++i];
+        else if(arg == "--ooc-budget" && i + 1 < argc)
+            residentBudgetMb = std::atof(argv[++i]);
+        else if(arg == "--no-materials")
+            importOpts.materials = false;
+        else if(arg == "--no-nee")
+            cam.nextEventEstimation = false;
+        else if(arg == "--texture-budget" && i + 1 < argc)
+            textureBudgetMb = std::atof(argv[++i]);
+        else if(arg == "--views" && i + 1 < argc)
+            viewsPath = argv[++i];
+        else if(arg == "--stereo" && i + 1 < argc)
+            stereoSeparation = std::atof(argv[++i]);
+        else if(arg == "--cubemap")
+            cubemap = true;
+        else if(arg == "--turntable" && i + 1 < argc)
+            turntableFrames = std::atoi(argv[++i]);
+        else if(arg == "--sequence" && i + 1 < argc)
+            sequencePath = argv[++i];
+        else if(arg == "--frames" && i + 1 < argc)
+            sequenceFrames = std::atoi(argv[++i]);
+        else if(arg == "--temporal")
+            temporal = true;
+        else if(arg == "--history-frames" && i + 1 < argc)
+            historyFrames = std::atof(argv[++i]);
+        else if(arg == "--processes" && i + 1 < argc)
+            processes = std::atoi(argv[++i]);
+        else if(arg == "--fail-worker-after" && i + 1 < argc)
+            failWorkerAfter = std::atoi(argv[++i]);
+        else if(arg == "--worker-timeout" && i + 1 < argc)
+            workerTimeoutMs = std::atof(argv[++i]);
+        else if(arg == "--worker" && i + 2 < argc)
+        {
+            workerIn = std::atoi(argv[++i]);
+            workerOut = std::atoi(argv[++i]);
+        }
+        else if(arg == "--fail-after" && i + 1 < argc)
+            failAfter = std::atoi(argv[++i]);
     }
 
-    hitMesh->mbvh = { &hitMesh->triangles, (int)hitMesh->triangles.size() };
-
-    modelList.push_back(hitMesh);
-}
-
-void buildModelList(std::vector<shared_ptr<model>>& modelList, aiNode* node, const aiScene* scene)
-{
-    for(int i = 0; i < node->mNumMeshes; i++)
+    // Workers get the scene and camera arguments, everything but the coordinator's own
+    std::vector<std::string> forwardedArgs;
+    for(int i = 1; i < argc; i++)
     {
-        aiMesh* mesh = scene->mMeshes[node->mMeshes[i]];
-        addFaces(modelList, mesh);
+        std::string arg = argv[i];
+        if((arg == "--processes" || arg == "--fail-worker-after" || arg == "--worker-timeout") && i + 1 < argc)
+            i++;
+        else
+            forwardedArgs.push_back(arg);
     }
 
-    for(int i = 0; i < node->mNumChildren; i++)
+    // Camera path, every frame rendered by this process against the one scene. The key file is read
+    // before the scene so a typo in it doesn't cost an import.
+    cameraPath path;
+    if(!sequencePath.empty())
     {
-        buildModelList(modelList, node->mChildren[i], scene);
+        if(!serveJobs.empty() || !serveSocket.empty() || processes > 0)
+        {
+            std::cout << "ERROR::SEQUENCE::--sequence renders its frames in this process, it can't be combined with --serve, --serve-socket or --processes" << std::endl;
+            return 0;
+        }
+        if(!viewsPath.empty() || stereoSeparation > 0.0f || cubemap || turntableFrames > 0)
+        {
+            std::cout << "ERROR::SEQUENCE::--sequence sets the camera of every frame, it can't be combined with --views, --stereo, --cubemap or --turntable" << std::endl;
+            return 0;
+        }
+
+        std::string error;
+        if(!path.load(sequencePath, cam, error))
+        {
+            std::cout << "ERROR::SEQUENCE::" << error << std::endl;
+            return 0;
+        }
     }
-}
+    else if(temporal)
+        std::cout << "--temporal reuses the previous frame of a --sequence and is ignored without one\n";
 
-int main()
-{
-    Assimp::Importer importer{};
-    const aiScene* scene = importer.ReadFile("sponza\\sponza.obj", aiProcess_Triangulate | aiProcess_FlipUVs 
-                                                        | aiProcess_CalcTangentSpace | aiProcess_GenBoundingBoxes);
+    unsigned int n = std::thread::hardware_concurrency();
+    std::cout << n << " concurrent threads are supported.\n";
+
+    scene world;
+    importTimings timings;
+    importOpts.threads = cam.threadCount > 0 ? cam.threadCount : std::max(1u, n);
+    importOpts.residentBudget = (size_t)(residentBudgetMb * 1024.0 * 1024.0);
+    importOpts.textureBudget = (size_t)(textureBudgetMb * 1024.0 * 1024.0);
 
-    //const aiScene* scene = importer.ReadFile("teapot.obj", aiProcess_Triangulate | aiProcess_FlipUVs
-    //                                                    | aiProcess_CalcTangentSpace | aiProcess_GenBoundingBoxes);
+    // Service mode: the camera set up above holds the defaults every job starts from
+    if(!serveJobs.empty() || !serveSocket.empty())
+    {
+        importOpts.cachePath.clear();
+        renderService service{cam, scenePath, importOpts, lodTolerance};
+        if(!serveSocket.empty())
+        {
+#if !defined(_WIN32)
+            if(!service.serveSocket(serveSocket))
+                std::cout << "Could not listen on " << serveSocket << '\n';
+#else
+            std::cout << "--serve-socket needs Unix sockets, use --serve with a job file instead\n";
+#endif
+        }
+        else if(serveJobs == "-")
+            service.serveStream(std::cin, std::cout);
+        else
+        {
+            std::ifstream jobs(serveJobs);
+            service.serveStream(jobs, std::cout);
+        }
+        return 0;
+    }
+
+    // Coordinator mode: the scene is only loaded by the worker processes
+    if(processes > 0)
+    {
+#if !defined(_WIN32)
+        renderCoordinator coordinator;
+        if(workerTimeoutMs > 0.0)
+            coordinator.tileTimeoutMs = workerTimeoutMs;
+        coordinator.render(cam, argv[0], forwardedArgs, processes, failWorkerAfter);
+#else
+        std::cout << "--processes needs fork and pipes, which this platform build does not support\n";
+#endif
+        return 0;
+    }
 
-    if (!scene || scene->mFlags & AI_SCENE_FLAGS_INCOMPLETE || !scene->mRootNode)
+    // An existing cache built from this scene with these options is reused as is, so the scene file
+    // isn't even read, a stale one is rebuilt. Workers only ever read a cache, several of them
+    // writing the same file would corrupt it, so a stale one stops them.
+    bool worker = workerIn >= 0;
+    bool stale = false;
+    blasCacheSource expected{scenePath, importOpts.cacheFingerprint()};
+    world.materials.textures.budget = importOpts.textureBudget;
+    if(!importOpts.cachePath.empty() && world.openCache(importOpts.cachePath, importOpts.residentBudget, expected, stale, importOpts.optimizeLayout))
+    {
+        std::cout << "OPENED BLAS CACHE " << importOpts.cachePath << '\n';
+        if(!world.lights.empty())
+            world.lights.report(std::cout);
+    }
+    else if(worker && stale)
     {
-        std::cout << "ERROR::ASSIMP::" << importer.GetErrorString() << std::endl;
+        std::cout << "ERROR::CACHE::" << importOpts.cachePath << " does not match the scene and options of this worker" << std::endl;
         return 0;
     }
     else
     {
-        std::cout << "HEY WE IMPORTED THE THING!!! " << scene->mRootNode->mName.C_Str() << "\n";
+        if(worker)
+            importOpts.cachePath.clear();
+        if(!importScene(scenePath, world, importOpts, timings))
+            return 0;
+        timings.report(std::cout);
     }
+    cam.materials = &world.materials;
+    cam.lights = &world.lights;
+    world.topLevel.lodTolerance = lodTolerance;
 
-    std::vector<shared_ptr<model>> globalModelList;
-    buildModelList(globalModelList, scene->mRootNode, scene);
+#if !defined(_WIN32)
+    if(worker)
+    {
+        runRenderWorker(cam, world.topLevel, workerIn, workerOut, failAfter);
+        return 0;
+    }
+#endif
 
-    tlas t {&globalModelList, (int)globalModelList.size()};
+    // Replicas only pay off when there is more than one node to place them on
+    numaTopology topology = numaTopology::detect();
+    std::cout << topology.nodeCount() << " NUMA node(s) detected.\n";
+    if(numaReplicate && topology.nodeCount() > 1)
+        world.replicate(topology);
+    world.reportMemory(std::cout);
+    if(reportBvh)
+        world.reportBvh().report(std::cout, importOpts.bvhProfile.name);
 
-    camera cam;
-    cam.aspectRatio = 16.0 / 9.0;
-    cam.imageWidth = 1920;
-    cam.samplesPerPixel = 10;
-    cam.maxBounceDepth = 50;
-    cam.vfov = 90;
-    cam.lookFrom = point3{0.0, 530.0, 0.0};
-    cam.lookAt = point3{-3.0, 530.0, 0.0};
-    cam.vUp = vec3{0,1,0};
+    // Batch views, each line of a views file uses the service job fields on top of the command line camera
+    std::vector<camera> views;
+    if(!viewsPath.empty())
+    {
+        std::ifstream viewFile(viewsPath);
+        std::string line;
+        while(std::getline(viewFile, line))
+        {
+            if(line.empty() || line[0] == '#')
+                continue;
 
-    unsigned int n = std::thread::hardware_concurrency();
-    std::cout << n << " concurrent threads are supported.\n";
+            renderJob job{scenePath, cam};
+            std::string error;
+            if(parseRenderJob(line, job, error))
+                views.push_back(job.cam);
+            else
+                std::cout << "Skipping view \"" << line << "\": " << error << '\n';
+        }
+    }
+    else if(stereoSeparation > 0.0f)
+        views = stereoViews(cam, stereoSeparation);
+    else if(cubemap)
+        views = cubemapViews(cam);
+    else if(turntableFrames > 0)
+        views = turntableViews(cam, turntableFrames);
+
+    std::vector<tlas*> nodeScenes;
+    if(world.replicas.empty())
+        nodeScenes.push_back(&world.topLevel);
+    else
+    {
+        for(int node = 0; node < topology.nodeCount(); node++)
+            nodeScenes.push_back(&world.topLevelFor(node));
+    }
 
     std::cout << "STARTING RENDER\n";
     std::chrono::system_clock::time_point now = std::chrono::system_clock::now();
-    cam.render(t); 
+    if(!sequencePath.empty())
+    {
+        temporalHistory history;
+        history.maxFrames = historyFrames;
+        renderSequence(cam, path, sequenceFrames, nodeScenes, temporal ? &history : nullptr);
+    }
+    else if(!views.empty())
+        renderBatch(views, world.topLevel, cam.threadCount);
+    else
+        cam.render(nodeScenes);
     std::cout << "TIME TO RENDER: " << std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now() - now).count() << '\n';
     return 0;
 }
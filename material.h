@@ -0,0 +1,50 @@
+#ifndef MATERIAL_H
+#define MATERIAL_H
+
+#include <cmath>
+#include <vector>
+
+#include "color.h"
+#include "ray.h"
+#include "texture.h"
+
+// Diffuse material. Without a material the renderer keeps its original constant 0.5 albedo.
+struct material
+{
+    color albedo{0.5f, 0.5f, 0.5f};
+    color emission{0.0f, 0.0f, 0.0f};
+    int diffuseTexture = -1;        // textureCache id, multiplied with albedo
+    int opacityTexture = -1;        // textureCache id of the alpha mask
+};
+
+class materialLibrary
+{
+public:
+    std::vector<material> materials;
+    textureCache textures;
+
+    // Albedo at the hit for a ray cone coneWidth wide there. The cone is projected onto the surface
+    // and into texture space to pick the mip level, so wide secondary ray cones read small mips.
+    color albedo(const hitRecord& rec, float coneWidth, const vec3& direction)
+    {
+        if(rec.material < 0 || rec.material >= (int)materials.size())
+            return color{0.5f, 0.5f, 0.5f};
+
+        const material& m = materials[rec.material];
+        if(m.diffuseTexture < 0 || rec.uvPerWorld <= 0.0f)
+            return m.albedo;
+
+        float cosine = std::fabs(dot(direction, rec.normal)) / direction.length();
+        float uvWidth = coneWidth * rec.uvPerWorld / std::max(cosine, 0.05f);
+        return m.albedo * textures.sample(m.diffuseTexture, rec.texU, rec.texV, uvWidth, color{1.0f, 1.0f, 1.0f});
+    }
+
+    color emission(const hitRecord& rec) const
+    {
+        if(rec.material < 0 || rec.material >= (int)materials.size())
+            return color{0.0f, 0.0f, 0.0f};
+        return materials[rec.material].emission;
+    }
+};
+
+#endif
@@ -0,0 +1,294 @@
+#ifndef MESH_H
+#define MESH_H
+
+#include "aabb.h"
+#include "arena.h"
+#include "stats.h"
+#include "texture.h"
+#include "triangle.h"
+#include "utilities.h"
+
+#include <cstdint>
+#include <cstring>
+
+// Opacity of a triangle's whole texture space footprint, so only mixed triangles need the alpha test
+enum class triangleOpacity : uint8_t
+{
+    opaque,
+    transparent,
+    mixed
+};
+
+// Indexed triangle mesh. Vertices are shared through an index buffer that is 16 bits wide whenever
+// the mesh has few enough vertices, and positions can be quantized to 16 bits per axis relative to
+// the model bounds. Triangles are decoded on the fly when the BVH builds or intersects them.
+class indexedMesh
+{
+public:
+    int vertexCount = 0;
+    int triCount = 0;
+
+    indexedMesh(){}
+
+    // Allocates the vertex and index buffers from the arena in the most compact format allowed
+    indexedMesh(int vertices, int triangles, const aabb& bounds, bool quantize, bool compactIndices, sceneArena& arena)
+        : vertexCount(vertices), triCount(triangles)
+    {
+        if(quantize)
+        {
+            qOrigin = bounds.min();
+            vec3 extent = bounds.max() - bounds.min();
+            qScale = vec3{ extent.x() / 65535.0f, extent.y() / 65535.0f, extent.z() / 65535.0f };
+            qPositions = arena.allocate<uint16_t>(3 * vertices, arenaTag::geometry);
+        }
+        else
+            positions = arena.allocate<point3>(vertices, arenaTag::geometry);
+
+        if(compactIndices && vertices <= 65536)
+            indices16 = arena.allocate<uint16_t>(3 * triangles, arenaTag::meshIndices);
+        else
+            indices32 = arena.allocate<uint32_t>(3 * triangles, arenaTag::meshIndices);
+    }
+
+    // Worst case arena bytes, for float positions, texcoords, opacity classes and 32 bit indices
+    static size_t memoryRequired(int vertices, int triangles)
+    {
+        return vertices * (sizeof(point3) + 2 * sizeof(float)) + triangles * (3 * sizeof(uint32_t) + sizeof(triangleOpacity))
+             + sceneArena::slack(4);
+    }
+
+    void allocateTexcoords(sceneArena& arena)
+    {
+        texcoords = arena.allocate<float>(2 * vertexCount, arenaTag::texcoords);
+    }
+
+    bool hasTexcoords() const { return texcoords != nullptr; }
+
+    // Classifies every triangle against the mask texels its texcoord bounds cover, which are the texels
+    // alpha lookups on it can read. Returns false, and keeps no classes, when every triangle is opaque
+    // so the mesh skips the alpha test entirely.
+    bool classifyOpacity(const opacityPyramid& mask, sceneArena& arena, int counts[3])
+    {
+        triangleOpacity* classes = arena.allocate<triangleOpacity>(triCount, arenaTag::opacity);
+        int local[3] = {0, 0, 0};
+        for(int tri = 0; tri < triCount; tri++)
+        {
+            uint32_t v[3];
+            vertexIndices(tri, v[0], v[1], v[2]);
+            float u0 = infinity, v0 = infinity, u1 = -infinity, v1 = -infinity;
+            for(uint32_t i : v)
+            {
+                u0 = std::min(u0, texcoordU(i));
+                u1 = std::max(u1, texcoordU(i));
+                v0 = std::min(v0, texcoordV(i));
+                v1 = std::max(v1, texcoordV(i));
+            }
+
+            int x0 = (int)std::floor(u0 * mask.width()), y0 = (int)std::floor(v0 * mask.height());
+            int x1 = std::max(x0, (int)std::ceil(u1 * mask.width()) - 1), y1 = std::max(y0, (int)std::ceil(v1 * mask.height()) - 1);
+            uint8_t lo, hi;
+            mask.range(x0, y0, x1, y1, lo, hi);
+            classes[tri] = lo >= 128 ? triangleOpacity::opaque : hi < 128 ? triangleOpacity::transparent : triangleOpacity::mixed;
+            local[(int)classes[tri]]++;
+        }
+
+        for(int i = 0; i < 3; i++)
+            counts[i] += local[i];
+        opacity = local[0] < triCount ? classes : nullptr;
+        return opacity != nullptr;
+    }
+
+    bool alphaTested() const { return opacity != nullptr; }
+    bool transparent(int tri) const { return opacity && opacity[tri] == triangleOpacity::transparent; }
+
+    bool quantized() const { return qPositions != nullptr; }
+    bool compactIndices() const { return indices16 != nullptr; }
+    const vec3& quantizeOrigin() const { return qOrigin; }
+    const vec3& quantizeScale() const { return qScale; }
+
+    // Raw buffers, used to write the mesh to the out-of-core cache
+    const void* positionData() const { return qPositions ? (const void*)qPositions : (const void*)positions; }
+    size_t positionBytes() const { return vertexCount * (qPositions ? 3 * sizeof(uint16_t) : sizeof(point3)); }
+    const void* indexData() const { return indices16 ? (const void*)indices16 : (const void*)indices32; }
+    size_t indexBytes() const { return 3 * triCount * (indices16 ? sizeof(uint16_t) : sizeof(uint32_t)); }
+    const void* texcoordData() const { return texcoords; }
+    size_t texcoordBytes() const { return texcoords ? 2 * vertexCount * sizeof(float) : 0; }
+    const void* opacityData() const { return opacity; }
+    size_t opacityBytes() const { return opacity ? triCount * sizeof(triangleOpacity) : 0; }
+
+    // Wraps buffers written by positionData/indexData that live elsewhere, e.g. in a mapped cache page
+    static indexedMesh view(int vertices, int triangles, const void* positionData, bool quantized, const vec3& origin,
+                            const vec3& scale, const void* indexData, bool compactIndices, const void* texcoordData = nullptr,
+                            const void* opacityData = nullptr)
+    {
+        indexedMesh m;
+        m.vertexCount = vertices;
+        m.triCount = triangles;
+        if(quantized)
+        {
+            m.qPositions = static_cast<uint16_t*>(const_cast<void*>(positionData));
+            m.qOrigin = origin;
+            m.qScale = scale;
+        }
+        else
+            m.positions = static_cast<point3*>(const_cast<void*>(positionData));
+
+        if(compactIndices)
+            m.indices16 = static_cast<uint16_t*>(const_cast<void*>(indexData));
+        else
+            m.indices32 = static_cast<uint32_t*>(const_cast<void*>(indexData));
+        m.texcoords = static_cast<float*>(const_cast<void*>(texcoordData));
+        m.opacity = static_cast<triangleOpacity*>(const_cast<void*>(opacityData));
+        return m;
+    }
+
+    // Copy of the buffers in arena, used to give every NUMA node its own replica
+    indexedMesh clone(sceneArena& arena) const
+    {
+        indexedMesh m = *this;
+        if(qPositions)
+            m.qPositions = arena.allocate<uint16_t>(3 * vertexCount, arenaTag::geometry);
+        else
+            m.positions = arena.allocate<point3>(vertexCount, arenaTag::geometry);
+        if(vertexCount > 0)
+            std::memcpy(const_cast<void*>(m.positionData()), positionData(), positionBytes());
+
+        if(indices16)
+            m.indices16 = arena.allocate<uint16_t>(3 * triCount, arenaTag::meshIndices);
+        else
+            m.indices32 = arena.allocate<uint32_t>(3 * triCount, arenaTag::meshIndices);
+        if(triCount > 0)
+            std::memcpy(const_cast<void*>(m.indexData()), indexData(), indexBytes());
+
+        if(texcoords)
+        {
+            m.allocateTexcoords(arena);
+            std::memcpy(m.texcoords, texcoords, texcoordBytes());
+        }
+        if(opacity)
+        {
+            m.opacity = arena.allocate<triangleOpacity>(triCount, arenaTag::opacity);
+            std::memcpy(m.opacity, opacity, opacityBytes());
+        }
+        return m;
+    }
+
+    void setVertex(int i, const point3& p)
+    {
+        if(qPositions)
+        {
+            for(int x = 0; x < 3; x++)
+            {
+                float q = qScale[x] > 0.0f ? (p[x] - qOrigin[x]) / qScale[x] : 0.0f;
+                qPositions[3 * i + x] = (uint16_t)std::min(std::max(q + 0.5f, 0.0f), 65535.0f);
+            }
+        }
+        else
+            positions[i] = p;
+    }
+
+    void setTriangle(int i, uint32_t a, uint32_t b, uint32_t c)
+    {
+        if(indices16)
+        {
+            indices16[3 * i] = (uint16_t)a;
+            indices16[3 * i + 1] = (uint16_t)b;
+            indices16[3 * i + 2] = (uint16_t)c;
+        }
+        else
+        {
+            indices32[3 * i] = a;
+            indices32[3 * i + 1] = b;
+            indices32[3 * i + 2] = c;
+        }
+    }
+
+    void setTexcoord(int i, float u, float v)
+    {
+        texcoords[2 * i] = u;
+        texcoords[2 * i + 1] = v;
+    }
+
+    float texcoordU(uint32_t i) const { return texcoords[2 * i]; }
+    float texcoordV(uint32_t i) const { return texcoords[2 * i + 1]; }
+
+    point3 vertex(uint32_t i) const
+    {
+        if(qPositions)
+        {
+            const uint16_t* q = &qPositions[3 * i];
+            return point3{ qOrigin.x() + q[0] * qScale.x(), qOrigin.y() + q[1] * qScale.y(), qOrigin.z() + q[2] * qScale.z() };
+        }
+        return positions[i];
+    }
+
+    void vertexIndices(int tri, uint32_t& a, uint32_t& b, uint32_t& c) const
+    {
+        if(indices16)
+        {
+            a = indices16[3 * tri];
+            b = indices16[3 * tri + 1];
+            c = indices16[3 * tri + 2];
+        }
+        else
+        {
+            a = indices32[3 * tri];
+            b = indices32[3 * tri + 1];
+            c = indices32[3 * tri + 2];
+        }
+    }
+
+    triangle get(int tri) const
+    {
+        uint32_t a, b, c;
+        vertexIndices(tri, a, b, c);
+        return triangle{vertex(a), vertex(b), vertex(c)};
+    }
+
+    void hit(ray& r, int tri) const
+    {
+        get(tri).hit(r, tri);
+    }
+
+    // Any-hit path of alpha-tested meshes: transparent triangles are skipped, opaque ones take the
+    // plain test and only a closer hit on a mixed triangle pays for the mask lookup
+    void hitMasked(ray& r, int tri, const alphaTest& alpha) const
+    {
+        triangleOpacity o = opacity[tri];
+        if(o == triangleOpacity::transparent)
+            return;
+        if(o == triangleOpacity::opaque)
+        {
+            hit(r, tri);
+            return;
+        }
+
+        float t, u, v;
+        if(!get(tri).intersect(r, t, u, v))
+            return;
+
+        uint32_t a, b, c;
+        vertexIndices(tri, a, b, c);
+        float w = 1.0f - u - v;
+        threadStats().alphaTests++;
+        if(!alpha.passes(w * texcoordU(a) + u * texcoordU(b) + v * texcoordU(c), w * texcoordV(a) + u * texcoordV(b) + v * texcoordV(c)))
+            return;
+
+        r.t = t;
+        r.u = u;
+        r.v = v;
+        r.primIdx = tri;
+    }
+
+private:
+    point3* positions = nullptr;
+    uint16_t* qPositions = nullptr;
+    vec3 qOrigin{};
+    vec3 qScale{};
+    uint16_t* indices16 = nullptr;
+    uint32_t* indices32 = nullptr;
+    float* texcoords = nullptr;     // Optional, two per vertex
+    triangleOpacity* opacity = nullptr;     // Only kept for meshes with transparent or mixed triangles
+};
+
+#endif
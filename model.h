@@ -3,28 +3,54 @@
 
 #include "aabb.h"
 #include "bvh.h"
-#include "triangle.h"
+#include "lod.h"
+#include "mesh.h"
 #include "utilities.h"
 
-#include <vector>
-
 class model// : public hittable
 {
     public:
         aabb bounds {};
         bvh mbvh {};
 
-        std::vector<shared_ptr<triangle>> triangles;
+        indexedMesh mesh {};
+        int material = -1;      // Index into the scene's material library, -1 for the default material
+        alphaTest alpha {};     // Any-hit filter, only active when the mesh has transparent or mixed triangles
+        lodLevel lods[maxLodLevels] {};     // Ever coarser simplifications of mesh for wide secondary rays
+        int lodCount = 0;
 
         model(){}
 
         model(const point3& min, const point3& max) : bounds{min, max} {}
 
-        void clear() { triangles.clear(); }
-
-        void addTriangle(shared_ptr<triangle> object)
+        // paged is the mesh view of a resident out-of-core page when the model's own mesh was released
+        void resolveHit(const ray& r, hitRecord& rec, const indexedMesh* paged = nullptr) const
         {
-            triangles.push_back(object);
+            const indexedMesh& m = paged ? *paged : mesh;
+            triangle tri = m.get(r.primIdx);
+            rec.p = r.at(r.t);
+            rec.normal = tri.normal();
+            rec.u = r.u;
+            rec.v = r.v;
+            rec.instIdx = r.instIdx;
+            rec.primIdx = r.primIdx;
+            rec.material = material;
+
+            if(m.hasTexcoords())
+            {
+                uint32_t a, b, c;
+                m.vertexIndices(r.primIdx, a, b, c);
+                float w = 1.0f - r.u - r.v;
+                rec.texU = w * m.texcoordU(a) + r.u * m.texcoordU(b) + r.v * m.texcoordU(c);
+                rec.texV = w * m.texcoordV(a) + r.u * m.texcoordV(b) + r.v * m.texcoordV(c);
+
+                // Ratio of texture space to world space triangle area, as in ray cone texture LOD
+                float du1 = m.texcoordU(b) - m.texcoordU(a), dv1 = m.texcoordV(b) - m.texcoordV(a);
+                float du2 = m.texcoordU(c) - m.texcoordU(a), dv2 = m.texcoordV(c) - m.texcoordV(a);
+                float uvArea = std::fabs(du1 * dv2 - du2 * dv1);
+                float worldArea = cross(tri.v1() - tri.v0(), tri.v2() - tri.v0()).length();
+                rec.uvPerWorld = worldArea > 0.0f ? std::sqrt(uvArea / worldArea) : 0.0f;
+            }
         }
 };
 
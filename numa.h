@@ -0,0 +1,123 @@
+#ifndef NUMA_H
+#define NUMA_H
+
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if defined(_WIN32)
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#elif defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+// CPUs of every NUMA node that has any. Platforms without topology information, or machines with a
+// single node, come out as one node holding every hardware thread.
+struct numaTopology
+{
+    std::vector<std::vector<int>> nodeCpus;
+
+    int nodeCount() const { return (int)nodeCpus.size(); }
+
+    // Spreads workers over the nodes round robin, then over the CPUs of each node
+    int nodeOf(int worker) const { return worker % nodeCount(); }
+
+    int cpuOf(int worker) const
+    {
+        const std::vector<int>& cpus = nodeCpus[nodeOf(worker)];
+        return cpus[(worker / nodeCount()) % cpus.size()];
+    }
+
+    static numaTopology detect()
+    {
+        numaTopology topology;
+#if defined(__linux__)
+        for(int node = 0; ; node++)
+        {
+            std::ifstream file("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+            if(!file)
+                break;
+
+            std::string list;
+            std::getline(file, list);
+            std::vector<int> cpus = parseCpuList(list);
+            if(!cpus.empty())
+                topology.nodeCpus.push_back(cpus);
+        }
+#elif defined(_WIN32)
+        ULONG highest = 0;
+        if(GetNumaHighestNodeNumber(&highest))
+        {
+            for(ULONG node = 0; node <= highest; node++)
+            {
+                ULONGLONG mask = 0;
+                if(!GetNumaNodeProcessorMask((UCHAR)node, &mask))
+                    continue;
+
+                std::vector<int> cpus;
+                for(int cpu = 0; cpu < 64; cpu++)
+                    if(mask & (1ull << cpu))
+                        cpus.push_back(cpu);
+                if(!cpus.empty())
+                    topology.nodeCpus.push_back(cpus);
+            }
+        }
+#endif
+        if(topology.nodeCpus.empty())
+        {
+            std::vector<int> cpus(std::max(1u, std::thread::hardware_concurrency()));
+            for(int i = 0; i < (int)cpus.size(); i++)
+                cpus[i] = i;
+            topology.nodeCpus.push_back(cpus);
+        }
+        return topology;
+    }
+
+    // Parses the sysfs format, e.g. "0-7,16-23"
+    static std::vector<int> parseCpuList(const std::string& list)
+    {
+        std::vector<int> cpus;
+        std::stringstream ranges(list);
+        std::string range;
+        while(std::getline(ranges, range, ','))
+        {
+            if(range.empty())
+                continue;
+
+            size_t dash = range.find('-');
+            int first = std::stoi(range.substr(0, dash));
+            int last = dash == std::string::npos ? first : std::stoi(range.substr(dash + 1));
+            for(int cpu = first; cpu <= last; cpu++)
+                cpus.push_back(cpu);
+        }
+        return cpus;
+    }
+};
+
+// Restricts the calling thread to one CPU, returns false where pinning isn't supported
+inline bool pinCurrentThread(int cpu)
+{
+#if defined(__linux__)
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#elif defined(_WIN32)
+    return cpu < 64 && SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR)1 << cpu) != 0;
+#else
+    (void)cpu;
+    return false;
+#endif
+}
+
+#endif
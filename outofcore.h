@@ -0,0 +1,521 @@
+#ifndef OUTOFCORE_H
+#define OUTOFCORE_H
+
+#include "bvh.h"
+#include "lights.h"
+#include "material.h"
+#include "mesh.h"
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+// Out-of-core BLAS cache. Every model's BVH nodes, BVH indices, vertex buffer and index buffer are
+// written into one page aligned blob of a cache file, which is the unit that gets paged in and out.
+// The table of model bounds at the end of the file is all the TLAS needs, so it can be built and
+// kept resident without touching any BLAS data. The materials, texture paths and emitters of the
+// import follow the table, so opening a cache renders the same image as importing the scene. The
+// header names the scene and fingerprints the import options the cache was built with, so a cache
+// left over from other ones isn't reused.
+
+constexpr char blasCacheMagic[8] = {'R', 'T', 'B', 'L', 'A', 'S', '0', '6'};
+constexpr uint64_t blasCachePageAlign = 16384;      // Covers 4K (x86) and 16K (arm64 macOS) pages
+
+struct blasCacheHeader
+{
+    char magic[8];
+    uint32_t modelCount;
+    uint32_t scenePathLength;   // Bytes of the scene path stored right after the header
+    uint64_t tableOffset;
+    uint64_t fingerprint;       // Of the import options
+    uint32_t materialCount;     // Materials, texture paths and emitters, in that order after the table
+    uint32_t textureCount;
+    uint32_t emitterCount;
+    uint32_t reserved;
+};
+
+// The import's scene data besides the BLASes, which a cache keeps after its table
+struct blasCacheScene
+{
+    std::vector<material> materials;
+    std::vector<std::string> texturePaths;      // In textureCache id order
+    std::vector<emitter> emitters;
+};
+
+struct blasCacheMaterial
+{
+    float albedo[3];
+    float emission[3];
+    int32_t diffuseTexture;
+    int32_t opacityTexture;
+};
+
+struct blasCacheEmitter
+{
+    float vertices[9];
+    float normal[3];
+    float emission[3];
+    float area;
+    int32_t model;
+};
+
+// What a cache was built from
+struct blasCacheSource
+{
+    std::string scenePath;
+    uint64_t fingerprint = 0;
+};
+
+// FNV-1a over size bytes at data, continuing from hash
+inline uint64_t fingerprintBytes(uint64_t hash, const void* data, size_t size)
+{
+    const unsigned char* bytes = static_cast<const unsigned char*>(data);
+    for(size_t i = 0; i < size; i++)
+        hash = (hash ^ bytes[i]) * 1099511628211ull;
+    return hash;
+}
+
+struct blasCacheRecord
+{
+    float bounds[6];        // Model bounds
+    float bvhBounds[6];     // Root bounds of the BLAS
+    float qOrigin[3];
+    float qScale[3];
+    uint64_t offset;        // Blob position in the file, page aligned
+    uint64_t size;          // Blob size, a multiple of the page alignment
+    uint64_t nodesOffset;   // Array positions relative to the blob
+    uint64_t indicesOffset;
+    uint64_t positionsOffset;
+    uint64_t meshIndicesOffset;
+    uint64_t texcoordsOffset;
+    uint64_t opacityOffset;
+    uint64_t parentsOffset;
+    int32_t nodeCount;
+    int32_t triCount;
+    int32_t vertexCount;
+    uint32_t flags;
+    int32_t material;       // Material index of the model
+    int32_t depth;          // BVH depth, which decides between fixed stack and stackless traversal
+
+    static constexpr uint32_t quantized = 1;
+    static constexpr uint32_t compactIndices = 2;
+    static constexpr uint32_t texcoords = 4;
+    static constexpr uint32_t opacity = 8;
+    static constexpr uint32_t parents = 16;
+
+    aabb modelBounds() const { return aabb{point3{bounds[0], bounds[1], bounds[2]}, point3{bounds[3], bounds[4], bounds[5]}}; }
+    aabb rootBounds() const { return aabb{point3{bvhBounds[0], bvhBounds[1], bvhBounds[2]}, point3{bvhBounds[3], bvhBounds[4], bvhBounds[5]}}; }
+};
+
+inline uint64_t alignTo(uint64_t offset, uint64_t alignment)
+{
+    return (offset + alignment - 1) / alignment * alignment;
+}
+
+// Appends BLAS blobs to a cache file from any number of import workers
+class blasCacheWriter
+{
+public:
+    bool open(const std::string& path, int modelCount, const blasCacheSource& builtFrom)
+    {
+        if(sizeof(blasCacheHeader) + builtFrom.scenePath.size() > blasCachePageAlign)
+            return false;
+
+        file.open(path, std::ios::binary | std::ios::trunc);
+        records.assign(modelCount, blasCacheRecord{});
+        source = builtFrom;
+        end = blasCachePageAlign;
+        return (bool)file;
+    }
+
+    void write(int idx, const aabb& bounds, const indexedMesh& mesh, const bvh& tree, int material)
+    {
+        blasCacheRecord rec{};
+        for(int x = 0; x < 3; x++)
+        {
+            rec.bounds[x] = bounds.min()[x];
+            rec.bounds[x + 3] = bounds.max()[x];
+            rec.bvhBounds[x] = tree.bvhBounds.min()[x];
+            rec.bvhBounds[x + 3] = tree.bvhBounds.max()[x];
+            rec.qOrigin[x] = mesh.quantizeOrigin()[x];
+            rec.qScale[x] = mesh.quantizeScale()[x];
+        }
+        rec.nodeCount = tree.nodeCount();
+        rec.triCount = mesh.triCount;
+        rec.vertexCount = mesh.vertexCount;
+        rec.flags = (mesh.quantized() ? blasCacheRecord::quantized : 0) | (mesh.compactIndices() ? blasCacheRecord::compactIndices : 0)
+                  | (mesh.hasTexcoords() ? blasCacheRecord::texcoords : 0) | (mesh.alphaTested() ? blasCacheRecord::opacity : 0)
+                  | (tree.stackless() ? blasCacheRecord::parents : 0);
+        rec.material = material;
+        rec.depth = tree.treeDepth();
+
+        rec.nodesOffset = 0;
+        rec.indicesOffset = alignTo(rec.nodesOffset + tree.nodeBytes(), 64);
+        rec.positionsOffset = alignTo(rec.indicesOffset + tree.indexBytes(), 64);
+        rec.meshIndicesOffset = alignTo(rec.positionsOffset + mesh.positionBytes(), 64);
+        rec.texcoordsOffset = alignTo(rec.meshIndicesOffset + mesh.indexBytes(), 64);
+        rec.opacityOffset = alignTo(rec.texcoordsOffset + mesh.texcoordBytes(), 64);
+        rec.parentsOffset = alignTo(rec.opacityOffset + mesh.opacityBytes(), 64);
+        rec.size = alignTo(rec.parentsOffset + tree.parentBytes(), blasCachePageAlign);
+
+        std::vector<char> blob(rec.size, 0);
+        std::memcpy(blob.data() + rec.nodesOffset, tree.nodeData(), tree.nodeBytes());
+        std::memcpy(blob.data() + rec.indicesOffset, tree.indexData(), tree.indexBytes());
+        std::memcpy(blob.data() + rec.positionsOffset, mesh.positionData(), mesh.positionBytes());
+        std::memcpy(blob.data() + rec.meshIndicesOffset, mesh.indexData(), mesh.indexBytes());
+        if(mesh.hasTexcoords())
+            std::memcpy(blob.data() + rec.texcoordsOffset, mesh.texcoordData(), mesh.texcoordBytes());
+        if(mesh.alphaTested())
+            std::memcpy(blob.data() + rec.opacityOffset, mesh.opacityData(), mesh.opacityBytes());
+        if(tree.stackless())
+            std::memcpy(blob.data() + rec.parentsOffset, tree.parentData(), tree.parentBytes());
+
+        std::lock_guard<std::mutex> lock(mutex);
+        rec.offset = end;
+        end += rec.size;
+        file.seekp(rec.offset);
+        file.write(blob.data(), blob.size());
+        records[idx] = rec;
+    }
+
+    bool finish(const materialLibrary& library, const std::vector<emitter>& emitters)
+    {
+        blasCacheHeader header{};
+        std::memcpy(header.magic, blasCacheMagic, sizeof(header.magic));
+        header.modelCount = (uint32_t)records.size();
+        header.scenePathLength = (uint32_t)source.scenePath.size();
+        header.tableOffset = end;
+        header.fingerprint = source.fingerprint;
+        header.materialCount = (uint32_t)library.materials.size();
+        header.textureCount = (uint32_t)library.textures.count();
+        header.emitterCount = (uint32_t)emitters.size();
+
+        file.seekp(end);
+        file.write(reinterpret_cast<const char*>(records.data()), records.size() * sizeof(blasCacheRecord));
+        for(const material& m : library.materials)
+        {
+            blasCacheMaterial rec{};
+            for(int x = 0; x < 3; x++)
+            {
+                rec.albedo[x] = m.albedo[x];
+                rec.emission[x] = m.emission[x];
+            }
+            rec.diffuseTexture = m.diffuseTexture;
+            rec.opacityTexture = m.opacityTexture;
+            file.write(reinterpret_cast<const char*>(&rec), sizeof(rec));
+        }
+        for(int i = 0; i < library.textures.count(); i++)
+        {
+            const std::string& texturePath = library.textures.path(i);
+            uint32_t length = (uint32_t)texturePath.size();
+            file.write(reinterpret_cast<const char*>(&length), sizeof(length));
+            file.write(texturePath.data(), length);
+        }
+        for(const emitter& e : emitters)
+        {
+            blasCacheEmitter rec{};
+            for(int x = 0; x < 3; x++)
+            {
+                rec.vertices[x] = e.p0[x];
+                rec.vertices[x + 3] = e.p1[x];
+                rec.vertices[x + 6] = e.p2[x];
+                rec.normal[x] = e.normal[x];
+                rec.emission[x] = e.emission[x];
+            }
+            rec.area = e.area;
+            rec.model = e.model;
+            file.write(reinterpret_cast<const char*>(&rec), sizeof(rec));
+        }
+        file.seekp(0);
+        file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        file.write(source.scenePath.data(), source.scenePath.size());
+        file.close();
+        return !file.fail();
+    }
+
+private:
+    std::ofstream file;
+    std::vector<blasCacheRecord> records;
+    blasCacheSource source;
+    uint64_t end = 0;
+    std::mutex mutex;
+};
+
+// source, when given, receives what the cache was built from and contents the rest of the import
+inline bool readBlasCacheTable(const std::string& path, std::vector<blasCacheRecord>& records, blasCacheSource* source = nullptr,
+                               blasCacheScene* contents = nullptr)
+{
+    std::ifstream file(path, std::ios::binary);
+    blasCacheHeader header{};
+    if(!file.read(reinterpret_cast<char*>(&header), sizeof(header)) || std::memcmp(header.magic, blasCacheMagic, sizeof(header.magic)) != 0
+       || sizeof(header) + header.scenePathLength > blasCachePageAlign)
+        return false;
+
+    if(source)
+    {
+        source->scenePath.resize(header.scenePathLength);
+        source->fingerprint = header.fingerprint;
+        if(!file.read(&source->scenePath[0], header.scenePathLength))
+            return false;
+    }
+
+    records.resize(header.modelCount);
+    file.seekg(header.tableOffset);
+    if(!file.read(reinterpret_cast<char*>(records.data()), records.size() * sizeof(blasCacheRecord)))
+        return false;
+    if(!contents)
+        return true;
+
+    contents->materials.resize(header.materialCount);
+    for(material& m : contents->materials)
+    {
+        blasCacheMaterial rec;
+        if(!file.read(reinterpret_cast<char*>(&rec), sizeof(rec)))
+            return false;
+        m.albedo = color{rec.albedo[0], rec.albedo[1], rec.albedo[2]};
+        m.emission = color{rec.emission[0], rec.emission[1], rec.emission[2]};
+        m.diffuseTexture = rec.diffuseTexture;
+        m.opacityTexture = rec.opacityTexture;
+    }
+
+    contents->texturePaths.resize(header.textureCount);
+    for(std::string& texturePath : contents->texturePaths)
+    {
+        uint32_t length = 0;
+        if(!file.read(reinterpret_cast<char*>(&length), sizeof(length)) || length > blasCachePageAlign)
+            return false;
+        texturePath.resize(length);
+        if(length > 0 && !file.read(&texturePath[0], length))
+            return false;
+    }
+
+    contents->emitters.resize(header.emitterCount);
+    for(emitter& e : contents->emitters)
+    {
+        blasCacheEmitter rec;
+        if(!file.read(reinterpret_cast<char*>(&rec), sizeof(rec)))
+            return false;
+        e.p0 = point3{rec.vertices[0], rec.vertices[1], rec.vertices[2]};
+        e.p1 = point3{rec.vertices[3], rec.vertices[4], rec.vertices[5]};
+        e.p2 = point3{rec.vertices[6], rec.vertices[7], rec.vertices[8]};
+        e.normal = vec3{rec.normal[0], rec.normal[1], rec.normal[2]};
+        e.emission = color{rec.emission[0], rec.emission[1], rec.emission[2]};
+        e.area = rec.area;
+        e.model = rec.model;
+    }
+    return true;
+}
+
+// Pages BLAS blobs of a cache file in on demand under a resident byte budget, evicting the least
+// recently used unpinned blob when a new one does not fit. Traversal pins a blob between acquire
+// and release; the TLAS and the model table always stay resident.
+class blasPager
+{
+public:
+    struct page
+    {
+        std::atomic<bool> resident {false};
+        std::atomic<int> pins {0};
+        std::atomic<unsigned long long> lastUse {0};
+        void* data = nullptr;
+        indexedMesh mesh{};
+        bvh tree{};
+    };
+
+    blasPager(){}
+    blasPager(const blasPager&) = delete;
+    blasPager& operator=(const blasPager&) = delete;
+    ~blasPager() { close(); }
+
+    bool open(const std::string& cachePath, const std::vector<blasCacheRecord>& table, size_t budgetBytes)
+    {
+        close();
+        path = cachePath;
+        records = table;
+        budget = budgetBytes;
+        pages.reset(new page[records.size()]);
+
+#if defined(_WIN32)
+        return (bool)std::ifstream(path, std::ios::binary);
+#else
+        fd = ::open(path.c_str(), O_RDONLY);
+        return fd >= 0;
+#endif
+    }
+
+    void close()
+    {
+        if(pages)
+        {
+            for(size_t i = 0; i < records.size(); i++)
+                if(pages[i].resident)
+                    unmap(i);
+        }
+        pages.reset();
+#if !defined(_WIN32)
+        if(fd >= 0)
+            ::close(fd);
+        fd = -1;
+#endif
+    }
+
+    bool active() const { return (bool)pages; }
+
+    const page& acquire(int idx)
+    {
+        page& p = pages[idx];
+        p.pins++;
+        if(!p.resident)
+        {
+            p.pins--;
+            fault(idx);
+        }
+        // Recency is kept at fault granularity so hot pages aren't written to on every visit
+        unsigned long long now = clock.load(std::memory_order_relaxed);
+        if(p.lastUse.load(std::memory_order_relaxed) != now)
+            p.lastUse.store(now, std::memory_order_relaxed);
+        return p;
+    }
+
+    void release(int idx)
+    {
+        pages[idx].pins--;
+    }
+
+    void report(std::ostream& out, unsigned long long acquires) const
+    {
+        const double mb = 1.0 / (1024.0 * 1024.0);
+        double hitRate = acquires > 0 ? 1.0 - (double)faults / acquires : 1.0;
+        out << "PAGING: " << acquires << " BLAS visits, " << faults << " page faults (hit rate " << hitRate * 100.0 << "%), "
+            << evictions << " evictions, peak resident " << peakResident * mb << " MB of " << budget * mb << " MB budget\n";
+    }
+
+private:
+    std::string path;
+    std::vector<blasCacheRecord> records;
+    std::unique_ptr<page[]> pages;
+    size_t budget = 0;
+    size_t residentBytes = 0;
+    size_t peakResident = 0;
+    unsigned long long faults = 0;
+    unsigned long long evictions = 0;
+    std::atomic<unsigned long long> clock {0};
+    std::mutex mutex;
+#if !defined(_WIN32)
+    int fd = -1;
+#endif
+
+    // Makes idx resident and leaves it pinned once for the caller
+    void fault(int idx)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        page& p = pages[idx];
+        p.pins++;
+        if(p.resident)
+            return;
+
+        const blasCacheRecord& rec = records[idx];
+        evictFor(rec.size);
+        if(!map(idx))
+        {
+            std::cout << "ERROR::PAGING::could not page in BLAS " << idx << " from " << path << '\n';
+            std::abort();
+        }
+
+        const char* base = static_cast<const char*>(p.data);
+        p.mesh = indexedMesh::view(rec.vertexCount, rec.triCount, base + rec.positionsOffset, rec.flags & blasCacheRecord::quantized,
+                                   vec3{rec.qOrigin[0], rec.qOrigin[1], rec.qOrigin[2]}, vec3{rec.qScale[0], rec.qScale[1], rec.qScale[2]},
+                                   base + rec.meshIndicesOffset, rec.flags & blasCacheRecord::compactIndices,
+                                   rec.flags & blasCacheRecord::texcoords ? base + rec.texcoordsOffset : nullptr,
+                                   rec.flags & blasCacheRecord::opacity ? base + rec.opacityOffset : nullptr);
+        p.tree = bvh::view(&p.mesh, base + rec.nodesOffset, rec.nodeCount,
+                           reinterpret_cast<const int*>(base + rec.indicesOffset), rec.rootBounds(), rec.depth,
+                           rec.flags & blasCacheRecord::parents ? reinterpret_cast<const int*>(base + rec.parentsOffset) : nullptr);
+
+        p.lastUse = ++clock;
+        residentBytes += rec.size;
+        peakResident = std::max(peakResident, residentBytes);
+        faults++;
+        p.resident = true;
+    }
+
+    void evictFor(size_t bytes)
+    {
+        while(residentBytes + bytes > budget)
+        {
+            int victim = -1;
+            unsigned long long oldest = ~0ull;
+            for(size_t i = 0; i < records.size(); i++)
+            {
+                page& p = pages[i];
+                if(p.resident && p.pins == 0 && p.lastUse < oldest)
+                {
+                    oldest = p.lastUse;
+                    victim = (int)i;
+                }
+            }
+
+            // Everything left is pinned by traversals in flight, go over budget rather than wait
+            if(victim < 0)
+                return;
+
+            // Readers pin before checking resident, so clearing resident before checking pins means
+            // either they see the page going away or we see their pin
+            page& p = pages[victim];
+            p.resident = false;
+            if(p.pins > 0)
+            {
+                p.resident = true;
+                continue;
+            }
+
+            unmap(victim);
+            residentBytes -= records[victim].size;
+            evictions++;
+        }
+    }
+
+    bool map(int idx)
+    {
+        const blasCacheRecord& rec = records[idx];
+#if defined(_WIN32)
+        std::ifstream file(path, std::ios::binary);
+        void* data = ::operator new(rec.size);
+        file.seekg(rec.offset);
+        if(!file.read(static_cast<char*>(data), rec.size))
+        {
+            ::operator delete(data);
+            return false;
+        }
+#else
+        void* data = mmap(nullptr, rec.size, PROT_READ, MAP_PRIVATE, fd, (off_t)rec.offset);
+        if(data == MAP_FAILED)
+            return false;
+#endif
+        pages[idx].data = data;
+        return true;
+    }
+
+    void unmap(int idx)
+    {
+#if defined(_WIN32)
+        ::operator delete(pages[idx].data);
+#else
+        munmap(pages[idx].data, records[idx].size);
+#endif
+        pages[idx].data = nullptr;
+    }
+};
+
+#endif
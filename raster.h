@@ -0,0 +1,303 @@
+#ifndef RASTER_H
+#define RASTER_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <ostream>
+#include <thread>
+#include <vector>
+
+#include "scheduler.h"
+#include "tlas.h"
+
+// Nearest triangle at one pixel sample, invZ < 0 when nothing covers it
+struct visSample
+{
+    float invZ = -1.0f;
+    int model = -1;
+    int tri = -1;
+};
+
+// Sub pixel offset of sample s, shared by every pixel so the rasterizer knows where the primary
+// rays go. An R2 sequence spreads any count of samples evenly over the pixel.
+inline void rasterSampleOffset(int s, float& x, float& y)
+{
+    x = std::fmod(0.5f + s * 0.7548776662f, 1.0f) - 0.5f;
+    y = std::fmod(0.5f + s * 0.5698402910f, 1.0f) - 0.5f;
+}
+
+// Software rasterizer for primary visibility. A multithreaded setup pass projects every front
+// facing triangle, clips it to the near plane and bins it into fixed screen bins; rendering a tile
+// then rasterizes the triangles of the bins it covers with a per sample depth test into a visibility
+// buffer. Pixel positions are those of camera::getRay: pixel i's center is at screen x = i.
+class primaryRaster
+{
+public:
+    static constexpr int binSize = 64;
+
+    // Screen space triangle as three barycentric plane equations, lambda_k = a[k] x + b[k] y + c[k]
+    // with x, y relative to the first vertex, and 1/z interpolates linearly with them. Relative
+    // coordinates keep the constants from cancelling out on small triangles far from pixel 0, 0.
+    struct setup
+    {
+        float originX, originY;
+        float a[3], b[3], c[3];
+        float invZ[3];
+        int model;
+        int tri;
+        int x0, y0, x1, y1;     // Pixel bounds, inclusive
+    };
+
+    int width = 0;
+    int height = 0;
+    int samples = 1;
+    long long triangles = 0;    // Triangles set up, after back face and near plane culling
+    long long clipped = 0;      // Triangles that crossed the near plane
+    double setupMs = 0.0;
+
+    // Projects the scene behind t for a camera at eye whose pixel i, j center lies at
+    // pixel00 + i * du + j * dv
+    void build(const tlas& t, const point3& eye, const point3& pixel00, const vec3& du, const vec3& dv,
+               int imageWidth, int imageHeight, int samplesPerPixel, int threads)
+    {
+        auto start = std::chrono::steady_clock::now();
+        width = imageWidth;
+        height = imageHeight;
+        samples = samplesPerPixel;
+        binsX = (width + binSize - 1) / binSize;
+        binsY = (height + binSize - 1) / binSize;
+
+        camera = eye;
+        forward = cross(du, dv).normalize();
+        if(dot(forward, pixel00 - eye) < 0.0f)
+            forward = -forward;
+        focal = dot(pixel00 - eye, forward);
+        uAxis = du / du.squaredLength();
+        vAxis = dv / dv.squaredLength();
+        uOrigin = dot(eye - pixel00, uAxis);
+        vOrigin = dot(eye - pixel00, vAxis);
+        nearZ = 1e-4f * focal;
+
+        int workers = std::max(1, threads);
+        std::vector<std::vector<setup>> local(workers);
+        std::atomic<int> next {0};
+        std::atomic<long long> clippedCount {0};
+        auto worker = [&](int w)
+        {
+            long long clips = 0;
+            for(int m = next++; m < t.instanceCount(); m = next++)
+            {
+                const model& mdl = t.instance(m);
+                const indexedMesh* mesh = &mdl.mesh;
+                if(t.pager)
+                    mesh = &t.pager->acquire(m).mesh;
+                for(int tri = 0; tri < mesh->triCount; tri++)
+                {
+                    if(mesh->transparent(tri))
+                        continue;
+                    clips += addTriangle(mesh->get(tri), m, tri, local[w]) ? 1 : 0;
+                }
+                if(t.pager)
+                    t.pager->release(m);
+            }
+            clippedCount += clips;
+        };
+        std::vector<std::thread> pool;
+        for(int i = 1; i < workers; i++)
+            pool.emplace_back(worker, i);
+        worker(0);
+        for(auto& thread : pool)
+            thread.join();
+
+        // Counting sort of the setups into the bins they overlap
+        setups.clear();
+        for(std::vector<setup>& l : local)
+            setups.insert(setups.end(), l.begin(), l.end());
+        triangles = (long long)setups.size();
+        clipped = clippedCount;
+
+        binStart.assign(binsX * binsY + 1, 0);
+        for(const setup& s : setups)
+            forBins(s, [&](int bin) { binStart[bin + 1]++; });
+        for(int i = 0; i < binsX * binsY; i++)
+            binStart[i + 1] += binStart[i];
+        binEntries.resize(binStart.back());
+        std::vector<int> fill(binStart.begin(), binStart.end() - 1);
+        for(int i = 0; i < (int)setups.size(); i++)
+            forBins(setups[i], [&](int bin) { binEntries[fill[bin]++] = i; });
+
+        setupMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    // Visibility of every sample of tl, row by row with samples innermost. Equal depths go to the
+    // lower model and triangle index so the result does not depend on the binning order.
+    void rasterize(const tile& tl, std::vector<visSample>& out) const
+    {
+        int tileWidth = tl.x1 - tl.x0;
+        out.assign(tileWidth * (tl.y1 - tl.y0) * samples, visSample{});
+
+        float offsetX[maxSamples], offsetY[maxSamples];
+        int sampleCount = std::min(samples, maxSamples);
+        for(int s = 0; s < sampleCount; s++)
+            rasterSampleOffset(s, offsetX[s], offsetY[s]);
+
+        for(int by = tl.y0 / binSize; by <= (tl.y1 - 1) / binSize; by++)
+        {
+            for(int bx = tl.x0 / binSize; bx <= (tl.x1 - 1) / binSize; bx++)
+            {
+                int rx0 = std::max(tl.x0, bx * binSize), rx1 = std::min(tl.x1, (bx + 1) * binSize) - 1;
+                int ry0 = std::max(tl.y0, by * binSize), ry1 = std::min(tl.y1, (by + 1) * binSize) - 1;
+                int bin = by * binsX + bx;
+                for(int e = binStart[bin]; e < binStart[bin + 1]; e++)
+                {
+                    const setup& st = setups[binEntries[e]];
+                    int x0 = std::max(rx0, st.x0), x1 = std::min(rx1, st.x1);
+                    int y0 = std::max(ry0, st.y0), y1 = std::min(ry1, st.y1);
+                    for(int y = y0; y <= y1; y++)
+                    {
+                        for(int x = x0; x <= x1; x++)
+                        {
+                            visSample* pixel = &out[((y - tl.y0) * tileWidth + x - tl.x0) * samples];
+                            for(int s = 0; s < sampleCount; s++)
+                            {
+                                float sx = x + offsetX[s] - st.originX, sy = y + offsetY[s] - st.originY;
+                                float l0 = st.a[0] * sx + st.b[0] * sy + st.c[0];
+                                float l1 = st.a[1] * sx + st.b[1] * sy + st.c[1];
+                                float l2 = st.a[2] * sx + st.b[2] * sy + st.c[2];
+                                if(l0 < 0.0f || l1 < 0.0f || l2 < 0.0f)
+                                    continue;
+
+                                float invZ = l0 * st.invZ[0] + l1 * st.invZ[1] + l2 * st.invZ[2];
+                                visSample& v = pixel[s];
+                                if(invZ > v.invZ || (invZ == v.invZ && (st.model < v.model || (st.model == v.model && st.tri < v.tri))))
+                                    v = visSample{invZ, st.model, st.tri};
+                            }
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    void report(std::ostream& out) const
+    {
+        out << "RASTER: " << triangles << " triangle(s) set up (" << clipped << " near clipped), " << binEntries.size()
+            << " bin entries in " << binsX << "x" << binsY << " bins of " << binSize << "px, " << setupMs << " ms\n";
+    }
+
+    static constexpr int maxSamples = 256;
+
+private:
+    std::vector<setup> setups;
+    std::vector<int> binStart;      // Prefix sums, bin i holds binEntries[binStart[i], binStart[i + 1])
+    std::vector<int> binEntries;
+    int binsX = 0;
+    int binsY = 0;
+
+    point3 camera{};
+    vec3 forward{};
+    float focal = 1.0f;
+    vec3 uAxis{}, vAxis{};          // Viewport axes scaled to one unit per pixel
+    float uOrigin = 0.0f, vOrigin = 0.0f;
+    float nearZ = 0.0f;
+
+    template <typename F>
+    void forBins(const setup& s, F&& f) const
+    {
+        for(int by = s.y0 / binSize; by <= s.y1 / binSize; by++)
+            for(int bx = s.x0 / binSize; bx <= s.x1 / binSize; bx++)
+                f(by * binsX + bx);
+    }
+
+    // Adds the visible part of tri, returns true when it had to be clipped to the near plane
+    bool addTriangle(const triangle& tri, int model, int index, std::vector<setup>& out) const
+    {
+        // Back faces are culled like the ray tests cull them, which is one test for rays from one point
+        vec3 n = cross(tri.v1() - tri.v0(), tri.v2() - tri.v0());
+        if(dot(camera - tri.v0(), n) <= 0.0f)
+            return false;
+
+        vec3 d[4] = {tri.v0() - camera, tri.v1() - camera, tri.v2() - camera};
+        float z[4] = {dot(d[0], forward), dot(d[1], forward), dot(d[2], forward)};
+        if(z[0] >= nearZ && z[1] >= nearZ && z[2] >= nearZ)
+        {
+            project(d[0], d[1], d[2], z[0], z[1], z[2], model, index, out);
+            return false;
+        }
+        if(z[0] < nearZ && z[1] < nearZ && z[2] < nearZ)
+            return false;
+
+        // Sutherland-Hodgman against the near plane leaves a triangle or a quad
+        vec3 poly[4];
+        float polyZ[4];
+        int count = 0;
+        for(int i = 0; i < 3; i++)
+        {
+            int j = (i + 1) % 3;
+            if(z[i] >= nearZ)
+            {
+                poly[count] = d[i];
+                polyZ[count++] = z[i];
+            }
+            if((z[i] >= nearZ) != (z[j] >= nearZ))
+            {
+                float f = (nearZ - z[i]) / (z[j] - z[i]);
+                poly[count] = d[i] + f * (d[j] - d[i]);
+                polyZ[count++] = nearZ;
+            }
+        }
+        for(int i = 1; i + 1 < count; i++)
+            project(poly[0], poly[i], poly[i + 1], polyZ[0], polyZ[i], polyZ[i + 1], model, index, out);
+        return true;
+    }
+
+    void project(const vec3& d0, const vec3& d1, const vec3& d2, float z0, float z1, float z2, int model, int index,
+                 std::vector<setup>& out) const
+    {
+        const vec3* d[3] = {&d0, &d1, &d2};
+        float z[3] = {z0, z1, z2};
+        float x[3], y[3];
+        for(int k = 0; k < 3; k++)
+        {
+            float s = focal / z[k];
+            x[k] = uOrigin + s * dot(*d[k], uAxis);
+            y[k] = vOrigin + s * dot(*d[k], vAxis);
+        }
+
+        float area = (x[1] - x[0]) * (y[2] - y[0]) - (x[2] - x[0]) * (y[1] - y[0]);
+        if(std::fabs(area) < 1e-12f)
+            return;
+
+        // Pixel i covers samples in [i - 0.5, i + 0.5)
+        float minX = std::min({x[0], x[1], x[2]}), maxX = std::max({x[0], x[1], x[2]});
+        float minY = std::min({y[0], y[1], y[2]}), maxY = std::max({y[0], y[1], y[2]});
+        if(maxX < -0.5f || maxY < -0.5f || minX >= width - 0.5f || minY >= height - 0.5f)
+            return;
+
+        setup s;
+        s.x0 = std::max(0, (int)std::floor(minX + 0.5f));
+        s.x1 = std::min(width - 1, (int)std::floor(maxX + 0.5f));
+        s.y0 = std::max(0, (int)std::floor(minY + 0.5f));
+        s.y1 = std::min(height - 1, (int)std::floor(maxY + 0.5f));
+        float inv = 1.0f / area;
+        s.originX = x[0];
+        s.originY = y[0];
+        float rx[3] = {0.0f, x[1] - x[0], x[2] - x[0]};
+        float ry[3] = {0.0f, y[1] - y[0], y[2] - y[0]};
+        for(int k = 0; k < 3; k++)
+        {
+            int i = (k + 1) % 3, j = (k + 2) % 3;
+            s.a[k] = (ry[i] - ry[j]) * inv;
+            s.b[k] = (rx[j] - rx[i]) * inv;
+            s.c[k] = (rx[i] * ry[j] - rx[j] * ry[i]) * inv;
+            s.invZ[k] = 1.0f / z[k];
+        }
+        s.model = model;
+        s.tri = index;
+        out.push_back(s);
+    }
+};
+
+#endif
@@ -1,25 +1,61 @@
 #ifndef RAY_H
 #define RAY_H
 
+#include "simd.h"
 #include "vec3.h"
 
+// Shading attributes of the closest hit, reconstructed once after traversal
+struct hitRecord
+{
+    point3 p{};
+    vec3 normal{};
+    float u = 0.0f;
+    float v = 0.0f;
+    int instIdx = -1;
+    int primIdx = -1;
+    int material = -1;
+    float texU = 0.0f;          // Interpolated texture coordinates
+    float texV = 0.0f;
+    float uvPerWorld = 0.0f;    // Texture coordinate change per world unit across the triangle, 0 without texcoords
+};
+
 class ray
 {
 private:
     point3 orig {};
     vec3 dir {};
     vec3 invDir {};
+    float4 orig4 {};    // Origin and inverse direction widened for the SIMD slab tests
+    float4 invDir4 {};
 
 public:
+    // Closest hit found so far. Traversal only records these, everything else is
+    // rebuilt from them by tlas::resolve once the closest hit is known
     float t = infinity;
-    vec3 normal{};
+    float u = 0.0f;     // Barycentric coordinates of the hit on the triangle
+    float v = 0.0f;
+    int instIdx = -1;   // Index of the model (BLAS) that was hit
+    int primIdx = -1;   // Index of the triangle within that model
+    int lod = 0;        // Level of detail of that model the triangle belongs to, 0 for the full mesh
+
+    // Ray cone for texture filtering: footprint width at the origin and growth per unit of distance
+    float coneWidth = 0.0f;
+    float coneSpread = 0.0f;
+
+    int bounce = 0;         // Diffuse bounces the path made before this ray, 0 for primary rays
+    int originInst = -1;    // Model the ray leaves from, which it always sees at full detail
+    int targetInst = -1;    // Model a shadow ray is aimed at, likewise seen at full detail
 
     ray (): orig{0,0,0}, dir{0,0,0} {};
-    ray (const point3& o, const vec3& d) : orig (o), dir (d), invDir{ 1.0f / d[0], 1.0f / d[1], 1.0f / d[2] } {}
-    
+    ray (const point3& o, const vec3& d) : orig (o), dir (d), invDir{ 1.0f / d[0], 1.0f / d[1], 1.0f / d[2] },
+                                           orig4{float4::load3(orig)}, invDir4{float4::load3(invDir)} {}
+
+
     const point3& origin() const { return orig; }
     const vec3& direction() const { return dir; }
     const vec3& invDirection() const { return invDir; }
+    const float4& origin4() const { return orig4; }
+    const float4& invDirection4() const { return invDir4; }
 
     point3 at(float t) const
     {
@@ -0,0 +1,221 @@
+#ifndef SCENE_H
+#define SCENE_H
+
+#include "arena.h"
+#include "lights.h"
+#include "material.h"
+#include "model.h"
+#include "numa.h"
+#include "outofcore.h"
+#include "tlas.h"
+
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Read-only copy of a scene's models and acceleration structures placed in one NUMA node's memory
+struct sceneReplica
+{
+    sceneArena arena;
+    model* models = nullptr;
+    tlas topLevel{};
+};
+
+// Everything loaded for one scene. The arena owns the models, their triangles and every BVH/TLAS
+// array, so tearing the scene down is a single release of a handful of blocks.
+class scene
+{
+public:
+    sceneArena arena;
+    model* models = nullptr;
+    int modelCount = 0;
+    tlas topLevel{};
+    blasPager pager;
+    materialLibrary materials;
+    lightTree lights;           // Emissive triangles of the import
+    std::vector<std::unique_ptr<sceneReplica>> replicas;   // One per NUMA node once replicated
+
+    scene(){}
+    scene(const scene&) = delete;
+    scene& operator=(const scene&) = delete;
+
+    // Allocates everything up front from the mesh count and the total vertex and face counts of the import
+    void reserve(int meshCount, long long vertexCount, long long faceCount)
+    {
+        size_t bytes = meshCount * sizeof(model) + tlas::memoryRequired(meshCount) + sceneArena::slack(1)
+                     + indexedMesh::memoryRequired((int)vertexCount, (int)faceCount) + bvh::memoryRequired((int)faceCount)
+                     + meshCount * (indexedMesh::memoryRequired(0, 0) + bvh::memoryRequired(0));
+        arena.reserve(bytes);
+
+        models = arena.allocate<model>(meshCount, arenaTag::models);
+        modelCount = 0;
+    }
+
+    // A model with bounds only, for meshes whose data goes to the out-of-core cache
+    model& addModel(const point3& min, const point3& max)
+    {
+        return *new (&models[modelCount++]) model{min, max};
+    }
+
+    model& addModel(const point3& min, const point3& max, int vertexCount, int triangleCount, bool quantize, bool compactIndices)
+    {
+        model& m = addModel(min, max);
+        m.mesh = indexedMesh{vertexCount, triangleCount, m.bounds, quantize, compactIndices, arena};
+        return m;
+    }
+
+    void buildTopLevel(bool optimizeLayout = true, bool stackless = false)
+    {
+        topLevel = tlas{models, modelCount, arena};
+        if(optimizeLayout)
+            topLevel.optimizeLayout();
+        if(stackless)
+            topLevel.linkParents(arena);
+    }
+
+    // Builds the TLAS from the table of a BLAS cache file and pages BLAS data in from it on demand,
+    // keeping at most budgetBytes of it resident. The materials, textures and emitters of the import
+    // come from the cache too. A cache built from another scene or with other import options than
+    // expected isn't opened and sets stale.
+    bool openCache(const std::string& path, size_t budgetBytes, const blasCacheSource& expected, bool& stale,
+                   bool optimizeLayout = true)
+    {
+        std::vector<blasCacheRecord> table;
+        blasCacheSource source;
+        blasCacheScene contents;
+        stale = false;
+        if(!readBlasCacheTable(path, table, &source, &contents))
+            return false;
+        if(source.scenePath != expected.scenePath || source.fingerprint != expected.fingerprint)
+        {
+            std::cout << "CACHE: " << path << " was built from " << source.scenePath
+                      << (source.scenePath == expected.scenePath ? " with other import options" : "") << '\n';
+            stale = true;
+            return false;
+        }
+
+        materials.materials = std::move(contents.materials);
+        for(const std::string& texturePath : contents.texturePaths)
+            materials.textures.add(texturePath);
+        lights.build(std::move(contents.emitters));
+
+        reserve((int)table.size(), 0, 0);
+        for(const blasCacheRecord& rec : table)
+        {
+            model& m = addModel(rec.modelBounds().min(), rec.modelBounds().max());
+            m.mbvh.bvhBounds = rec.rootBounds();
+            m.material = rec.material;
+
+            // The cached triangles keep the opacity classes of the import, the mask itself is sampled lazily
+            int mask = m.material >= 0 && m.material < (int)materials.materials.size() ? materials.materials[m.material].opacityTexture : -1;
+            if(mask >= 0 && (rec.flags & blasCacheRecord::opacity))
+                m.alpha = alphaTest{&materials.textures, mask};
+        }
+        buildTopLevel(optimizeLayout);
+        return attachCache(path, table, budgetBytes);
+    }
+
+    bool attachCache(const std::string& path, const std::vector<blasCacheRecord>& table, size_t budgetBytes)
+    {
+        if(!pager.open(path, table, budgetBytes))
+            return false;
+        topLevel.pager = &pager;
+        return true;
+    }
+
+    // Copies the models, BLASes and TLAS once per NUMA node. Each copy is made by a thread pinned to
+    // that node so the first touch policy places its pages there. Out-of-core pages stay shared.
+    void replicate(const numaTopology& topology)
+    {
+        replicas.clear();
+        for(int node = 0; node < topology.nodeCount(); node++)
+        {
+            replicas.emplace_back(new sceneReplica{});
+            sceneReplica& replica = *replicas.back();
+
+            std::thread copier([&]()
+            {
+                pinCurrentThread(topology.nodeCpus[node][0]);
+                replica.arena.reserve(arena.bytesUsed() + sceneArena::slack((5 + 5 * maxLodLevels) * modelCount + 2));
+                replica.models = replica.arena.allocate<model>(modelCount, arenaTag::models);
+                for(int i = 0; i < modelCount; i++)
+                {
+                    model& m = *new (&replica.models[i]) model{models[i]};
+                    if(topLevel.pager)
+                        continue;
+
+                    m.mesh = models[i].mesh.clone(replica.arena);
+                    m.mbvh = models[i].mbvh.clone(&m.mesh, replica.arena);
+                    for(int l = 0; l < m.lodCount; l++)
+                    {
+                        m.lods[l].mesh = models[i].lods[l].mesh.clone(replica.arena);
+                        m.lods[l].tree = models[i].lods[l].tree.clone(&m.lods[l].mesh, replica.arena);
+                    }
+                }
+                replica.topLevel = topLevel.clone(replica.models, replica.arena);
+            });
+            copier.join();
+        }
+    }
+
+    // The material model idx renders with, copied first when other models share it so an edit of it
+    // changes this model only
+    material& ownMaterial(int idx)
+    {
+        int current = models[idx].material;
+        bool shared = current < 0;
+        for(int i = 0; i < modelCount && !shared; i++)
+            shared = i != idx && models[i].material == current;
+
+        if(shared)
+        {
+            materials.materials.push_back(current < 0 ? material{} : materials.materials[current]);
+            models[idx].material = (int)materials.materials.size() - 1;
+        }
+        return materials.materials[models[idx].material];
+    }
+
+    // Gathers the emitters of every model again, after the emission of their materials was edited.
+    // Models paged from a cache have no mesh to gather from, so their scenes keep the lights they have.
+    bool rebuildLights()
+    {
+        if(topLevel.pager)
+            return false;
+
+        std::vector<emitter> emitters;
+        for(int i = 0; i < modelCount; i++)
+        {
+            if(models[i].material < 0)
+                continue;
+            const color& emission = materials.materials[models[i].material].emission;
+            if(emission.x() > 0.0f || emission.y() > 0.0f || emission.z() > 0.0f)
+                gatherEmitters(models[i].mesh, emission, i, emitters);
+        }
+        lights.build(std::move(emitters));
+        return true;
+    }
+
+    // The TLAS workers on a node should traverse, the shared one until replicate() ran
+    tlas& topLevelFor(int node)
+    {
+        return replicas.empty() ? topLevel : replicas[node % replicas.size()]->topLevel;
+    }
+
+    bvhReport reportBvh() const
+    {
+        bvhReport rep;
+        for(int i = 0; i < modelCount; i++)
+            rep.merge(models[i].mbvh.report());
+        return rep;
+    }
+
+    void reportMemory(std::ostream& out) const
+    {
+        arena.report(out);
+        if(!replicas.empty())
+            out << "  + " << replicas.size() << " NUMA replica(s) of " << replicas[0]->arena.bytesUsed() / (1024.0 * 1024.0) << " MB\n";
+    }
+};
+
+#endif
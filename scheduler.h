@@ -0,0 +1,323 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include "utilities.h"
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Order in which tiles are handed to workers. Curve orders keep the tiles that are in flight at
+// the same time next to each other so they share BVH working sets.
+enum class tileOrder
+{
+    rowMajor,
+    morton,
+    hilbert,
+    spiral
+};
+
+inline bool parseTileOrder(const std::string& name, tileOrder& order)
+{
+    if(name == "row") order = tileOrder::rowMajor;
+    else if(name == "morton") order = tileOrder::morton;
+    else if(name == "hilbert") order = tileOrder::hilbert;
+    else if(name == "spiral") order = tileOrder::spiral;
+    else return false;
+
+    return true;
+}
+
+inline const char* tileOrderName(tileOrder order)
+{
+    switch(order)
+    {
+        case tileOrder::rowMajor: return "row";
+        case tileOrder::morton: return "morton";
+        case tileOrder::hilbert: return "hilbert";
+        case tileOrder::spiral: return "spiral";
+    }
+    return "unknown";
+}
+
+// Pixel rectangle [x0, x1) x [y0, y1)
+struct tile
+{
+    int x0 = 0;
+    int y0 = 0;
+    int x1 = 0;
+    int y1 = 0;
+
+    int pixels() const { return (x1 - x0) * (y1 - y0); }
+};
+
+// Parses x0,y0,x1,y1, e.g. a crop window
+inline bool parseTile(const std::string& text, tile& t)
+{
+    tile parsed;
+    char c1, c2, c3;
+    std::istringstream in(text);
+    if(!(in >> parsed.x0 >> c1 >> parsed.y0 >> c2 >> parsed.x1 >> c3 >> parsed.y1) || c1 != ',' || c2 != ',' || c3 != ','
+       || parsed.x0 >= parsed.x1 || parsed.y0 >= parsed.y1)
+        return false;
+    t = parsed;
+    return true;
+}
+
+inline unsigned int mortonIndex(unsigned int x, unsigned int y)
+{
+    unsigned int d = 0;
+    for(int b = 0; b < 16; b++)
+        d |= ((x >> b) & 1u) << (2 * b) | ((y >> b) & 1u) << (2 * b + 1);
+    return d;
+}
+
+// Distance along a Hilbert curve filling an n x n grid, n a power of two
+inline unsigned int hilbertIndex(unsigned int n, unsigned int x, unsigned int y)
+{
+    unsigned int d = 0;
+    for(unsigned int s = n / 2; s > 0; s /= 2)
+    {
+        unsigned int rx = (x & s) > 0;
+        unsigned int ry = (y & s) > 0;
+        d += s * s * ((3 * rx) ^ ry);
+        if(ry == 0)
+        {
+            if(rx == 1)
+            {
+                x = n - 1 - x;
+                y = n - 1 - y;
+            }
+            std::swap(x, y);
+        }
+    }
+    return d;
+}
+
+class tileScheduler
+{
+public:
+    tileOrder order = tileOrder::hilbert;
+    int tileSize = 0;               // Tile edge in pixels, 0 picks one from the image size and worker count
+    bool splitExpensive = true;     // Hand the unrendered half of slow tiles back to the queue. Every tile
+                                    // next() hands out must then be reported back through finished().
+
+    static int adaptiveTileSize(int width, int height, int workers)
+    {
+        // Aim for at least 16 tiles per worker so the tail of the frame stays balanced
+        float target = std::sqrt((float)width * height / (std::max(workers, 1) * 16.0f));
+        int size = 8;
+        while(size * 2 <= target && size < 64)
+            size *= 2;
+        return size;
+    }
+
+    void build(int width, int height, int workers)
+    {
+        workerCount = std::max(workers, 1);
+        size = tileSize > 0 ? tileSize : adaptiveTileSize(width, height, workerCount);
+
+        int tX = (width + size - 1) / size;
+        int tY = (height + size - 1) / size;
+        gridColumns = tX;
+        gridRows = tY;
+
+        unsigned int n = 1;
+        while(n < (unsigned int)std::max(tX, tY))
+            n *= 2;
+
+        std::vector<std::pair<float, tile>> keyed;
+        keyed.reserve(tX * tY);
+        for(int y = 0; y < tY; y++)
+        {
+            for(int x = 0; x < tX; x++)
+            {
+                tile t {x * size, y * size, std::min((x + 1) * size, width), std::min((y + 1) * size, height)};
+
+                float key = 0.0f;
+                switch(order)
+                {
+                    case tileOrder::rowMajor: key = (float)(y * tX + x); break;
+                    case tileOrder::morton: key = (float)mortonIndex(x, y); break;
+                    case tileOrder::hilbert: key = (float)hilbertIndex(n, x, y); break;
+                    case tileOrder::spiral:
+                    {
+                        // Ring around the center first, angle within the ring second
+                        float dx = x + 0.5f - tX * 0.5f;
+                        float dy = y + 0.5f - tY * 0.5f;
+                        float ring = std::floor(std::max(std::fabs(dx), std::fabs(dy)));
+                        key = ring * 8.0f + (std::atan2(dy, dx) + pi) / (2.0f * pi) * 8.0f;
+                        break;
+                    }
+                }
+                keyed.push_back({key, t});
+            }
+        }
+
+        std::stable_sort(keyed.begin(), keyed.end(), [](const auto& a, const auto& b) { return a.first < b.first; });
+
+        tiles.clear();
+        for(auto& k : keyed)
+            tiles.push_back(k.second);
+
+        nextTile = 0;
+        inFlight = 0;
+        splitQueue.clear();
+        splits = 0;
+        helpedSplits = 0;
+        finishedPixels = 0;
+        finishedMicros = 0;
+    }
+
+    // Keeps only the parts of the tiles inside region, e.g. a crop window. Tiles stay on the grid
+    // build() laid out, so cellOf() still finds them.
+    void clip(const tile& region)
+    {
+        std::vector<tile> kept;
+        for(const tile& t : tiles)
+        {
+            tile c {std::max(t.x0, region.x0), std::max(t.y0, region.y0), std::min(t.x1, region.x1), std::min(t.y1, region.y1)};
+            if(c.x0 < c.x1 && c.y0 < c.y1)
+                kept.push_back(c);
+        }
+        tiles.swap(kept);
+    }
+
+    // Keeps only the tiles whose cell is set in cells, which holds one entry per cell row by row
+    void select(const std::vector<uint8_t>& cells)
+    {
+        std::vector<tile> kept;
+        for(const tile& t : tiles)
+        {
+            if(cells[cellOf(t)])
+                kept.push_back(t);
+        }
+        tiles.swap(kept);
+    }
+
+    // Grid cell of a tile or of any part of one
+    int cellOf(const tile& t) const { return (t.y0 / size) * gridColumns + t.x0 / size; }
+
+    // Hands out the next tile. With splitting on, a worker that finds the queue empty while other
+    // tiles are still being rendered waits for one of them to split off its bottom half, and only
+    // returns false once no tile is left in flight.
+    bool next(tile& t)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        while(true)
+        {
+            if(!splitQueue.empty())
+            {
+                t = splitQueue.back().part;
+                if(splitQueue.back().by != std::this_thread::get_id())
+                    helpedSplits++;
+                splitQueue.pop_back();
+                inFlight++;
+                return true;
+            }
+            if(nextTile < (int)tiles.size())
+            {
+                t = tiles[nextTile++];
+                inFlight++;
+                return true;
+            }
+            if(!splitExpensive || inFlight == 0)
+                return false;
+            waiting++;
+            splitReady.wait(lock);
+            waiting--;
+        }
+    }
+
+    // Called by a worker after finishing row nextRow - 1 of t. When the tile is running well over the
+    // average cost and another worker waits in next() for want of tiles, the remaining rows are split
+    // in half and the bottom half is handed to it. Returns true if t was shrunk.
+    bool trySplit(tile& t, int nextRow, double elapsedMicros)
+    {
+        if(!splitExpensive)
+            return false;
+
+        int rowsLeft = t.y1 - nextRow;
+        if(rowsLeft < 2 * minSplitRows || idleWorkers() == 0)
+            return false;
+
+        long long pixels = finishedPixels;
+        if(pixels == 0)
+            return false;
+
+        double expected = (double)finishedMicros / pixels * (t.x1 - t.x0) * (nextRow - t.y0);
+        if(elapsedMicros < 2.0 * expected)
+            return false;
+
+        int mid = nextRow + rowsLeft / 2;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            splitQueue.push_back({{t.x0, mid, t.x1, t.y1}, std::this_thread::get_id()});
+        }
+        splitReady.notify_one();
+        t.y1 = mid;
+        splits++;
+        return true;
+    }
+
+    void finished(const tile& t, double elapsedMicros)
+    {
+        finishedPixels += t.pixels();
+        finishedMicros += (long long)elapsedMicros;
+
+        // The last tile in flight lets the workers waiting for a split go
+        bool last;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            last = --inFlight == 0;
+        }
+        if(last)
+            splitReady.notify_all();
+    }
+
+    int tileEdge() const { return size; }
+    int tileCount() const { return (int)tiles.size(); }
+    int cellCount() const { return gridColumns * gridRows; }
+    int splitCount() const { return splits; }
+    int helpedSplitCount() const { return helpedSplits; }   // Split off halves another worker rendered
+
+private:
+    static constexpr int minSplitRows = 2;
+
+    struct splitPart
+    {
+        tile part;
+        std::thread::id by;     // Worker that split it off
+    };
+
+    std::vector<tile> tiles;
+    int nextTile = 0;           // Guarded by mutex, like everything below up to splitReady
+    int inFlight = 0;           // Tiles and parts handed out and not finished yet
+    int waiting = 0;            // Workers in next() waiting for a split
+    std::vector<splitPart> splitQueue;
+    int helpedSplits = 0;
+    std::mutex mutex;
+    std::condition_variable splitReady;
+    std::atomic<int> splits {0};
+    std::atomic<long long> finishedPixels {0};
+    std::atomic<long long> finishedMicros {0};
+    int workerCount = 1;
+    int size = 16;
+    int gridColumns = 0;
+    int gridRows = 0;
+
+    // Waiting workers no queued split is on its way to yet
+    int idleWorkers()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return std::max(waiting - (int)splitQueue.size(), 0);
+    }
+};
+
+#endif
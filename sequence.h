@@ -0,0 +1,178 @@
+#ifndef SEQUENCE_H
+#define SEQUENCE_H
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "batch.h"
+#include "camera.h"
+#include "temporal.h"
+#include "tlas.h"
+
+// Camera pose at one moment of a path
+struct cameraKey
+{
+    float time = 0.0f;
+    point3 lookFrom{};
+    point3 lookAt{};
+    vec3 vUp{};
+    double vfov = 90;
+    bool linear = false;    // The path runs straight to the next key instead of along a spline
+};
+
+// Camera path through keyframes. Positions and look at points follow a Catmull-Rom spline through
+// the keys, with tangents scaled by the time between them so uneven spacing doesn't overshoot,
+// the up vector and field of view are interpolated linearly.
+class cameraPath
+{
+public:
+    std::vector<cameraKey> keys;
+
+    // One key per line of whitespace separated key=value pairs:
+    //   time=0 from=0,530,0 at=-3,530,0 up=0,1,0 vfov=90 interp=smooth|linear
+    // Fields a line leaves out keep the previous key's value, the first key starts from base.
+    bool load(const std::string& path, const camera& base, std::string& error)
+    {
+        std::ifstream in(path);
+        if(!in)
+        {
+            error = "could not open " + path;
+            return false;
+        }
+
+        keys.clear();
+        cameraKey key{0.0f, base.lookFrom, base.lookAt, base.vUp, base.vfov, false};
+        std::string line;
+        while(std::getline(in, line))
+        {
+            if(line.empty() || line[0] == '#')
+                continue;
+
+            std::istringstream fields(line);
+            std::string field;
+            bool timed = false;
+            while(fields >> field)
+            {
+                size_t eq = field.find('=');
+                if(eq == std::string::npos)
+                {
+                    error = "expected key=value, got " + field;
+                    return false;
+                }
+
+                std::string name = field.substr(0, eq);
+                std::string value = field.substr(eq + 1);
+                bool ok = true;
+                if(name == "time")
+                {
+                    key.time = std::atof(value.c_str());
+                    timed = true;
+                }
+                else if(name == "from") ok = parseVec3(value, key.lookFrom);
+                else if(name == "at") ok = parseVec3(value, key.lookAt);
+                else if(name == "up") ok = parseVec3(value, key.vUp);
+                else if(name == "vfov") key.vfov = std::atof(value.c_str());
+                else if(name == "interp" && (value == "smooth" || value == "linear")) key.linear = value == "linear";
+                else ok = false;
+
+                if(!ok)
+                {
+                    error = "bad field " + field + " in \"" + line + "\"";
+                    return false;
+                }
+            }
+
+            if(!timed || (!keys.empty() && key.time <= keys.back().time))
+            {
+                error = "every key needs a time after the previous key's, in \"" + line + "\"";
+                return false;
+            }
+            keys.push_back(key);
+        }
+
+        if(keys.empty())
+        {
+            error = "no keys in " + path;
+            return false;
+        }
+        return true;
+    }
+
+    float startTime() const { return keys.front().time; }
+    float endTime() const { return keys.back().time; }
+
+    // Poses cam at time, clamped to the path
+    void pose(float time, camera& cam) const
+    {
+        time = std::min(std::max(time, startTime()), endTime());
+        size_t i = 0;
+        while(i + 2 < keys.size() && keys[i + 1].time <= time)
+            i++;
+
+        const cameraKey& k1 = keys[i];
+        const cameraKey& k2 = keys[std::min(i + 1, keys.size() - 1)];
+        float span = k2.time - k1.time;
+        float s = span > 0.0f ? (time - k1.time) / span : 0.0f;
+
+        const cameraKey& k0 = keys[i > 0 ? i - 1 : i];
+        const cameraKey& k3 = keys[std::min(i + 2, keys.size() - 1)];
+        cam.lookFrom = interpolate(k0, k1, k2, k3, k0.lookFrom, k1.lookFrom, k2.lookFrom, k3.lookFrom, s);
+        cam.lookAt = interpolate(k0, k1, k2, k3, k0.lookAt, k1.lookAt, k2.lookAt, k3.lookAt, s);
+        cam.vUp = k1.vUp + (k2.vUp - k1.vUp) * s;
+        cam.vfov = k1.vfov + (k2.vfov - k1.vfov) * s;
+    }
+
+private:
+    // Cubic Hermite segment from p1 to p2 with Catmull-Rom tangents, or the straight line
+    static vec3 interpolate(const cameraKey& k0, const cameraKey& k1, const cameraKey& k2, const cameraKey& k3,
+                            const vec3& p0, const vec3& p1, const vec3& p2, const vec3& p3, float s)
+    {
+        if(k1.linear)
+            return p1 + (p2 - p1) * s;
+
+        float span = k2.time - k1.time;
+        vec3 m1 = k2.time > k0.time ? (p2 - p0) * (span / (k2.time - k0.time)) : p2 - p1;
+        vec3 m2 = k3.time > k1.time ? (p3 - p1) * (span / (k3.time - k1.time)) : p2 - p1;
+
+        float s2 = s * s;
+        float s3 = s2 * s;
+        return p1 * (2 * s3 - 3 * s2 + 1) + m1 * (s3 - 2 * s2 + s) + p2 * (-2 * s3 + 3 * s2) + m2 * (s3 - s2);
+    }
+};
+
+// Renders frames evenly spaced along path, first and last key included, into numbered copies of
+// base's output path. The scene stays loaded and its TLAS built across frames. With a history each
+// frame reuses the radiance of the one before where it still sees the same surfaces.
+inline void renderSequence(const camera& base, const cameraPath& path, int frames, const std::vector<tlas*>& nodeScenes,
+                           temporalHistory* history)
+{
+    auto start = std::chrono::steady_clock::now();
+    for(int i = 0; i < frames; i++)
+    {
+        float time = frames > 1 ? path.startTime() + (path.endTime() - path.startTime()) * i / (frames - 1) : path.startTime();
+
+        char number[16];
+        std::snprintf(number, sizeof(number), "%04d", i);
+        camera cam = base;
+        path.pose(time, cam);
+        cam.outputPath = viewOutputPath(base.outputPath, number);
+        cam.history = history;
+
+        std::cout << "FRAME " << i << " AT " << time << '\n';
+        cam.render(nodeScenes);
+    }
+    double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+    std::cout << "SEQUENCE: " << frames << " frame(s) along " << path.keys.size() << " key(s), " << ms << " ms ("
+              << (frames > 0 ? ms / frames : 0.0) << " ms per frame)";
+    if(history)
+        std::cout << ", temporal history of up to " << history->maxFrames << " frames";
+    std::cout << '\n';
+}
+
+#endif
@@ -0,0 +1,429 @@
+#ifndef SERVICE_H
+#define SERVICE_H
+
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <istream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if !defined(_WIN32)
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+#include "camera.h"
+#include "importer.h"
+#include "scene.h"
+#include "tilehits.h"
+
+// One line of a job stream, whitespace separated key=value pairs on top of the service defaults:
+//   scene=sponza/sponza.obj from=0,530,0 at=-3,530,0 up=0,1,0 vfov=90 width=1920 height=1080 spp=10 depth=50 out=a.ppm
+//   format=rgb8|half|rgb9e5 crop=x0,y0,x1,y1 keep=0|1 albedo=model:r,g,b emission=model:r,g,b changed=model,model
+// keep=1 keeps the frame and the models each of its tiles reached, one kept frame per scene. albedo
+// and emission edit one model's material in the resident scene. A later job on the kept frame's
+// output and view redraws the models edited and the ones listed by changed only in the tiles that
+// reached them.
+struct materialEdit
+{
+    int model = -1;
+    bool emission = false;      // Sets the emission instead of the albedo
+    color value{};
+};
+
+struct renderJob
+{
+    std::string scenePath;
+    camera cam;
+    std::vector<materialEdit> edits{};
+    std::vector<int> changed{};
+    bool keep = false;
+};
+
+// model:r,g,b
+inline bool parseMaterialEdit(const std::string& text, bool emission, materialEdit& edit)
+{
+    size_t colon = text.find(':');
+    if(colon == std::string::npos || colon == 0)
+        return false;
+    edit.model = std::atoi(text.substr(0, colon).c_str());
+    edit.emission = emission;
+    return edit.model >= 0 && parseVec3(text.substr(colon + 1), edit.value);
+}
+
+// Comma separated model indices
+inline bool parseModelList(const std::string& text, std::vector<int>& models)
+{
+    std::istringstream in(text);
+    std::string item;
+    while(std::getline(in, item, ','))
+    {
+        if(item.empty() || item.find_first_not_of("0123456789") != std::string::npos)
+            return false;
+        models.push_back(std::atoi(item.c_str()));
+    }
+    return true;
+}
+
+inline bool parseRenderJob(const std::string& line, renderJob& job, std::string& error)
+{
+    std::istringstream in(line);
+    std::string field;
+    int height = 0;
+    while(in >> field)
+    {
+        size_t eq = field.find('=');
+        if(eq == std::string::npos)
+        {
+            error = "expected key=value, got " + field;
+            return false;
+        }
+
+        std::string key = field.substr(0, eq);
+        std::string value = field.substr(eq + 1);
+        bool ok = true;
+        if(key == "scene") job.scenePath = value;
+        else if(key == "from") ok = parseVec3(value, job.cam.lookFrom);
+        else if(key == "at") ok = parseVec3(value, job.cam.lookAt);
+        else if(key == "up") ok = parseVec3(value, job.cam.vUp);
+        else if(key == "vfov") job.cam.vfov = std::atof(value.c_str());
+        else if(key == "width") job.cam.imageWidth = std::atoi(value.c_str());
+        else if(key == "height") height = std::atoi(value.c_str());
+        else if(key == "spp") job.cam.samplesPerPixel = std::atoi(value.c_str());
+        else if(key == "depth") job.cam.maxBounceDepth = std::atoi(value.c_str());
+        else if(key == "out") job.cam.outputPath = value;
+        else if(key == "format") ok = parsePixelFormat(value, job.cam.framebufferFormat);
+        else if(key == "crop") ok = parseTile(value, job.cam.crop);
+        else if(key == "albedo" || key == "emission")
+        {
+            job.edits.emplace_back();
+            ok = parseMaterialEdit(value, key == "emission", job.edits.back());
+        }
+        else if(key == "changed") ok = parseModelList(value, job.changed);
+        else if(key == "keep" && (value == "0" || value == "1")) job.keep = value == "1";
+        else ok = false;
+
+        if(!ok)
+        {
+            error = "bad field " + field;
+            return false;
+        }
+    }
+
+    if(job.cam.imageWidth < 1 || job.cam.samplesPerPixel < 1)
+    {
+        error = "width and spp must be positive";
+        return false;
+    }
+    if(height > 0)
+        job.cam.aspectRatio = (double)job.cam.imageWidth / height;
+    return true;
+}
+
+// Long running renderer. Scenes are imported on the first job that names them and stay resident,
+// BLASes and TLAS included, so later jobs on the same scene only pay for the render itself.
+class renderService
+{
+public:
+    // lodTolerance is set on the TLAS of every scene the service loads
+    renderService(const camera& defaults, const std::string& defaultScene, const importOptions& options, float lodTolerance)
+        : defaults(defaults), defaultScene(defaultScene), options(options), lodTolerance(lodTolerance) {}
+
+    // Runs one job line and returns the status line to answer it with
+    std::string run(const std::string& line)
+    {
+        renderJob job{defaultScene, defaults};
+        std::string error;
+        if(!parseRenderJob(line, job, error))
+            return "ERROR " + error;
+
+        scene* world = load(job.scenePath);
+        if(!world)
+            return "ERROR could not import " + job.scenePath;
+        for(const materialEdit& edit : job.edits)
+        {
+            if(edit.model >= world->modelCount)
+                return "ERROR no model " + std::to_string(edit.model) + " in " + job.scenePath;
+        }
+
+        auto start = std::chrono::steady_clock::now();
+        int revision = revisions[job.scenePath];
+        bool lightsChanged = applyEdits(*world, job);
+        if(lightsChanged)
+            world->rebuildLights();
+        if(!job.edits.empty())
+            revisions[job.scenePath]++;
+
+        job.cam.materials = &world->materials;
+        job.cam.lights = &world->lights;
+        // Emission reaches every tile the light can, not just the ones that looked at the emitter
+        if(lightsChanged)
+            std::cout << "EDIT: emission edited, " << world->lights.lightCount() << " emitter(s) gathered again, rendering every tile\n";
+
+        auto found = keptRenders.find(job.scenePath);
+        keptRender* kept = found != keptRenders.end() && found->second.outputPath == job.cam.outputPath ? &found->second : nullptr;
+        bool incremental = kept && !lightsChanged && kept->view == viewOf(job.cam) && kept->revision == revision;
+        if(job.cam.crop.pixels() > 0)
+        {
+            // Renders into the image file, which the kept image no longer matches
+            if(kept)
+                kept->view.clear();
+            job.cam.render(world->topLevel);
+        }
+        else if(!job.changed.empty() && incremental)
+        {
+            job.cam.renderChanged(world->topLevel, kept->image, kept->hits, job.changed);
+            kept->revision = revisions[job.scenePath];
+        }
+        else
+        {
+            if(!job.changed.empty() && !lightsChanged)
+                std::cout << "INCREMENTAL: no kept frame of this output and view, rendering every tile\n";
+            if(job.keep)
+            {
+                keptRender& replaced = keptRenders[job.scenePath];
+                renderKept(job.cam, *world, replaced);
+                replaced.revision = revisions[job.scenePath];
+            }
+            else
+                job.cam.render(world->topLevel);
+        }
+        jobsDone++;
+
+        std::ostringstream status;
+        status << "DONE " << job.cam.outputPath << ' ' << msSince(start) << " ms";
+        return status.str();
+    }
+
+    // Job file or stdin, one job per line; blank lines and lines starting with # are skipped
+    void serveStream(std::istream& in, std::ostream& out)
+    {
+        std::string line;
+        while(std::getline(in, line))
+        {
+            if(line.empty() || line[0] == '#')
+                continue;
+            if(line == "quit")
+                break;
+            out << run(line) << std::endl;
+        }
+        report(out);
+    }
+
+#if !defined(_WIN32)
+    // Accepts any number of clients on a Unix socket. Every client line is queued and rendered in
+    // arrival order by the calling thread, and answered on the client's connection. A "quit" line
+    // from any client stops the service once the jobs ahead of it are done.
+    bool serveSocket(const std::string& path)
+    {
+        int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+        sockaddr_un address{};
+        address.sun_family = AF_UNIX;
+        if(listener < 0 || path.size() >= sizeof(address.sun_path))
+            return false;
+        std::strncpy(address.sun_path, path.c_str(), sizeof(address.sun_path) - 1);
+
+        unlink(path.c_str());
+        if(bind(listener, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 || listen(listener, 16) != 0)
+        {
+            close(listener);
+            return false;
+        }
+        std::cout << "SERVING ON " << path << std::endl;
+
+        std::thread acceptor([this, listener]()
+        {
+            while(true)
+            {
+                int fd = accept(listener, nullptr, nullptr);
+                if(fd < 0)
+                    break;
+                std::thread(&renderService::readClient, this, std::make_shared<client>(fd)).detach();
+            }
+        });
+
+        while(true)
+        {
+            queuedJob job;
+            {
+                std::unique_lock<std::mutex> lock(queueMutex);
+                queueReady.wait(lock, [this]() { return !queue.empty(); });
+                job = queue.front();
+                queue.pop_front();
+            }
+
+            if(job.line == "quit")
+            {
+                job.from->send("BYE");
+                break;
+            }
+            job.from->send(run(job.line));
+        }
+
+        shutdown(listener, SHUT_RDWR);
+        close(listener);
+        acceptor.join();
+        unlink(path.c_str());
+        report(std::cout);
+        return true;
+    }
+#endif
+
+    void report(std::ostream& out) const
+    {
+        out << "SERVICE: " << jobsDone << " job(s) rendered, " << scenes.size() << " scene(s) resident\n";
+    }
+
+private:
+    camera defaults;
+    std::string defaultScene;
+    importOptions options;
+    float lodTolerance;
+    std::map<std::string, std::unique_ptr<scene>> scenes;
+    int jobsDone = 0;
+
+    // Last frame a keep=1 job rendered with the hits its tiles recorded, to redo after edits
+    struct keptRender
+    {
+        std::string outputPath;
+        std::string view;       // viewOf() the camera that rendered it, empty when there is none
+        int revision = 0;       // Edits of the scene it includes
+        framebuffer image;
+        tileHits hits;
+    };
+
+    std::map<std::string, keptRender> keptRenders;   // By scene path, only the latest one of each
+    std::map<std::string, int> revisions;           // Material edits made to each resident scene
+
+    // Everything about a camera that changes which pixels it renders
+    static std::string viewOf(const camera& cam)
+    {
+        std::ostringstream view;
+        view << cam.lookFrom << ' ' << cam.lookAt << ' ' << cam.vUp << ' ' << cam.vfov << ' ' << cam.imageWidth << ' '
+             << cam.aspectRatio << ' ' << cam.samplesPerPixel << ' ' << cam.maxBounceDepth << ' ' << (int)cam.framebufferFormat;
+        return view.str();
+    }
+
+    // Applies the job's material edits and adds the edited models to its changed ones. Returns
+    // whether an emission changed.
+    static bool applyEdits(scene& world, renderJob& job)
+    {
+        bool lightsChanged = false;
+        for(const materialEdit& edit : job.edits)
+        {
+            material& m = world.ownMaterial(edit.model);
+            if(edit.emission)
+            {
+                lightsChanged = lightsChanged || !(m.emission == edit.value);
+                m.emission = edit.value;
+            }
+            else
+                m.albedo = edit.value;
+            job.changed.push_back(edit.model);
+        }
+        return lightsChanged;
+    }
+
+    // Renders the whole frame into kept and records its tiles' hits
+    static void renderKept(camera& cam, scene& world, keptRender& kept)
+    {
+        cam.prepare();
+        kept.image = framebuffer(cam.imageWidth, cam.height(), cam.framebufferFormat);
+        cam.recordHits = &kept.hits;
+        cam.renderCrop(world.topLevel, kept.image, tile{0, 0, cam.imageWidth, cam.height()});
+        cam.recordHits = nullptr;
+        kept.outputPath = cam.outputPath;
+        kept.view = viewOf(cam);
+    }
+
+    scene* load(const std::string& path)
+    {
+        auto found = scenes.find(path);
+        if(found != scenes.end())
+            return found->second.get();
+
+        std::unique_ptr<scene> world(new scene{});
+        importTimings timings;
+        if(!importScene(path, *world, options, timings))
+            return nullptr;
+        world->topLevel.lodTolerance = lodTolerance;
+        timings.report(std::cout);
+        world->reportMemory(std::cout);
+        return (scenes[path] = std::move(world)).get();
+    }
+
+#if !defined(_WIN32)
+#ifdef MSG_NOSIGNAL
+    static constexpr int noSignal = MSG_NOSIGNAL;   // A client hanging up must not kill the service
+#else
+    static constexpr int noSignal = 0;
+#endif
+
+    struct client
+    {
+        int fd;
+        std::mutex mutex;
+
+        explicit client(int fd) : fd(fd) {}
+        ~client() { close(fd); }
+
+        void send(const std::string& status)
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            std::string line = status + '\n';
+            for(size_t sent = 0; sent < line.size(); )
+            {
+                ssize_t n = ::send(fd, line.data() + sent, line.size() - sent, noSignal);
+                if(n <= 0)
+                    return;
+                sent += n;
+            }
+        }
+    };
+
+    struct queuedJob
+    {
+        std::string line;
+        std::shared_ptr<client> from;
+    };
+
+    std::deque<queuedJob> queue;
+    std::mutex queueMutex;
+    std::condition_variable queueReady;
+
+    void readClient(std::shared_ptr<client> from)
+    {
+        std::string pending;
+        char buffer[4096];
+        ssize_t n;
+        while((n = read(from->fd, buffer, sizeof(buffer))) > 0)
+        {
+            pending.append(buffer, n);
+            for(size_t end = pending.find('\n'); end != std::string::npos; end = pending.find('\n'))
+            {
+                std::string line = pending.substr(0, end);
+                pending.erase(0, end + 1);
+                if(!line.empty() && line.back() == '\r')
+                    line.pop_back();
+                if(line.empty() || line[0] == '#')
+                    continue;
+
+                std::lock_guard<std::mutex> lock(queueMutex);
+                queue.push_back({line, from});
+                queueReady.notify_one();
+            }
+        }
+    }
+#endif
+};
+
+#endif
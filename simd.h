@@ -0,0 +1,129 @@
+#ifndef SIMD_H
+#define SIMD_H
+
+#include "vec3.h"
+
+#include <algorithm>
+
+// Compile time selection of the vector backend. SSE is picked up on any x86-64 target, AVX when the
+// compiler is allowed to emit it (-mavx / -march=native). Define RT_NO_SIMD to force the portable
+// scalar fallback, which is also what non x86 targets get.
+#if !defined(RT_NO_SIMD) && (defined(__SSE2__) || defined(_M_X64))
+#define RT_SIMD_SSE 1
+#include <immintrin.h>
+#endif
+
+#if defined(RT_SIMD_SSE) && defined(__AVX__)
+#define RT_SIMD_AVX 1
+#endif
+
+// 4-wide float vector. Used for single xyz(w) values such as box corners and ray origins.
+struct alignas(16) float4
+{
+#ifdef RT_SIMD_SSE
+    __m128 v;
+
+    float4() : v{_mm_setzero_ps()} {}
+    float4(__m128 m) : v{m} {}
+    float4(float s) : v{_mm_set1_ps(s)} {}
+    float4(float x, float y, float z, float w) : v{_mm_setr_ps(x, y, z, w)} {}
+
+    float operator[](int i) const { alignas(16) float e[4]; _mm_store_ps(e, v); return e[i]; }
+#else
+    float e[4];
+
+    float4() : e{0, 0, 0, 0} {}
+    float4(float s) : e{s, s, s, s} {}
+    float4(float x, float y, float z, float w) : e{x, y, z, w} {}
+
+    float operator[](int i) const { return e[i]; }
+#endif
+
+    static float4 load3(const vec3& p, float w = 0.0f) { return float4{p.x(), p.y(), p.z(), w}; }
+};
+
+#ifdef RT_SIMD_SSE
+inline float4 operator+(const float4& a, const float4& b) { return _mm_add_ps(a.v, b.v); }
+inline float4 operator-(const float4& a, const float4& b) { return _mm_sub_ps(a.v, b.v); }
+inline float4 operator*(const float4& a, const float4& b) { return _mm_mul_ps(a.v, b.v); }
+inline float4 operator/(const float4& a, const float4& b) { return _mm_div_ps(a.v, b.v); }
+inline float4 min(const float4& a, const float4& b) { return _mm_min_ps(a.v, b.v); }
+inline float4 max(const float4& a, const float4& b) { return _mm_max_ps(a.v, b.v); }
+
+// Horizontal min / max over the xyz lanes
+inline float hmin3(const float4& a)
+{
+    __m128 m = _mm_min_ps(a.v, _mm_shuffle_ps(a.v, a.v, _MM_SHUFFLE(1, 1, 1, 1)));
+    return _mm_cvtss_f32(_mm_min_ps(m, _mm_shuffle_ps(a.v, a.v, _MM_SHUFFLE(2, 2, 2, 2))));
+}
+
+inline float hmax3(const float4& a)
+{
+    __m128 m = _mm_max_ps(a.v, _mm_shuffle_ps(a.v, a.v, _MM_SHUFFLE(1, 1, 1, 1)));
+    return _mm_cvtss_f32(_mm_max_ps(m, _mm_shuffle_ps(a.v, a.v, _MM_SHUFFLE(2, 2, 2, 2))));
+}
+#else
+inline float4 operator+(const float4& a, const float4& b) { return {a.e[0] + b.e[0], a.e[1] + b.e[1], a.e[2] + b.e[2], a.e[3] + b.e[3]}; }
+inline float4 operator-(const float4& a, const float4& b) { return {a.e[0] - b.e[0], a.e[1] - b.e[1], a.e[2] - b.e[2], a.e[3] - b.e[3]}; }
+inline float4 operator*(const float4& a, const float4& b) { return {a.e[0] * b.e[0], a.e[1] * b.e[1], a.e[2] * b.e[2], a.e[3] * b.e[3]}; }
+inline float4 operator/(const float4& a, const float4& b) { return {a.e[0] / b.e[0], a.e[1] / b.e[1], a.e[2] / b.e[2], a.e[3] / b.e[3]}; }
+
+inline float4 min(const float4& a, const float4& b)
+{
+    return {std::min(a.e[0], b.e[0]), std::min(a.e[1], b.e[1]), std::min(a.e[2], b.e[2]), std::min(a.e[3], b.e[3])};
+}
+
+inline float4 max(const float4& a, const float4& b)
+{
+    return {std::max(a.e[0], b.e[0]), std::max(a.e[1], b.e[1]), std::max(a.e[2], b.e[2]), std::max(a.e[3], b.e[3])};
+}
+
+inline float hmin3(const float4& a) { return std::min(std::min(a.e[0], a.e[1]), a.e[2]); }
+inline float hmax3(const float4& a) { return std::max(std::max(a.e[0], a.e[1]), a.e[2]); }
+#endif
+
+// 8-wide float vector of two float4 halves, e.g. the boxes of both children of a BVH node
+struct alignas(32) float8
+{
+#if defined(RT_SIMD_AVX)
+    __m256 v;
+
+    float8() : v{_mm256_setzero_ps()} {}
+    float8(__m256 m) : v{m} {}
+    float8(float s) : v{_mm256_set1_ps(s)} {}
+    float8(const float4& lo, const float4& hi) : v{_mm256_insertf128_ps(_mm256_castps128_ps256(lo.v), hi.v, 1)} {}
+
+    float4 lo() const { return _mm256_castps256_ps128(v); }
+    float4 hi() const { return _mm256_extractf128_ps(v, 1); }
+    float operator[](int i) const { alignas(32) float e[8]; _mm256_store_ps(e, v); return e[i]; }
+#else
+    float4 l;
+    float4 h;
+
+    float8() {}
+    float8(float s) : l{s}, h{s} {}
+    float8(const float4& lo, const float4& hi) : l{lo}, h{hi} {}
+
+    float4 lo() const { return l; }
+    float4 hi() const { return h; }
+    float operator[](int i) const { return i < 4 ? l[i] : h[i - 4]; }
+#endif
+};
+
+#if defined(RT_SIMD_AVX)
+inline float8 operator+(const float8& a, const float8& b) { return _mm256_add_ps(a.v, b.v); }
+inline float8 operator-(const float8& a, const float8& b) { return _mm256_sub_ps(a.v, b.v); }
+inline float8 operator*(const float8& a, const float8& b) { return _mm256_mul_ps(a.v, b.v); }
+inline float8 operator/(const float8& a, const float8& b) { return _mm256_div_ps(a.v, b.v); }
+inline float8 min(const float8& a, const float8& b) { return _mm256_min_ps(a.v, b.v); }
+inline float8 max(const float8& a, const float8& b) { return _mm256_max_ps(a.v, b.v); }
+#else
+inline float8 operator+(const float8& a, const float8& b) { return {a.lo() + b.lo(), a.hi() + b.hi()}; }
+inline float8 operator-(const float8& a, const float8& b) { return {a.lo() - b.lo(), a.hi() - b.hi()}; }
+inline float8 operator*(const float8& a, const float8& b) { return {a.lo() * b.lo(), a.hi() * b.hi()}; }
+inline float8 operator/(const float8& a, const float8& b) { return {a.lo() / b.lo(), a.hi() / b.hi()}; }
+inline float8 min(const float8& a, const float8& b) { return {min(a.lo(), b.lo()), min(a.hi(), b.hi())}; }
+inline float8 max(const float8& a, const float8& b) { return {max(a.lo(), b.lo()), max(a.hi(), b.hi())}; }
+#endif
+
+#endif
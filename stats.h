@@ -0,0 +1,161 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <cstdint>
+#include <cstdlib>
+#include <mutex>
+#include <new>
+#include <ostream>
+
+// Per thread traversal counters. Rays are always counted; node visits and cache line changes are a
+// proxy for L1/L2 misses and are only collected when built with RT_TRAVERSAL_STATS since they sit
+// in the innermost traversal loop. That build also counts heap allocations, which the render loop
+// should not make at all.
+struct traversalStats
+{
+    unsigned long long rays = 0;
+    unsigned long long blasVisits = 0;      // TLAS leaves entered, i.e. BLAS acquisitions when paging
+    unsigned long long textureLookups = 0;
+    unsigned long long alphaTests = 0;      // Mask lookups of hits on mixed opacity triangles
+    unsigned long long shadowRays = 0;      // Occlusion queries of next event estimation, also counted in rays
+    unsigned long long culledTiles = 0;     // Tiles whose primary rays started from a frustum culled TLAS entry
+    unsigned long long tileLeaves = 0;      // BLAS candidates summed over the tiles that got a list
+    unsigned long long subtreeTiles = 0;    // Tiles with too many candidates, entered at a subtree instead
+    unsigned long long rasterSamples = 0;   // Primary samples whose visibility came from the rasterizer
+    unsigned long long rasterFallbacks = 0; // Of those, the ones traced because the rasterized triangle missed or none covered them
+    unsigned long long rasterMicros = 0;    // Time spent rasterizing tiles, summed over the workers
+    unsigned long long lodEntries = 0;      // BLAS entries that traversed a simplified level instead of the full mesh
+    unsigned long long historyPixels = 0;   // Pixels of a sequence frame looked up in the previous frame
+    unsigned long long historyReused = 0;   // Of those, the ones that found their first hit there
+    unsigned long long historySamples = 0;  // Samples the reused history stood in for
+    unsigned long long nodeVisits = 0;
+    unsigned long long lineChanges = 0;     // Node fetches landing on a different 64 byte line than the last one
+    unsigned long long allocations = 0;
+    uintptr_t lastLine = 0;
+
+    void visit(const void* node)
+    {
+#ifdef RT_TRAVERSAL_STATS
+        nodeVisits++;
+        uintptr_t line = reinterpret_cast<uintptr_t>(node) >> 6;
+        if(line != lastLine)
+        {
+            lineChanges++;
+            lastLine = line;
+        }
+#else
+        (void)node;
+#endif
+    }
+
+    void merge(const traversalStats& other)
+    {
+        rays += other.rays;
+        blasVisits += other.blasVisits;
+        textureLookups += other.textureLookups;
+        alphaTests += other.alphaTests;
+        shadowRays += other.shadowRays;
+        culledTiles += other.culledTiles;
+        tileLeaves += other.tileLeaves;
+        subtreeTiles += other.subtreeTiles;
+        rasterSamples += other.rasterSamples;
+        rasterFallbacks += other.rasterFallbacks;
+        rasterMicros += other.rasterMicros;
+        lodEntries += other.lodEntries;
+        historyPixels += other.historyPixels;
+        historyReused += other.historyReused;
+        historySamples += other.historySamples;
+        nodeVisits += other.nodeVisits;
+        lineChanges += other.lineChanges;
+        allocations += other.allocations;
+    }
+
+    void report(std::ostream& out, double ms) const
+    {
+        out << "RAYS: " << rays << ", " << (ms > 0.0 ? rays / (ms * 1000.0) : 0.0) << " Mrays/s, "
+            << (rays > 0 ? (double)blasVisits / rays : 0.0) << " BLAS entries/ray\n";
+        if(alphaTests > 0)
+            out << "  alpha tests: " << alphaTests << " (" << (double)alphaTests / rays << " per ray)\n";
+        if(culledTiles > 0)
+        {
+            unsigned long long listed = culledTiles - subtreeTiles;
+            out << "  tile culling: " << culledTiles << " tiles, " << (listed > 0 ? (double)tileLeaves / listed : 0.0)
+                << " BLAS candidates per listed tile, " << subtreeTiles << " entered at a subtree\n";
+        }
+        if(rasterSamples > 0)
+            out << "  raster primaries: " << rasterSamples << " samples, " << rasterFallbacks << " traced after a raster miss, "
+                << rasterMicros / 1000.0 << " ms cpu rasterizing\n";
+        if(lodEntries > 0)
+            out << "  level of detail: " << lodEntries << " of " << blasVisits << " BLAS entries on a simplified mesh\n";
+        if(historyPixels > 0)
+            out << "  temporal history: " << historyReused << " of " << historyPixels << " pixels reprojected, "
+                << (historyReused > 0 ? (double)historySamples / historyReused : 0.0) << " samples reused per pixel\n";
+        if(shadowRays > 0)
+            out << "  shadow rays: " << shadowRays << " (" << (double)shadowRays / rays << " of all rays)\n";
+#ifdef RT_TRAVERSAL_STATS
+        if(rays > 0)
+            out << "  nodes/ray: " << (double)nodeVisits / rays << ", cache lines/ray: " << (double)lineChanges / rays
+                << ", allocations/ray: " << (double)allocations / rays << '\n';
+#endif
+    }
+};
+
+inline traversalStats& threadStats()
+{
+    static thread_local traversalStats stats;
+    return stats;
+}
+
+// Bit set of BLAS indices the calling thread's rays entered, recorded while a tile's hits are kept
+// for incremental re-renders and null otherwise
+inline uint64_t*& threadTouchedBlas()
+{
+    static thread_local uint64_t* touched = nullptr;
+    return touched;
+}
+
+inline void touchBlas(int blas)
+{
+    if(uint64_t* touched = threadTouchedBlas())
+        touched[blas >> 6] |= 1ull << (blas & 63);
+}
+
+#ifdef RT_TRAVERSAL_STATS
+// Replaces the global allocation functions, which this single translation unit build allows
+void* operator new(size_t bytes)
+{
+    threadStats().allocations++;
+    if(void* p = std::malloc(bytes ? bytes : 1))
+        return p;
+    throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept
+{
+    std::free(p);
+}
+
+void operator delete(void* p, size_t) noexcept
+{
+    std::free(p);
+}
+#endif
+
+// Collects the counters of every worker once they are done
+class statsAccumulator
+{
+public:
+    void add(const traversalStats& s)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        total.merge(s);
+    }
+
+    const traversalStats& result() const { return total; }
+
+private:
+    traversalStats total;
+    std::mutex mutex;
+};
+
+#endif
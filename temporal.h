@@ -0,0 +1,160 @@
+#ifndef TEMPORAL_H
+#define TEMPORAL_H
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#include "color.h"
+#include "stats.h"
+
+// What the ray through a pixel's center hit first
+struct surfaceSample
+{
+    point3 position{};
+    vec3 normal{};
+    int model = -1;     // -1 when the ray left the scene
+    int material = -1;
+};
+
+// Radiance of the previous frame of a sequence with the first hits it was gathered at. A frame
+// finds each of its pixels' first hit in the previous frame and takes the radiance kept there as
+// extra samples, which holds as long as shading does not depend on the view, as it doesn't for
+// diffuse surfaces. Taps whose first hit lies on another model or material, off the surface's
+// plane or facing elsewhere were occluded or out of view before and are rejected.
+class temporalHistory
+{
+public:
+    float maxFrames = 8.0f;         // History weighs at most this many frames' worth of samples
+    float planeTolerance = 0.02f;   // Distance off the surface's plane a tap may be, per unit of depth
+    float normalTolerance = 0.9f;   // Smallest cosine between the tap's normal and the surface's
+
+    // Starts a frame of width x height. History kept for another size is dropped.
+    void begin(int width, int height)
+    {
+        if(width != frameWidth || height != frameHeight)
+        {
+            frameWidth = width;
+            frameHeight = height;
+            previous.clear();
+        }
+        current.assign((size_t)width * height, texel{});
+    }
+
+    // Ends the frame, whose view rays left eye through pixel00 + x * deltaU + y * deltaV, and keeps it as history
+    void end(const point3& eye, const point3& pixel00, const vec3& deltaU, const vec3& deltaV)
+    {
+        previous.swap(current);
+        previousEye = eye;
+        previousPixel00 = pixel00;
+        previousDeltaU = deltaU;
+        previousDeltaV = deltaV;
+    }
+
+    // Average of fresh, the mean of samples new samples of pixel x, y, and the history found at
+    // first. Called once per pixel by the worker rendering it.
+    color blend(int x, int y, const color& fresh, int samples, const surfaceSample& first)
+    {
+        texel& out = current[(size_t)y * frameWidth + x];
+        out.radiance = fresh;
+        out.samples = (float)samples;
+        out.position = first.position;
+        out.normal = first.normal;
+        out.model = first.model;
+        out.material = first.material;
+
+        traversalStats& stats = threadStats();
+        stats.historyPixels++;
+
+        color kept;
+        float keptSamples;
+        if(first.model < 0 || !reproject(first, kept, keptSamples))
+            return fresh;
+
+        keptSamples = std::min(keptSamples, maxFrames * samples);
+        out.samples = keptSamples + samples;
+        out.radiance = (kept * keptSamples + fresh * (float)samples) / out.samples;
+        stats.historyReused++;
+        stats.historySamples += (unsigned long long)keptSamples;
+        return out.radiance;
+    }
+
+private:
+    struct texel
+    {
+        color radiance{};
+        float samples = 0.0f;
+        point3 position{};
+        vec3 normal{};
+        int model = -1;
+        int material = -1;
+    };
+
+    std::vector<texel> previous;
+    std::vector<texel> current;
+    int frameWidth = 0;
+    int frameHeight = 0;
+    point3 previousEye{};
+    point3 previousPixel00{};
+    vec3 previousDeltaU{};
+    vec3 previousDeltaV{};
+
+    // Nearest of the four previous pixels around first's projection that saw the same surface.
+    // Blending them instead would blur the frame a little more at every step, which spreads bright
+    // emitters over their surroundings within a few frames.
+    bool reproject(const surfaceSample& first, color& kept, float& keptSamples) const
+    {
+        if(previous.empty())
+            return false;
+
+        // Where the line from the previous eye to the hit crosses the previous image plane
+        vec3 toHit = first.position - previousEye;
+        vec3 planeNormal = cross(previousDeltaU, previousDeltaV);
+        float along = dot(toHit, planeNormal);
+        float plane = dot(previousPixel00 - previousEye, planeNormal);
+        if(along * plane <= 0.0f)
+            return false;
+        vec3 onPlane = previousEye + toHit * (plane / along) - previousPixel00;
+        float px = dot(onPlane, previousDeltaU) / previousDeltaU.squaredLength();
+        float py = dot(onPlane, previousDeltaV) / previousDeltaV.squaredLength();
+        if(px <= -1.0f || py <= -1.0f || px >= frameWidth || py >= frameHeight)
+            return false;
+
+        int x0 = (int)std::floor(px);
+        int y0 = (int)std::floor(py);
+        float fx = px - x0;
+        float fy = py - y0;
+        float tolerance = planeTolerance * toHit.length();
+
+        const texel* nearest = nullptr;
+        float weight = 0.0f;
+        for(int tap = 0; tap < 4; tap++)
+        {
+            int x = x0 + (tap & 1);
+            int y = y0 + (tap >> 1);
+            if(x < 0 || y < 0 || x >= frameWidth || y >= frameHeight)
+                continue;
+
+            const texel& h = previous[(size_t)y * frameWidth + x];
+            if(h.model != first.model || h.material != first.material || h.samples <= 0.0f
+               || dot(h.normal, first.normal) < normalTolerance || std::fabs(dot(h.position - first.position, first.normal)) > tolerance)
+                continue;
+
+            float w = ((tap & 1) ? fx : 1.0f - fx) * ((tap >> 1) ? fy : 1.0f - fy);
+            if(w > weight)
+            {
+                nearest = &h;
+                weight = w;
+            }
+        }
+
+        // A far corner alone would stretch one old pixel over a newly uncovered area
+        if(weight < 0.1f)
+            return false;
+        kept = nearest->radiance;
+        keptSamples = nearest->samples;
+        return true;
+    }
+};
+
+#endif
@@ -0,0 +1,508 @@
+#ifndef TEXTURE_H
+#define TEXTURE_H
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "color.h"
+#include "image.h"
+#include "stats.h"
+
+inline float srgbToLinear(float c)
+{
+    return c <= 0.04045f ? c / 12.92f : std::pow((c + 0.055f) / 1.055f, 2.4f);
+}
+
+inline float linearToSrgb(float c)
+{
+    return c <= 0.0031308f ? c * 12.92f : 1.055f * std::pow(c, 1.0f / 2.4f) - 0.055f;
+}
+
+inline const float* srgbTable()
+{
+    static const std::vector<float> table = []()
+    {
+        std::vector<float> t(256);
+        for(int i = 0; i < 256; i++)
+            t[i] = srgbToLinear(i / 255.0f);
+        return t;
+    }();
+    return table.data();
+}
+
+// One mip level stored in 8x8 texel tiles of sRGB RGBA8, 256 bytes each, so a bilinear footprint
+// almost always touches a single tile and neighbouring rows share cache lines
+struct mipLevel
+{
+    static constexpr int tileEdge = 8;
+
+    int width = 0;
+    int height = 0;
+    int tilesX = 0;
+    std::vector<uint8_t> texels;
+
+    size_t bytes() const { return texels.size(); }
+
+    const uint8_t* texel(int x, int y) const
+    {
+        int tile = (y / tileEdge) * tilesX + x / tileEdge;
+        return &texels[((size_t)tile * tileEdge * tileEdge + (y % tileEdge) * tileEdge + x % tileEdge) * 4];
+    }
+
+    // Linear RGB with repeat wrapping
+    color fetch(int x, int y) const
+    {
+        x %= width;
+        y %= height;
+        if(x < 0) x += width;
+        if(y < 0) y += height;
+        const uint8_t* t = texel(x, y);
+        const float* lut = srgbTable();
+        return color{lut[t[0]], lut[t[1]], lut[t[2]]};
+    }
+
+    color bilinear(float u, float v) const
+    {
+        float x = u * width - 0.5f;
+        float y = v * height - 0.5f;
+        float fx = std::floor(x);
+        float fy = std::floor(y);
+        int x0 = (int)fx, y0 = (int)fy;
+        float ax = x - fx, ay = y - fy;
+        color top = (1.0f - ax) * fetch(x0, y0) + ax * fetch(x0 + 1, y0);
+        color bottom = (1.0f - ax) * fetch(x0, y0 + 1) + ax * fetch(x0 + 1, y0 + 1);
+        return (1.0f - ay) * top + ay * bottom;
+    }
+
+    static mipLevel fromImage(int width, int height, const uint8_t* rgba)
+    {
+        mipLevel level;
+        level.width = width;
+        level.height = height;
+        level.tilesX = (width + tileEdge - 1) / tileEdge;
+        int tilesY = (height + tileEdge - 1) / tileEdge;
+        level.texels.assign((size_t)level.tilesX * tilesY * tileEdge * tileEdge * 4, 0);
+        for(int y = 0; y < height; y++)
+            for(int x = 0; x < width; x++)
+                std::memcpy(const_cast<uint8_t*>(level.texel(x, y)), &rgba[((size_t)y * width + x) * 4], 4);
+        return level;
+    }
+};
+
+// Opacity masks are either real alpha or, like Sponza's *_mask.png files, grayscale images without
+// alpha whose gray value is the opacity
+inline int opacityChannel(const image& img)
+{
+    for(size_t i = 3; i < img.rgba.size(); i += 4)
+        if(img.rgba[i] != 255)
+            return 3;
+    return 0;
+}
+
+// Minimum and maximum opacity of power of two texel blocks of a mask, so the opacity range under any
+// texture space box is found from a handful of blocks. Only used to classify triangles at import.
+class opacityPyramid
+{
+public:
+    int width() const { return levels.empty() ? 0 : levels[0].width; }
+    int height() const { return levels.empty() ? 0 : levels[0].height; }
+
+    bool load(const std::string& path)
+    {
+        image img;
+        if(!loadImage(path, img))
+            return false;
+
+        int channel = opacityChannel(img);
+        levels.push_back({img.width, img.height, std::vector<uint8_t>((size_t)img.width * img.height), {}});
+        for(size_t i = 0; i < levels[0].lo.size(); i++)
+            levels[0].lo[i] = img.rgba[i * 4 + channel];
+        levels[0].hi = levels[0].lo;
+
+        while(levels.back().width > 1 || levels.back().height > 1)
+        {
+            const level& fine = levels.back();
+            level coarse{(fine.width + 1) / 2, (fine.height + 1) / 2, {}, {}};
+            coarse.lo.assign((size_t)coarse.width * coarse.height, 255);
+            coarse.hi.assign((size_t)coarse.width * coarse.height, 0);
+            for(int y = 0; y < fine.height; y++)
+            {
+                for(int x = 0; x < fine.width; x++)
+                {
+                    size_t from = (size_t)y * fine.width + x;
+                    size_t to = (size_t)(y / 2) * coarse.width + x / 2;
+                    coarse.lo[to] = std::min(coarse.lo[to], fine.lo[from]);
+                    coarse.hi[to] = std::max(coarse.hi[to], fine.hi[from]);
+                }
+            }
+            levels.push_back(std::move(coarse));
+        }
+        return true;
+    }
+
+    // Opacity range over the level 0 texels [x0, x1] x [y0, y1], which may lie outside the texture
+    // and are wrapped like lookups are
+    void range(int x0, int y0, int x1, int y1, uint8_t& lo, uint8_t& hi) const
+    {
+        lo = 255;
+        hi = 0;
+        int w = width(), h = height();
+        if(x1 - x0 + 1 >= w)
+        {
+            x0 = 0;
+            x1 = w - 1;
+        }
+        if(y1 - y0 + 1 >= h)
+        {
+            y0 = 0;
+            y1 = h - 1;
+        }
+
+        // Wrap the box start into the texture, a box crossing the edge becomes two
+        int wx = ((x0 % w) + w) % w, wy = ((y0 % h) + h) % h;
+        x1 += wx - x0;
+        y1 += wy - y0;
+        int xs[2][2] = {{wx, std::min(x1, w - 1)}, {0, x1 - w}};
+        int ys[2][2] = {{wy, std::min(y1, h - 1)}, {0, y1 - h}};
+        for(int i = 0; i < 2; i++)
+            for(int j = 0; j < 2; j++)
+                if(xs[i][1] >= xs[i][0] && ys[j][1] >= ys[j][0])
+                    rangeInside(xs[i][0], ys[j][0], xs[i][1], ys[j][1], lo, hi);
+    }
+
+private:
+    struct level
+    {
+        int width;
+        int height;
+        std::vector<uint8_t> lo;
+        std::vector<uint8_t> hi;
+    };
+
+    std::vector<level> levels;
+
+    // Reads the finest level where the box touches at most 64 blocks, coarser blocks also cover
+    // texels outside the box and make more triangles look mixed
+    void rangeInside(int x0, int y0, int x1, int y1, uint8_t& lo, uint8_t& hi) const
+    {
+        int k = 0;
+        while(k + 1 < (int)levels.size() && ((x1 >> k) - (x0 >> k) + 1) * ((y1 >> k) - (y0 >> k) + 1) > 64)
+            k++;
+
+        const level& l = levels[k];
+        for(int y = y0 >> k; y <= (y1 >> k); y++)
+        {
+            for(int x = x0 >> k; x <= (x1 >> k); x++)
+            {
+                lo = std::min(lo, l.lo[(size_t)y * l.width + x]);
+                hi = std::max(hi, l.hi[(size_t)y * l.width + x]);
+            }
+        }
+    }
+};
+
+// Decoded on first use, mip-mapped and kept under a byte budget. Residency is tracked per mip level
+// so the large top levels primary rays need can be evicted while the small ones secondary rays hit
+// stay resident. Lookups pin the level they read, like blasPager does for BLAS pages.
+class textureCache
+{
+public:
+    static constexpr int maxLevels = 16;
+
+    size_t budget = 512u << 20;
+
+    textureCache(){}
+    textureCache(const textureCache&) = delete;
+    textureCache& operator=(const textureCache&) = delete;
+
+    // Registers a texture file without reading it, the same path always gets the same id
+    int add(const std::string& path)
+    {
+        for(int i = 0; i < (int)textures.size(); i++)
+            if(textures[i]->path == path)
+                return i;
+        textures.emplace_back(new entry{});
+        textures.back()->path = path;
+        return (int)textures.size() - 1;
+    }
+
+    int count() const { return (int)textures.size(); }
+    const std::string& path(int tex) const { return textures[tex]->path; }
+
+    // Trilinear lookup for a footprint uvWidth wide in texture coordinates. Returns fallback if the
+    // file can't be decoded.
+    color sample(int tex, float u, float v, float uvWidth, const color& fallback)
+    {
+        entry& e = *textures[tex];
+        if(e.state.load(std::memory_order_acquire) == 0 && !fault(tex, 0, uvWidth))
+            return fallback;
+        if(e.state.load(std::memory_order_acquire) < 0)
+            return fallback;
+
+        threadStats().textureLookups++;
+        float lod = levelOf(e, uvWidth);
+        int l0 = (int)lod;
+        int l1 = std::min(l0 + 1, e.levelCount - 1);
+        float blend = lod - l0;
+
+        const mipLevel* m0 = acquire(tex, l0);
+        if(!m0)
+            return fallback;
+        color c0 = m0->bilinear(u, v);
+        release(tex, l0);
+        if(blend <= 0.0f || l1 == l0)
+            return c0;
+
+        const mipLevel* m1 = acquire(tex, l1);
+        if(!m1)
+            return c0;
+        color c1 = m1->bilinear(u, v);
+        release(tex, l1);
+        return (1.0f - blend) * c0 + blend * c1;
+    }
+
+    // Nearest level 0 texel opacity, for alpha testing. Unreadable masks count as opaque.
+    uint8_t opacity(int tex, float u, float v)
+    {
+        entry& e = *textures[tex];
+        if(e.state.load(std::memory_order_acquire) == 0 && !fault(tex, 0))
+            return 255;
+
+        const mipLevel* m = acquire(tex, 0);
+        if(!m)
+            return 255;
+        int x = (int)std::floor(u * m->width) % m->width;
+        int y = (int)std::floor(v * m->height) % m->height;
+        uint8_t alpha = m->texel(x < 0 ? x + m->width : x, y < 0 ? y + m->height : y)[e.opacityChannel];
+        release(tex, 0);
+        return alpha;
+    }
+
+    void report(std::ostream& out, unsigned long long lookups) const
+    {
+        const double mb = 1.0 / (1024.0 * 1024.0);
+        int decoded = 0;
+        for(const auto& e : textures)
+            decoded += e->state > 0 ? 1 : 0;
+        double hitRate = lookups > 0 ? 1.0 - (double)decodes / lookups : 1.0;
+        out << "TEXTURES: " << decoded << " of " << textures.size() << " decoded, resident "
+            << residentBytes * mb << " MB, peak " << peakResident * mb << " MB of " << budget * mb << " MB budget\n";
+        out << "  " << lookups << " lookups, " << decodes << " misses (hit rate " << hitRate * 100.0 << "%), " << evictions << " evictions\n";
+    }
+
+private:
+    struct slot
+    {
+        std::atomic<bool> resident {false};
+        std::atomic<int> pins {0};
+        std::atomic<unsigned long long> lastUse {0};
+        std::unique_ptr<mipLevel> level;
+    };
+
+    struct entry
+    {
+        std::string path;
+        std::atomic<int> state {0};     // 0 never decoded, 1 size known, -1 unreadable
+        int width = 0;
+        int height = 0;
+        int levelCount = 0;
+        int opacityChannel = 3;
+        slot levels[maxLevels];
+        std::mutex decodeMutex;
+    };
+
+    std::vector<std::unique_ptr<entry>> textures;
+    std::mutex mutex;
+    std::atomic<unsigned long long> clock {0};
+    size_t residentBytes = 0;
+    size_t peakResident = 0;
+    unsigned long long evictions = 0;
+    unsigned long long decodes = 0;     // Every decode is a miss, the first one of each texture included
+
+    // Pinned level, or nullptr when the file stopped being readable
+    const mipLevel* acquire(int tex, int l)
+    {
+        slot& s = textures[tex]->levels[l];
+        while(true)
+        {
+            s.pins++;
+            if(s.resident)
+                break;
+
+            // Another install may evict the level again before we pin it, so check once more
+            s.pins--;
+            if(!fault(tex, l))
+                return nullptr;
+        }
+
+        unsigned long long now = clock.load(std::memory_order_relaxed);
+        if(s.lastUse.load(std::memory_order_relaxed) != now)
+            s.lastUse.store(now, std::memory_order_relaxed);
+        return s.level.get();
+    }
+
+    void release(int tex, int l)
+    {
+        textures[tex]->levels[l].pins--;
+    }
+
+    // Mip level, with the fraction towards the next one, a footprint uvWidth wide reads
+    static float levelOf(const entry& e, float uvWidth)
+    {
+        float lod = std::log2(std::max(uvWidth * std::max(e.width, e.height), 1e-6f));
+        return std::min(std::max(lod, 0.0f), (float)(e.levelCount - 1));
+    }
+
+    // Decodes the file and rebuilds the mip chain, installing level l and every smaller level that isn't
+    // resident since the decode already paid for them. Larger levels are left out so a wide ray cone
+    // doesn't pull in the top level it will never read. The first decode doesn't know the levels yet:
+    // a uvWidth of 0 or more then picks l from the footprint once the size is known.
+    bool fault(int tex, int l, float uvWidth = -1.0f)
+    {
+        entry& e = *textures[tex];
+        std::lock_guard<std::mutex> decodeLock(e.decodeMutex);
+        if(e.state < 0)
+            return false;
+        if(e.state > 0 && uvWidth >= 0.0f)
+            l = (int)levelOf(e, uvWidth);
+        if(e.state > 0 && e.levels[l].resident)
+            return true;
+
+        image img;
+        if(!loadImage(e.path, img))
+        {
+            std::cout << "ERROR::TEXTURE::could not decode " << e.path << '\n';
+            e.state = -1;
+            return false;
+        }
+
+        std::vector<std::unique_ptr<mipLevel>> chain;
+        buildChain(img, chain);
+
+        std::lock_guard<std::mutex> lock(mutex);
+        decodes++;
+        if(e.state == 0)
+        {
+            e.width = img.width;
+            e.height = img.height;
+            e.levelCount = (int)chain.size();
+            e.opacityChannel = ::opacityChannel(img);
+        }
+        if(uvWidth >= 0.0f)
+            l = (int)levelOf(e, uvWidth);
+
+        size_t needed = 0;
+        for(int i = l; i < e.levelCount; i++)
+            if(!e.levels[i].resident)
+                needed += chain[i]->bytes();
+        evictFor(needed, tex);
+
+        for(int i = l; i < e.levelCount; i++)
+        {
+            slot& s = e.levels[i];
+            if(s.resident)
+                continue;
+            residentBytes += chain[i]->bytes();
+            s.level = std::move(chain[i]);
+            s.lastUse = ++clock;
+            s.resident = true;
+        }
+        peakResident = std::max(peakResident, residentBytes);
+        e.state.store(1, std::memory_order_release);
+        return true;
+    }
+
+    static void buildChain(const image& img, std::vector<std::unique_ptr<mipLevel>>& chain)
+    {
+        int w = img.width, h = img.height;
+        std::vector<uint8_t> rgba = img.rgba;
+        while(true)
+        {
+            chain.emplace_back(new mipLevel{mipLevel::fromImage(w, h, rgba.data())});
+            if((w == 1 && h == 1) || (int)chain.size() == maxLevels)
+                break;
+
+            // 2x2 box filter in linear space, odd edges reuse the last row or column
+            int nw = std::max(1, w / 2), nh = std::max(1, h / 2);
+            std::vector<uint8_t> next((size_t)nw * nh * 4);
+            const float* lut = srgbTable();
+            for(int y = 0; y < nh; y++)
+            {
+                for(int x = 0; x < nw; x++)
+                {
+                    int x0 = std::min(2 * x, w - 1), x1 = std::min(2 * x + 1, w - 1);
+                    int y0 = std::min(2 * y, h - 1), y1 = std::min(2 * y + 1, h - 1);
+                    const uint8_t* p[4] = {&rgba[((size_t)y0 * w + x0) * 4], &rgba[((size_t)y0 * w + x1) * 4],
+                                           &rgba[((size_t)y1 * w + x0) * 4], &rgba[((size_t)y1 * w + x1) * 4]};
+                    uint8_t* out = &next[((size_t)y * nw + x) * 4];
+                    for(int c = 0; c < 3; c++)
+                    {
+                        float sum = lut[p[0][c]] + lut[p[1][c]] + lut[p[2][c]] + lut[p[3][c]];
+                        out[c] = (uint8_t)(linearToSrgb(0.25f * sum) * 255.0f + 0.5f);
+                    }
+                    out[3] = (uint8_t)((p[0][3] + p[1][3] + p[2][3] + p[3][3] + 2) / 4);
+                }
+            }
+            rgba.swap(next);
+            w = nw;
+            h = nh;
+        }
+    }
+
+    // Same race protocol as blasPager::evictFor. Levels of the texture being installed are skipped so
+    // a decode never evicts its own result.
+    void evictFor(size_t bytes, int installing)
+    {
+        while(residentBytes + bytes > budget)
+        {
+            slot* victim = nullptr;
+            unsigned long long oldest = ~0ull;
+            for(int t = 0; t < (int)textures.size(); t++)
+            {
+                if(t == installing)
+                    continue;
+                for(slot& s : textures[t]->levels)
+                {
+                    if(s.resident && s.pins == 0 && s.lastUse < oldest)
+                    {
+                        oldest = s.lastUse;
+                        victim = &s;
+                    }
+                }
+            }
+            if(!victim)
+                return;
+
+            victim->resident = false;
+            if(victim->pins > 0)
+            {
+                victim->resident = true;
+                continue;
+            }
+
+            residentBytes -= victim->level->bytes();
+            victim->level.reset();
+            evictions++;
+        }
+    }
+};
+
+// Any-hit filter of an alpha-tested model: hits on texels less than half opaque are ignored
+struct alphaTest
+{
+    textureCache* textures = nullptr;
+    int texture = -1;
+
+    bool active() const { return textures != nullptr; }
+    bool passes(float u, float v) const { return textures->opacity(texture, u, v) >= 128; }
+};
+
+#endif
@@ -0,0 +1,130 @@
+#ifndef TILEHITS_H
+#define TILEHITS_H
+
+#include <algorithm>
+#include <cstdint>
+#include <mutex>
+#include <ostream>
+#include <vector>
+
+#include "aabb.h"
+#include "scheduler.h"
+#include "tlas.h"
+
+// The BLASes the paths of every tile entered during a render, kept so a later render can redo only
+// the tiles an edited model could have changed. Tiles are the cells of the scheduler's grid, split
+// tiles add to the cell they came from. A path that never entered a BLAS's bounds cannot have seen
+// anything of it, so as long as the edit stays inside the bounds recorded here, every other tile
+// would come out the same.
+class tileHits
+{
+public:
+    // Forgets everything and sizes the grid for a width x height image cut into edge sized cells
+    void reset(int width, int height, int edge, const tlas& t)
+    {
+        imageWidth = width;
+        imageHeight = height;
+        cellEdge = edge;
+        columns = (width + edge - 1) / edge;
+        rows = (height + edge - 1) / edge;
+        blasCount = t.instanceCount();
+        wordCount = (blasCount + 63) / 64;
+        bits.assign((size_t)columns * rows * wordCount, 0);
+        recordedPixels.assign((size_t)columns * rows, 0);
+        bounds.resize(blasCount);
+        for(int i = 0; i < blasCount; i++)
+            bounds[i] = t.instance(i).bounds;
+    }
+
+    bool matches(int width, int height, const tlas& t) const
+    {
+        return width == imageWidth && height == imageHeight && t.instanceCount() == blasCount;
+    }
+
+    int edge() const { return cellEdge; }
+    int words() const { return wordCount; }
+    int cellCount() const { return columns * rows; }
+
+    // Adds the BLASes one part of a tile entered, a bit per BLAS index
+    void add(const tile& tl, const uint64_t* touched)
+    {
+        int cell = cellOf(tl);
+        std::lock_guard<std::mutex> lock(mutex);
+        uint64_t* cellBits = &bits[(size_t)cell * wordCount];
+        for(int i = 0; i < wordCount; i++)
+            cellBits[i] |= touched[i];
+        recordedPixels[cell] += tl.pixels();
+    }
+
+    void clear(int cell)
+    {
+        std::fill(&bits[(size_t)cell * wordCount], &bits[(size_t)(cell + 1) * wordCount], 0);
+        recordedPixels[cell] = 0;
+    }
+
+    bool entered(int cell, int blas) const
+    {
+        return (bits[(size_t)cell * wordCount + (blas >> 6)] >> (blas & 63)) & 1u;
+    }
+
+    // Sets cells to the cells whose paths entered any of the changed BLASes, plus the cells that
+    // were never fully rendered while recording. Returns false when that can't be known: a changed
+    // BLAS outgrew the bounds it had when the hits were recorded, so paths that never came near it
+    // could reach it now, or the scene has a different number of BLASes.
+    bool affected(const tlas& t, const std::vector<int>& changed, std::vector<uint8_t>& cells) const
+    {
+        if(t.instanceCount() != blasCount)
+            return false;
+
+        cells.assign(cellCount(), 0);
+        for(int cell = 0; cell < cellCount(); cell++)
+        {
+            if(recordedPixels[cell] < cellArea(cell))
+                cells[cell] = 1;
+        }
+
+        for(int blas : changed)
+        {
+            if(blas < 0 || blas >= blasCount)
+                return false;
+            const aabb& now = t.instance(blas).bounds;
+            const aabb& then = bounds[blas];
+            for(int a = 0; a < 3; a++)
+            {
+                if(now.min()[a] < then.min()[a] || now.max()[a] > then.max()[a])
+                    return false;
+            }
+
+            for(int cell = 0; cell < cellCount(); cell++)
+            {
+                if(entered(cell, blas))
+                    cells[cell] = 1;
+            }
+        }
+        return true;
+    }
+
+private:
+    int imageWidth = 0;
+    int imageHeight = 0;
+    int cellEdge = 0;
+    int columns = 0;
+    int rows = 0;
+    int blasCount = 0;
+    int wordCount = 0;
+    std::vector<uint64_t> bits;             // wordCount words per cell
+    std::vector<long long> recordedPixels;  // Pixels rendered into each cell since it was cleared
+    std::vector<aabb> bounds;               // BLAS bounds when the hits were recorded
+    std::mutex mutex;
+
+    int cellOf(const tile& tl) const { return (tl.y0 / cellEdge) * columns + tl.x0 / cellEdge; }
+
+    long long cellArea(int cell) const
+    {
+        int x = cell % columns, y = cell / columns;
+        return (long long)(std::min((x + 1) * cellEdge, imageWidth) - x * cellEdge) *
+               (std::min((y + 1) * cellEdge, imageHeight) - y * cellEdge);
+    }
+};
+
+#endif
@@ -2,14 +2,26 @@
 #define TLAS_H
 
 #include "model.h"
+#include "outofcore.h"
 
+#include <algorithm>
 #include <vector>
-#include <stack>
+
+// Where a bundle of rays leaving one point enters the TLAS: the few leaves whose boxes overlap the
+// bundle's frustum, nearest first, or when there are too many the smallest subtree holding them all
+struct tlasEntry
+{
+    static constexpr int maxLeaves = 16;
+
+    int root = 0;
+    int leafCount = -1;         // -1 when the rays traverse from root instead of the list
+    int leaves[maxLeaves];      // TLAS node indices
+};
 
 class tlas
 {
 private:
-    struct tlasNode
+    struct alignas(32) tlasNode
     {
         aabb bounds{};
         int leftRight = 0;
@@ -17,11 +29,15 @@ private:
 
         bool isLeaf() { return leftRight == 0; }
     };
+    static_assert(sizeof(tlasNode) == 32, "tlasNode should fill half a cache line");
 
-    std::vector<tlasNode> tlasNodes;
-    std::vector<shared_ptr<model>>* blas;
-    int nodesUsed;
-    int blasCount;
+    // Not owned, both arrays live in the scene arena
+    tlasNode* tlasNodes = nullptr;
+    model* blas = nullptr;
+    int nodesUsed = 0;
+    int blasCount = 0;
+    int depth = 1;
+    int* parents = nullptr;     // Only for stackless traversal, like bvh::parents
 
     int findBestMatch(int* nodeIdx, int N, int A)
     {
@@ -59,8 +75,8 @@ private:
         for(int i = 0; i < blasCount; i++)
         {
             nodeIdx[i] = nodesUsed;
-            tlasNodes[nodesUsed].bounds.min() = (*blas)[i]->mbvh.bvhBounds.min();
-            tlasNodes[nodesUsed].bounds.max() = (*blas)[i]->mbvh.bvhBounds.max();
+            tlasNodes[nodesUsed].bounds.min() = blas[i].mbvh.bvhBounds.min();
+            tlasNodes[nodesUsed].bounds.max() = blas[i].mbvh.bvhBounds.max();
             tlasNodes[nodesUsed].blas = i;
             tlasNodes[nodesUsed].leftRight = 0;
             nodesUsed++;
@@ -93,31 +109,118 @@ private:
         tlasNodes[0] = tlasNodes[nodeIdx[A]];
     }
 
-public:
-    tlas (){}
+    // Measures the depth from node 0 and fills the parent links when there are any. The agglomerative
+    // build is not balanced, so a TLAS over many models can be far deeper than log2 of their count.
+    void walk()
+    {
+        depth = 1;
+        if(parents)
+            parents[0] = -1;
+
+        std::vector<std::pair<int, int>> pending{{0, 1}};
+        while(!pending.empty())
+        {
+            int idx = pending.back().first;
+            int level = pending.back().second;
+            pending.pop_back();
+            depth = std::max(depth, level);
+            if(tlasNodes[idx].isLeaf())
+                continue;
 
-    tlas (std::vector<shared_ptr<model>>* b, int N) : blas(b), blasCount(N)
+            for(int child : {tlasNodes[idx].leftRight & 0xffff, tlasNodes[idx].leftRight >> 16})
+            {
+                if(parents)
+                    parents[child] = idx;
+                pending.push_back({child, level + 1});
+            }
+        }
+    }
+
+    int nearChild(int idx, const ray& r) const
     {
-        tlasNodes.resize(2 * blasCount);
-        build();
+        const tlasNode& a = tlasNodes[tlasNodes[idx].leftRight & 0xffff];
+        const tlasNode& b = tlasNodes[tlasNodes[idx].leftRight >> 16];
+        vec3 between = (a.bounds.min() + a.bounds.max()) - (b.bounds.min() + b.bounds.max());
+        return dot(between, r.direction()) <= 0.0f ? tlasNodes[idx].leftRight & 0xffff : tlasNodes[idx].leftRight >> 16;
     }
 
-    void hit(ray& r)
+    int sibling(int idx) const
     {
-        tlasNode* n = &tlasNodes[0];
-        std::stack<tlasNode*> stack;
+        int pair = tlasNodes[parents[idx]].leftRight;
+        return (pair & 0xffff) == idx ? pair >> 16 : pair & 0xffff;
+    }
+
+    // Coarsest level of detail of m whose error is below lodTolerance times r's footprint where it
+    // reaches the model, times the bounces before r. Primary rays see m whole, and so do rays that
+    // start inside its bounds: a simplified surface there could shadow the ray's own origin, or miss
+    // a contact a ray from a neighbouring surface should find. A shadow ray's emitter model is seen
+    // whole too, or its simplified surface could occlude the very point sampled on the full one.
+    int selectLod(const model& m, int idx, const ray& r) const
+    {
+        if(m.lodCount == 0 || r.bounce == 0 || r.originInst == idx || r.targetInst == idx)
+            return 0;
+
+        float entry = m.bounds.hit(r);
+        if(entry <= 0.0f || entry == infinity)
+            return 0;
+        float footprint = r.coneWidth + r.coneSpread * entry * r.direction().length();
+        float budget = lodTolerance * footprint * r.bounce;
+        int level = 0;
+        while(level < m.lodCount && m.lods[level].error <= budget)
+            level++;
+        return level;
+    }
+
+    void intersectLeaf(tlasNode* n, ray& r)
+    {
+        float prevT = r.t;
+        threadStats().blasVisits++;
+        touchBlas(n->blas);
+        const model& m = blas[n->blas];
+        if(int lod = selectLod(m, n->blas, r))
+        {
+            threadStats().lodEntries++;
+            m.lods[lod - 1].tree.hit(r);
+            if(r.t < prevT)
+            {
+                r.instIdx = n->blas;
+                r.lod = lod;
+            }
+            return;
+        }
+        const alphaTest* alpha = m.alpha.active() ? &m.alpha : nullptr;
+        if(pager)
+        {
+            pager->acquire(n->blas).tree.hit(r, alpha);
+            pager->release(n->blas);
+        }
+        else
+            m.mbvh.hit(r, alpha);
+        if(r.t < prevT)
+        {
+            r.instIdx = n->blas;
+            r.lod = 0;
+        }
+    }
+
+    // anyHit stops at the first BLAS that shortens the ray, enough for occlusion queries
+    void hitStack(ray& r, bool anyHit, int root = 0)
+    {
+        float limit = r.t;
+        tlasNode* n = &tlasNodes[root];
+        tlasNode* stack[traversalStackSize];
+        int stackPtr = 0;
+        traversalStats& stats = threadStats();
         while(true)
         {
+            stats.visit(n);
             if(n->isLeaf())
             {
-                (*blas)[n->blas]->mbvh.hit(r);
-                
-                if(stack.size() == 0)
+                intersectLeaf(n, r);
+                if(stackPtr == 0 || (anyHit && r.t < limit))
                     break;
 
-                n = stack.top();
-                stack.pop();
-                
+                n = stack[--stackPtr];
                 continue;
             }
 
@@ -125,8 +228,7 @@ public:
             tlasNode* child2 = &tlasNodes[n->leftRight >> 16];
 
             float hit1, hit2;
-            hit1 = child1->bounds.hit(r);
-            hit2 = child2->bounds.hit(r);
+            aabb::hit2(child1->bounds, child2->bounds, r, hit1, hit2);
             
             if(hit1 > hit2)
             {
@@ -136,19 +238,341 @@ public:
 
             if(hit1 == infinity)
             {
-                if(stack.size() == 0)
+                if(stackPtr == 0)
                     break;
 
-                n = stack.top();
-                stack.pop();
+                n = stack[--stackPtr];
             }
             else
             {
                 n = child1;
                 if(hit2 != infinity)
-                    stack.push(child2);
+                    stack[stackPtr++] = child2;
+            }
+        }
+    }
+
+    // Same walk as bvh::hitStackless, with the siblings found through the parent. It ends when it
+    // climbs back to root, so it works on any subtree.
+    void hitStackless(ray& r, bool anyHit, int root = 0)
+    {
+        float limit = r.t;
+        traversalStats& stats = threadStats();
+        stats.visit(&tlasNodes[root]);
+        if(tlasNodes[root].isLeaf())
+        {
+            intersectLeaf(&tlasNodes[root], r);
+            return;
+        }
+
+        enum { fromParent, fromSibling, fromChild } state = fromParent;
+        int current = nearChild(root, r);
+        while(true)
+        {
+            if(state == fromChild)
+            {
+                if(current == root)
+                    return;
+
+                int parent = parents[current];
+                if(current == nearChild(parent, r))
+                {
+                    current = sibling(current);
+                    state = fromSibling;
+                }
+                else
+                {
+                    current = parent;
+                    state = fromChild;
+                }
+                continue;
+            }
+
+            tlasNode* n = &tlasNodes[current];
+            stats.visit(n);
+            bool entered = n->bounds.hit(r) != infinity;
+            if(entered && !n->isLeaf())
+            {
+                current = nearChild(current, r);
+                state = fromParent;
+                continue;
+            }
+
+            if(entered)
+            {
+                intersectLeaf(n, r);
+                if(anyHit && r.t < limit)
+                    return;
+            }
+            if(state == fromParent)
+            {
+                current = sibling(current);
+                state = fromSibling;
+            }
+            else
+            {
+                current = parents[current];
+                state = fromChild;
+            }
+        }
+    }
+
+    void layoutDepthFirst(std::vector<tlasNode>& newNodes, int oldIdx, int newIdx, int& next)
+    {
+        tlasNode node = tlasNodes[oldIdx];
+        newNodes[newIdx] = node;
+        if(node.isLeaf())
+            return;
+
+        int first = node.leftRight & 0xffff;
+        int second = node.leftRight >> 16;
+        if(tlasNodes[second].bounds.area() > tlasNodes[first].bounds.area())
+            std::swap(first, second);
+
+        int pair = next;
+        next += 2;
+        newNodes[newIdx].leftRight = pair + ((pair + 1) << 16);
+
+        layoutDepthFirst(newNodes, first, pair, next);
+        layoutDepthFirst(newNodes, second, pair + 1, next);
+    }
+
+public:
+    // Set when the BLAS data lives in an out-of-core cache; the models then only hold their bounds
+    blasPager* pager = nullptr;
+    float lodTolerance = 0.5f;  // Error of a simplified level allowed per unit of ray footprint and bounce
+
+    tlas (){}
+
+    tlas (model* b, int N, sceneArena& arena) : blas(b), blasCount(N)
+    {
+        tlasNodes = arena.create<tlasNode>(2 * blasCount, arenaTag::tlasNodes);
+        build();
+        walk();
+        if(depth > traversalStackSize)
+            linkParents(arena);
+    }
+
+    static size_t memoryRequired(int N)
+    {
+        return 2 * N * (sizeof(tlasNode) + sizeof(int)) + sceneArena::slack(2);
+    }
+
+    // Switches to stackless traversal, see bvh::linkParents
+    void linkParents(sceneArena& arena)
+    {
+        if(parents || nodesUsed == 0)
+            return;
+        parents = arena.allocate<int>(nodesUsed, arenaTag::tlasNodes);
+        walk();
+    }
+
+    int nodeCount() const { return nodesUsed; }
+    int instanceCount() const { return blasCount; }
+    const model& instance(int i) const { return blas[i]; }
+    int treeDepth() const { return depth; }
+    bool stackless() const { return parents != nullptr; }
+
+    // Copy of the tree in arena over the models b, which must be copies of this tree's models
+    tlas clone(model* b, sceneArena& arena) const
+    {
+        tlas t = *this;
+        t.blas = b;
+        t.tlasNodes = arena.allocate<tlasNode>(nodesUsed, arenaTag::tlasNodes);
+        std::copy(tlasNodes, tlasNodes + nodesUsed, t.tlasNodes);
+        if(parents)
+        {
+            t.parents = arena.allocate<int>(nodesUsed, arenaTag::tlasNodes);
+            std::copy(parents, parents + nodesUsed, t.parents);
+        }
+        return t;
+    }
+
+    // Same depth first reordering as bvh::optimizeLayout. The build leaves the children of a node
+    // wherever the agglomerative clustering happened to put them, and a copy of the root behind.
+    // Slot 1 stays unused so every pair of 32 byte nodes shares a cache line.
+    void optimizeLayout()
+    {
+        if(blasCount < 2)
+            return;
+
+        std::vector<tlasNode> newNodes(nodesUsed);
+        int next = 2;
+        layoutDepthFirst(newNodes, 0, 0, next);
+        std::copy(newNodes.begin(), newNodes.begin() + next, tlasNodes);
+        nodesUsed = next;
+        walk();
+    }
+
+    hitRecord resolve(const ray& r) const
+    {
+        hitRecord rec{};
+        if(pager)
+        {
+            const blasPager::page& p = pager->acquire(r.instIdx);
+            blas[r.instIdx].resolveHit(r, rec, &p.mesh);
+            pager->release(r.instIdx);
+        }
+        else
+            blas[r.instIdx].resolveHit(r, rec, r.lod > 0 ? &blas[r.instIdx].lods[r.lod - 1].mesh : nullptr);
+        return rec;
+    }
+
+    void hit(ray& r)
+    {
+        threadStats().rays++;
+        if(parents)
+            hitStackless(r, false);
+        else
+            hitStack(r, false);
+    }
+
+    // Entry for rays from apex whose directions lie inside the pyramid spanned by the four corner
+    // directions, given in order around it. Nodes are culled against the pyramid's side planes.
+    tlasEntry cull(const point3& apex, const vec3 corners[4]) const
+    {
+        tlasEntry entry;
+        if(nodesUsed == 0)
+        {
+            entry.leafCount = 0;
+            return entry;
+        }
+
+        vec3 planes[4];
+        vec3 middle = corners[0] + corners[1] + corners[2] + corners[3];
+        for(int i = 0; i < 4; i++)
+        {
+            planes[i] = cross(corners[i], corners[(i + 1) % 4]);
+            if(dot(planes[i], middle) < 0.0f)
+                planes[i] = -planes[i];
+        }
+        auto inside = [&](int idx)
+        {
+            const aabb& b = tlasNodes[idx].bounds;
+            for(const vec3& n : planes)
+            {
+                point3 farthest{n.x() > 0.0f ? b.max().x() : b.min().x(), n.y() > 0.0f ? b.max().y() : b.min().y(),
+                                n.z() > 0.0f ? b.max().z() : b.min().z()};
+                if(dot(n, farthest - apex) < 0.0f)
+                    return false;
+            }
+            return true;
+        };
+
+        // Descend while only one child survives, that child's subtree holds every visible leaf
+        int root = 0;
+        if(!inside(0))
+        {
+            entry.leafCount = 0;
+            return entry;
+        }
+        while(!tlasNodes[root].isLeaf())
+        {
+            int a = tlasNodes[root].leftRight & 0xffff;
+            int b = tlasNodes[root].leftRight >> 16;
+            bool inA = inside(a), inB = inside(b);
+            if(inA && inB)
+                break;
+            if(!inA && !inB)
+            {
+                entry.leafCount = 0;
+                return entry;
             }
+            root = inA ? a : b;
         }
+        entry.root = root;
+
+        int stack[traversalStackSize];
+        int stackPtr = 0;
+        int count = 0;
+        stack[stackPtr++] = root;
+        while(stackPtr > 0)
+        {
+            int idx = stack[--stackPtr];
+            if(tlasNodes[idx].isLeaf())
+            {
+                if(count == tlasEntry::maxLeaves)
+                    return entry;
+                entry.leaves[count++] = idx;
+                continue;
+            }
+            for(int child : {tlasNodes[idx].leftRight & 0xffff, tlasNodes[idx].leftRight >> 16})
+            {
+                if(!inside(child))
+                    continue;
+                if(stackPtr == traversalStackSize)
+                    return entry;
+                stack[stackPtr++] = child;
+            }
+        }
+
+        // Nearest first, so the closest hits shorten the rays before the farther boxes are tested
+        auto distance = [&](int idx)
+        {
+            const aabb& b = tlasNodes[idx].bounds;
+            return (vmax(b.min(), vmin(apex, b.max())) - apex).squaredLength();
+        };
+        std::sort(entry.leaves, entry.leaves + count, [&](int a, int b) { return distance(a) < distance(b); });
+        entry.leafCount = count;
+        return entry;
+    }
+
+    // Closest hit of a ray inside the frustum entry was culled for
+    void hit(ray& r, const tlasEntry& entry)
+    {
+        traversalStats& stats = threadStats();
+        stats.rays++;
+        if(entry.leafCount < 0)
+        {
+            if(parents)
+                hitStackless(r, false, entry.root);
+            else
+                hitStack(r, false, entry.root);
+            return;
+        }
+
+        for(int i = 0; i < entry.leafCount; i++)
+        {
+            tlasNode* n = &tlasNodes[entry.leaves[i]];
+            stats.visit(n);
+            if(n->bounds.hit(r) != infinity)
+                intersectLeaf(n, r);
+        }
+    }
+
+    // Tests r against one triangle of one model only, with the model's alpha test, e.g. to confirm
+    // a hit found by rasterization. r keeps its t when it misses.
+    void hitTriangle(ray& r, int inst, int tri)
+    {
+        touchBlas(inst);
+        const model& m = blas[inst];
+        const indexedMesh& mesh = pager ? pager->acquire(inst).mesh : m.mesh;
+        float prevT = r.t;
+        if(m.alpha.active())
+            mesh.hitMasked(r, tri, m.alpha);
+        else
+            mesh.hit(r, tri);
+        if(pager)
+            pager->release(inst);
+        if(r.t < prevT)
+        {
+            r.instIdx = inst;
+            r.lod = 0;
+        }
+    }
+
+    // True when anything lies along r before its t, which the caller sets to the distance to test
+    bool occluded(ray& r)
+    {
+        traversalStats& stats = threadStats();
+        stats.rays++;
+        stats.shadowRays++;
+        float limit = r.t;
+        if(parents)
+            hitStackless(r, true);
+        else
+            hitStack(r, true);
+        return r.t < limit;
     }
 };
 
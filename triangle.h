@@ -12,46 +12,56 @@ class triangle
         vec3 p0 {};
         vec3 p1 {};
         vec3 p2 {};
-        vec3 cent {};
 
     public:
-        triangle(const vec3& a, const vec3& b, const vec3& c): p0{a}, p1{b}, p2{c}, cent{(a + b + c) * 0.33333f}{} 
+        triangle(const vec3& a, const vec3& b, const vec3& c): p0{a}, p1{b}, p2{c} {}
 
         const point3& v0() const { return p0; }
         const point3& v1() const { return p1; }
         const point3& v2() const { return p2; }
-        const point3& centroid() const { return cent; }
+        point3 centroid() const { return (p0 + p1 + p2) * 0.33333f; }
 
-        void hit(ray& r)
+        vec3 normal() const
+        {
+            return cross(p1 - p0, p2 - p0).normalize();
+        }
+
+        // Closest hit test without committing the hit, for the any-hit path
+        bool intersect(const ray& r, float& t, float& u, float& v) const
         {
             const vec3 e1 = p1 - p0;
             const vec3 e2 = p2 - p0;
 
-            const vec3 normal = cross(e1, e2).normalize();
-            if(dot(r.direction(), normal) > 0.0)
-                return;
-
+            // a = -dot(direction, e1 x e2), so a negative determinant is a back face
             const vec3 h = cross(r.direction(), e2);
             const float a = dot(h, e1);
-            if(a > -0.00001f && a < 0.00001f)
-                return;
+            if(a < 0.00001f)
+                return false;
             
             const float f = 1.0f / a;
             const vec3 s = r.origin() - p0;
-            const float u = f * dot(s, h);
+            u = f * dot(s, h);
             if(u < 0.0f || u > 1.0f)
-                return;
+                return false;
 
             const vec3 q = cross(s, e1);
-            const float v = f * dot(r.direction(), q);
+            v = f * dot(r.direction(), q);
             if(v < 0.0f || u + v > 1.0f)
-                return;
+                return false;
 
-            const float t = f * dot(e2, q);
-            if(t > 0.00001f && t < r.t)
+            t = f * dot(e2, q);
+            return t > 0.00001f && t < r.t;
+        }
+
+        void hit(ray& r, int primIdx)
+        {
+            float t, u, v;
+            if(intersect(r, t, u, v))
             {
                 r.t = t;
-                r.normal = normal;
+                r.u = u;
+                r.v = v;
+                r.primIdx = primIdx;
             }
         }
 
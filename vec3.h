@@ -3,6 +3,11 @@
 
 #include "utilities.h"
 
+#include <algorithm>
+#include <sstream>
+#include <string>
+#include <type_traits>
+
 class vec3 {
     private:
         float e[3] {};
@@ -10,7 +15,6 @@ class vec3 {
     public:
         vec3(){}
         vec3(float  x) : e {x,x,x} {}
-        vec3(const vec3& v) : e{v.x(), v.y(), v.z()}{};
         vec3(float x, float y, float z): e {x, y ,z}{};
 
         // For vector semnatics 
@@ -89,6 +93,9 @@ class vec3 {
         static vec3 negInf() {return vec3{-infinity, -infinity, -infinity};}
 };
 
+// Must stay trivially copyable so vec3 arrays can be memcpy'd and loaded straight into SIMD registers
+static_assert(std::is_trivially_copyable<vec3>::value, "vec3 must be trivially copyable");
+
 // point alias for semantics
 using point3 = vec3;
 
@@ -172,11 +179,23 @@ inline vec3 randomVectorOnHemisphere(const vec3& normal)
 
 inline vec3 vmin(const vec3& a, const vec3& b)
 {
-    return vec3{fminf(a.x(), b.x()), fminf(a.y(), b.y()), fminf(a.z(), b.z())};
+    return vec3{std::min(a.x(), b.x()), std::min(a.y(), b.y()), std::min(a.z(), b.z())};
 }
 
 inline vec3 vmax(const vec3& a, const vec3& b)
 {
-    return vec3{fmaxf(a.x(), b.x()), fmaxf(a.y(), b.y()), fmaxf(a.z(), b.z())};
+    return vec3{std::max(a.x(), b.x()), std::max(a.y(), b.y()), std::max(a.z(), b.z())};
+}
+
+// Parses x,y,z
+inline bool parseVec3(const std::string& text, vec3& v)
+{
+    float x, y, z;
+    char c1, c2;
+    std::istringstream in(text);
+    if(!(in >> x >> c1 >> y >> c2 >> z) || c1 != ',' || c2 != ',')
+        return false;
+    v = vec3{x, y, z};
+    return true;
 }
 #endif